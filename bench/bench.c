@@ -0,0 +1,216 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Most options a mode passes before the pattern and file
+#define MAX_MODE_ARGS 4
+
+/**
+ * One way of running grep over every corpus
+ */
+typedef struct
+{
+    const char *name;
+    const char *args[MAX_MODE_ARGS];  // options and pattern, NULL terminated
+} bench_mode;
+
+static const bench_mode modes[] = {
+    {"literal", {"needle token", NULL}},
+    {"ignore-case", {"-i", "NEEDLE TOKEN", NULL}},
+    {"wildcard", {"-w", "*needle*token*", NULL}},
+    {"anchored", {"-a", "^needle token", NULL}},
+    {"count", {"-c", "needle token", NULL}},
+    {"invert", {"-v", "needle token", NULL}},
+};
+
+/**
+ * Outcome of one run
+ */
+typedef struct
+{
+    double seconds;
+    long peak_rss_kb;
+    int status;  // exit status, -1 if grep did not exit normally
+} run_result;
+
+/**
+ * Run grep once with its output discarded, timing it from fork to exit
+ */
+static bool run_once(const char *grep, const bench_mode *mode, const char *corpus, run_result *r)
+{
+    const char *argv[MAX_MODE_ARGS + 3];
+    size_t argc = 0;
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    int status;
+
+    argv[argc++] = grep;
+    for (size_t i = 0; mode->args[i] != NULL; i++)
+    {
+        argv[argc++] = mode->args[i];
+    }
+    argv[argc++] = corpus;
+    argv[argc] = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        return false;
+    }
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        execv(grep, (char *const *) argv);
+        _exit(127);
+    }
+
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    r->seconds = (double) (end.tv_sec - start.tv_sec)
+                 + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    r->peak_rss_kb = usage.ru_maxrss;
+    r->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return true;
+}
+
+/**
+ * Count the bytes and lines of a corpus once, up front
+ */
+static bool measure_corpus(const char *path, uint64_t *bytes, uint64_t *lines)
+{
+    FILE *file = fopen(path, "r");
+    char buf[64 * 1024];
+    size_t n;
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    *bytes = 0;
+    *lines = 0;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+    {
+        *bytes += n;
+        for (const char *p = buf; (p = memchr(p, '\n', (size_t) (buf + n - p))) != NULL; p++)
+        {
+            (*lines)++;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+/**
+ * Name of a corpus without its directory and extension
+ */
+static void corpus_name(const char *path, char *name, size_t size)
+{
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+
+    const char *dot = strrchr(base, '.');
+    size_t len = dot != NULL ? (size_t) (dot - base) : strlen(base);
+    len = len < size - 1 ? len : size - 1;
+
+    memcpy(name, base, len);
+    name[len] = '\0';
+}
+
+/**
+ * Run every mode over every corpus and print one JSON object per line
+ * Each result is the fastest of runs repetitions, the peak RSS the largest.
+ * Usage: bench <grep> <runs> <corpus>...
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <grep> <runs> <corpus>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *grep = argv[1];
+    int runs = atoi(argv[2]);
+    if (runs < 1)
+    {
+        fprintf(stderr, "Error: Invalid number of runs '%s'\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    for (int c = 3; c < argc; c++)
+    {
+        uint64_t bytes;
+        uint64_t lines;
+        char name[256];
+
+        if (!measure_corpus(argv[c], &bytes, &lines))
+        {
+            fprintf(stderr, "Error: Cannot read corpus '%s'\n", argv[c]);
+            return EXIT_FAILURE;
+        }
+        corpus_name(argv[c], name, sizeof(name));
+
+        for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++)
+        {
+            run_result best = {0, 0, 0};
+
+            for (int i = 0; i < runs; i++)
+            {
+                run_result r;
+
+                if (!run_once(grep, &modes[m], argv[c], &r))
+                {
+                    fprintf(stderr, "Error: Cannot run '%s'\n", grep);
+                    return EXIT_FAILURE;
+                }
+
+                if (i == 0 || r.seconds < best.seconds)
+                {
+                    best.seconds = r.seconds;
+                }
+                if (r.peak_rss_kb > best.peak_rss_kb)
+                {
+                    best.peak_rss_kb = r.peak_rss_kb;
+                }
+                best.status = r.status;
+            }
+
+            // Exit status 2 and above, or a crash, means the run itself failed
+            printf("{\"corpus\":\"%s\",\"mode\":\"%s\",\"bytes\":%llu,\"lines\":%llu,"
+                   "\"seconds\":%.6f,\"gb_per_s\":%.3f,\"lines_per_s\":%.0f,"
+                   "\"peak_rss_kb\":%ld,\"status\":%d}\n",
+                   name,
+                   modes[m].name,
+                   (unsigned long long) bytes,
+                   (unsigned long long) lines,
+                   best.seconds,
+                   (double) bytes / best.seconds / 1e9,
+                   (double) lines / best.seconds,
+                   best.peak_rss_kb,
+                   best.status);
+            fflush(stdout);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// The text the benchmark patterns look for
+#define MARKER "needle token"
+
+/**
+ * One synthetic corpus: how long its lines are, how often they match, and their case
+ */
+typedef struct
+{
+    const char *name;
+    size_t line_len;    // average line length, actual lengths spread from half to one and a half
+    unsigned density;   // one line in this many holds the marker
+    bool mixed_case;    // letters are randomly upper-cased, the marker included
+} corpus_spec;
+
+static const corpus_spec corpora[] = {
+    {"short-rare", 40, 10000, false},
+    {"short-dense", 40, 10, false},
+    {"long-rare", 400, 10000, false},
+    {"long-dense", 400, 10, false},
+    {"mixed-case", 120, 100, true},
+};
+
+static const char *const words[] = {
+    "connection", "request", "timeout",  "user",   "session", "error", "warning", "info",
+    "debug",      "host",    "response", "server", "client",  "retry", "closed",  "opened",
+    "value",      "id",      "status",   "queue",  "worker",  "cache", "miss",    "hit",
+};
+
+/**
+ * xorshift64, seeded per corpus so every run writes the same bytes
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Append text to the line, upper-casing letters at random for mixed-case corpora
+ */
+static void put_text(FILE *file, const char *text, bool mixed_case, uint64_t *state)
+{
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        bool upper = mixed_case && *c >= 'a' && *c <= 'z' && next_random(state) % 3 == 0;
+        fputc(upper ? *c - 'a' + 'A' : *c, file);
+    }
+}
+
+/**
+ * Write about size bytes of lines following spec to path
+ */
+static bool write_corpus(const corpus_spec *spec, const char *path, size_t size, uint64_t seed)
+{
+    FILE *file = fopen(path, "w");
+    uint64_t state = seed;
+    size_t written = 0;
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    while (written < size)
+    {
+        size_t target = spec->line_len / 2 + next_random(&state) % (spec->line_len + 1);
+        bool match = next_random(&state) % spec->density == 0;
+        bool at_start = match && next_random(&state) % 2 == 0;
+        size_t len = 0;
+
+        // Half of the matching lines start with the marker, so -a has lines to find
+        if (at_start)
+        {
+            put_text(file, MARKER, spec->mixed_case, &state);
+            len += strlen(MARKER);
+        }
+
+        while (len < target)
+        {
+            const char *word = words[next_random(&state) % (sizeof(words) / sizeof(*words))];
+
+            if (len > 0)
+            {
+                fputc(' ', file);
+                len++;
+            }
+            put_text(file, word, spec->mixed_case, &state);
+            len += strlen(word);
+
+            if (match && !at_start && len >= target / 2)
+            {
+                fputc(' ', file);
+                put_text(file, MARKER, spec->mixed_case, &state);
+                len += strlen(MARKER) + 1;
+                match = false;
+            }
+        }
+
+        fputc('\n', file);
+        written += len + 1;
+    }
+
+    return fclose(file) == 0;
+}
+
+/**
+ * Generate the benchmark corpora
+ * Usage: corpus <directory> <MiB per corpus>
+ */
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <directory> <MiB per corpus>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *end;
+    unsigned long mib = strtoul(argv[2], &end, 10);
+    if (*argv[2] == '\0' || *end != '\0' || mib == 0)
+    {
+        fprintf(stderr, "Error: Invalid corpus size '%s'\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    if (mkdir(argv[1], 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: Cannot create directory '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof(corpora) / sizeof(*corpora); i++)
+    {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.txt", argv[1], corpora[i].name);
+
+        if (!write_corpus(&corpora[i], path, (size_t) mib << 20, 0x9e3779b97f4a7c15ull + i))
+        {
+            fprintf(stderr, "Error: Cannot write corpus '%s'\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
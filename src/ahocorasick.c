@@ -0,0 +1,258 @@
+#include "ahocorasick.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+
+// Marks a trie edge that does not exist yet while building
+#define NO_STATE UINT32_MAX
+
+/**
+ * Grow the state tables so that at least count states fit
+ */
+static bool reserve_states(ac_automaton *ac, size_t *cap, size_t count)
+{
+    if (count <= *cap)
+    {
+        return true;
+    }
+
+    size_t grown = *cap > 0 ? *cap : 64;
+    while (grown < count)
+    {
+        grown *= 2;
+    }
+
+    uint32_t *next = realloc(ac->next, grown * ac->class_count * sizeof(*next));
+    if (next == NULL)
+    {
+        return false;
+    }
+    ac->next = next;
+
+    uint8_t *accept = realloc(ac->accept, grown);
+    if (accept == NULL)
+    {
+        return false;
+    }
+    ac->accept = accept;
+
+    *cap = grown;
+    return true;
+}
+
+/**
+ * Append a state with no edges, returns its number or NO_STATE if memory runs out
+ */
+static uint32_t add_state(ac_automaton *ac, size_t *cap)
+{
+    if (ac->state_count >= NO_STATE || !reserve_states(ac, cap, ac->state_count + 1))
+    {
+        return NO_STATE;
+    }
+
+    uint32_t state = (uint32_t) ac->state_count++;
+    uint32_t *row = ac->next + (size_t) state * ac->class_count;
+
+    for (size_t c = 0; c < ac->class_count; c++)
+    {
+        row[c] = NO_STATE;
+    }
+    ac->accept[state] = 0;
+    return state;
+}
+
+/**
+ * Number the byte classes, class 0 collects every byte no literal contains
+ * If the literals use all 256 byte values, the last new one simply ends up alone in class 0.
+ */
+static void build_classes(ac_automaton *ac,
+                          const char *const *texts,
+                          const size_t *lens,
+                          size_t count,
+                          bool fold)
+{
+    memset(ac->classes, 0, sizeof(ac->classes));
+    ac->class_count = 1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t j = 0; j < lens[i]; j++)
+        {
+            unsigned char c = (unsigned char) texts[i][j];
+
+            if (ac->classes[c] == 0 && ac->class_count < 256)
+            {
+                ac->classes[c] = (uint8_t) ac->class_count++;
+            }
+        }
+    }
+
+    // Upper-case letters share the class of their lower-case form
+    if (fold)
+    {
+        for (unsigned b = 'A'; b <= 'Z'; b++)
+        {
+            ac->classes[b] = ac->classes[scan_fold_table[b]];
+        }
+    }
+}
+
+bool ac_build(ac_automaton *ac,
+              const char *const *texts,
+              const size_t *lens,
+              size_t count,
+              bool fold)
+{
+    size_t cap = 0;
+    uint32_t *fail = NULL;
+    uint32_t *queue = NULL;
+
+    memset(ac, 0, sizeof(*ac));
+    build_classes(ac, texts, lens, count, fold);
+
+    if (add_state(ac, &cap) == NO_STATE)
+    {
+        goto out_of_memory;
+    }
+
+    // Build the trie
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t state = 0;
+
+        if (lens[i] == 0)
+        {
+            ac->matches_empty = true;
+            continue;
+        }
+
+        for (size_t j = 0; j < lens[i]; j++)
+        {
+            size_t c = ac->classes[(unsigned char) texts[i][j]];
+            uint32_t target = ac->next[(size_t) state * ac->class_count + c];
+
+            if (target == NO_STATE)
+            {
+                target = add_state(ac, &cap);
+                if (target == NO_STATE)
+                {
+                    goto out_of_memory;
+                }
+                ac->next[(size_t) state * ac->class_count + c] = target;
+            }
+            state = target;
+        }
+        ac->accept[state] = 1;
+    }
+
+    fail = malloc(ac->state_count * sizeof(*fail));
+    queue = malloc(ac->state_count * sizeof(*queue));
+    if (fail == NULL || queue == NULL)
+    {
+        goto out_of_memory;
+    }
+
+    // Breadth-first over the trie, filling every missing edge from the failure state's row
+    size_t head = 0;
+    size_t tail = 0;
+    uint32_t *root = ac->next;
+
+    for (size_t c = 0; c < ac->class_count; c++)
+    {
+        if (root[c] == NO_STATE)
+        {
+            root[c] = 0;
+        }
+        else
+        {
+            fail[root[c]] = 0;
+            queue[tail++] = root[c];
+        }
+    }
+
+    while (head < tail)
+    {
+        uint32_t state = queue[head++];
+        uint32_t *row = ac->next + (size_t) state * ac->class_count;
+        const uint32_t *fail_row = ac->next + (size_t) fail[state] * ac->class_count;
+
+        // A literal that ends at the failure state also ends here
+        ac->accept[state] |= ac->accept[fail[state]];
+
+        for (size_t c = 0; c < ac->class_count; c++)
+        {
+            if (row[c] == NO_STATE)
+            {
+                row[c] = fail_row[c];
+            }
+            else
+            {
+                fail[row[c]] = fail_row[c];
+                queue[tail++] = row[c];
+            }
+        }
+    }
+
+    for (unsigned b = 0; b < 256; b++)
+    {
+        ac->root_skip[b] = root[ac->classes[b]] != 0;
+    }
+
+    free(fail);
+    free(queue);
+    return true;
+
+out_of_memory:
+    free(fail);
+    free(queue);
+    ac_free(ac);
+    return false;
+}
+
+const char *ac_find(const ac_automaton *ac, const char *data, size_t len)
+{
+    const unsigned char *pos = (const unsigned char *) data;
+    const unsigned char *end = pos + len;
+    uint32_t state = 0;
+
+    if (ac->matches_empty)
+    {
+        return len > 0 ? data : NULL;
+    }
+
+    while (pos < end)
+    {
+        // In the root state most bytes lead nowhere, skip them without touching the table
+        if (state == 0)
+        {
+            while (pos < end && !ac->root_skip[*pos])
+            {
+                pos++;
+            }
+            if (pos == end)
+            {
+                break;
+            }
+        }
+
+        state = ac->next[(size_t) state * ac->class_count + ac->classes[*pos]];
+        if (ac->accept[state])
+        {
+            return (const char *) pos;
+        }
+        pos++;
+    }
+
+    return NULL;
+}
+
+void ac_free(ac_automaton *ac)
+{
+    free(ac->next);
+    free(ac->accept);
+    ac->next = NULL;
+    ac->accept = NULL;
+    ac->state_count = 0;
+}
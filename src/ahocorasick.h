@@ -0,0 +1,46 @@
+#ifndef AHOCORASICK_H
+#define AHOCORASICK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Aho-Corasick automaton over a set of literals, searched in one pass over the input
+ * Bytes are first mapped to equivalence classes (every byte no literal uses shares one class),
+ * and the automaton is stored as a complete DFA: one flat row of next states per state, so each
+ * input byte costs two table loads and no failure-link chasing.
+ */
+typedef struct
+{
+    uint8_t classes[256];  // byte to equivalence class
+    size_t class_count;
+    uint32_t *next;      // state * class_count + class, the next state
+    uint8_t *accept;     // per state, non-zero if some literal ends here
+    uint8_t root_skip[256];  // non-zero for bytes that leave the root state
+    size_t state_count;
+    bool matches_empty;  // the set contains the empty literal
+} ac_automaton;
+
+/**
+ * Build the automaton for count literals, under fold they must already be lower-cased and
+ * are matched case-insensitively. Returns false if memory runs out.
+ */
+bool ac_build(ac_automaton *ac,
+              const char *const *texts,
+              const size_t *lens,
+              size_t count,
+              bool fold);
+
+/**
+ * Find the end of the first literal occurrence in the len bytes at data
+ * Returns a pointer to the last byte of the match, or NULL if there is none.
+ */
+const char *ac_find(const ac_automaton *ac, const char *data, size_t len);
+
+/**
+ * Release the automaton tables
+ */
+void ac_free(ac_automaton *ac);
+
+#endif
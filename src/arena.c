@@ -0,0 +1,170 @@
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+struct arena_block
+{
+    arena_block *prev;
+    size_t cap;
+    size_t used;
+    max_align_t data[];
+};
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Allocate a block with room for cap bytes after the one before it
+ */
+static arena_block *new_block(arena_block *prev, size_t cap)
+{
+    arena_block *block = malloc(sizeof(*block) + cap);
+
+    if (block != NULL)
+    {
+        block->prev = prev;
+        block->cap = cap;
+        block->used = 0;
+    }
+    return block;
+}
+
+static void free_arena(void *arg)
+{
+    arena *a = arg;
+
+    while (a->block != NULL)
+    {
+        arena_block *prev = a->block->prev;
+        free(a->block);
+        a->block = prev;
+    }
+    free(a);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&arena_key, free_arena);
+}
+
+arena *arena_thread(void)
+{
+    pthread_once(&arena_once, create_key);
+
+    arena *a = pthread_getspecific(arena_key);
+    if (a != NULL)
+    {
+        return a;
+    }
+
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+    {
+        return NULL;
+    }
+
+    a->block = new_block(NULL, ARENA_BLOCK_SIZE);
+    if (a->block == NULL || pthread_setspecific(arena_key, a) != 0)
+    {
+        free(a->block);
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+/**
+ * Round a size up so the next allocation stays aligned
+ */
+static size_t aligned_size(size_t size)
+{
+    size_t align = alignof(max_align_t);
+    return (size + align - 1) & ~(align - 1);
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+    size = aligned_size(size);
+
+    if (a->block->cap - a->block->used < size)
+    {
+        // Each new block at least doubles, a file with huge lines takes few of them
+        size_t cap = a->block->cap * 2;
+        arena_block *block = new_block(a->block, cap > size ? cap : size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        a->block = block;
+    }
+
+    void *ptr = (char *) a->block->data + a->block->used;
+    a->block->used += size;
+    a->in_use += size;
+    a->peak = a->in_use > a->peak ? a->in_use : a->peak;
+    return ptr;
+}
+
+void *arena_grow(arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+    arena_block *block = a->block;
+    size_t old_aligned = aligned_size(old_size);
+    size_t new_aligned = aligned_size(new_size);
+
+    // The last allocation of the block just moves its end
+    if ((char *) ptr + old_aligned == (char *) block->data + block->used
+        && new_aligned - old_aligned <= block->cap - block->used)
+    {
+        block->used += new_aligned - old_aligned;
+        a->in_use += new_aligned - old_aligned;
+        a->peak = a->in_use > a->peak ? a->in_use : a->peak;
+        return ptr;
+    }
+
+    void *grown = arena_alloc(a, new_size);
+    if (grown != NULL)
+    {
+        memcpy(grown, ptr, old_size);
+    }
+    return grown;
+}
+
+arena_mark arena_save(arena *a)
+{
+    arena_mark mark = {a->block, a->block->used, a->in_use};
+
+    a->marks++;
+    return mark;
+}
+
+void arena_release(arena *a, arena_mark mark)
+{
+    while (a->block != mark.block)
+    {
+        arena_block *prev = a->block->prev;
+        free(a->block);
+        a->block = prev;
+    }
+    a->block->used = mark.used;
+    a->in_use = mark.in_use;
+    a->marks--;
+
+    // Empty again with no outer mark left pointing at the first block, one block big enough for
+    // the largest file so far replaces it
+    if (a->marks == 0 && a->in_use == 0 && a->block->cap < a->peak)
+    {
+        arena_block *block = new_block(NULL, a->peak);
+        if (block != NULL)
+        {
+            free(a->block);
+            a->block = block;
+        }
+    }
+
+    STATS_MAX(scratch_peak, a->peak);
+}
@@ -0,0 +1,64 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// First block of every thread's arena, room for a stream buffer and what goes with it
+#define ARENA_BLOCK_SIZE (512 * 1024)
+
+typedef struct arena_block arena_block;
+
+/**
+ * Scratch memory for the search of one file, handed out by bumping a pointer
+ * Every thread has one, see arena_thread(). Allocations are taken back all at once by
+ * arena_release(), in the reverse order of the marks, so a file searched while another waits
+ * on the same thread only gives back its own. Once the last mark is released, an arena that
+ * needed more than its first block grows that block to its high-water mark, so the next file
+ * of the same kind takes no heap allocation at all.
+ */
+typedef struct
+{
+    arena_block *block;  // current block, the first one is never freed before the arena
+    size_t in_use;       // bytes handed out, over every block
+    size_t peak;         // high-water mark of in_use
+    size_t marks;        // marks saved and not released yet, the blocks they point to stay
+} arena;
+
+/**
+ * A point to release an arena back to
+ */
+typedef struct
+{
+    arena_block *block;
+    size_t used;
+    size_t in_use;
+} arena_mark;
+
+/**
+ * The calling thread's arena, created with its first block on first use and freed when the
+ * thread exits. Returns NULL if memory runs out, callers then use the heap.
+ */
+arena *arena_thread(void);
+
+/**
+ * Allocate size bytes aligned for any type, NULL if memory runs out
+ */
+void *arena_alloc(arena *a, size_t size);
+
+/**
+ * Resize an allocation, in place when it is the last one and the block has room, else by
+ * copying it to a new one; the old space is only taken back on release
+ */
+void *arena_grow(arena *a, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Remember the current point, for arena_release(), which every mark has to be given to
+ */
+arena_mark arena_save(arena *a);
+
+/**
+ * Take back everything allocated since mark, the latest mark not released yet
+ */
+void arena_release(arena *a, arena_mark mark);
+
+#endif
@@ -0,0 +1,328 @@
+#include "context.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+#include "stats.h"
+
+// First allocation of the ring, it doubles from there up to -B entries
+#define RING_INITIAL_CAP 16
+
+void context_init(context_window *w,
+                  output *out,
+                  const char *filename,
+                  grep_options opts,
+                  bool print_filename,
+                  arena *scratch)
+{
+    w->out = out;
+    w->filename = filename;
+    w->print_filename = print_filename;
+    w->line_number = opts.line_number;
+    w->byte_offset = opts.byte_offset;
+    w->before = opts.before_context;
+    w->after = opts.after_context;
+    w->scratch = scratch;
+    w->ring = NULL;
+    w->cap = 0;
+    w->start = 0;
+    w->count = 0;
+    w->after_left = 0;
+    w->last_printed = 0;
+    w->end = NULL;
+    w->end_offset = 0;
+}
+
+void context_free(context_window *w)
+{
+    if (w->scratch == NULL)
+    {
+        free(w->ring);
+    }
+    w->ring = NULL;
+    w->cap = 0;
+    w->count = 0;
+}
+
+size_t context_kept(const context_window *w)
+{
+    // The oldest entry reaches furthest back
+    return w->count > 0 ? w->ring[w->start].back : 0;
+}
+
+bool context_pending(const context_window *w)
+{
+    return w->after_left > 0;
+}
+
+/**
+ * Remember an unselected line for -B, forgetting the oldest once -B are remembered
+ * Should the ring fail to grow the oldest entry makes room instead.
+ */
+static void ring_push(context_window *w, size_t back, size_t len, size_t line_number)
+{
+    if (w->count == w->cap && w->cap < w->before)
+    {
+        size_t cap = w->cap > 0 ? w->cap * 2 : RING_INITIAL_CAP;
+        cap = cap < w->before ? cap : w->before;
+
+        context_line *ring = w->scratch != NULL ? arena_alloc(w->scratch, cap * sizeof(*ring))
+                                                : malloc(cap * sizeof(*ring));
+        if (ring != NULL)
+        {
+            for (size_t i = 0; i < w->count; i++)
+            {
+                ring[i] = w->ring[(w->start + i) % w->cap];
+            }
+            if (w->scratch == NULL)
+            {
+                free(w->ring);
+            }
+            w->ring = ring;
+            w->cap = cap;
+            w->start = 0;
+        }
+    }
+
+    if (w->cap == 0)
+    {
+        return;
+    }
+    if (w->count == w->cap)
+    {
+        w->start = (w->start + 1) % w->cap;
+        w->count--;
+    }
+
+    context_line *slot = &w->ring[(w->start + w->count) % w->cap];
+    slot->back = back;
+    slot->len = len;
+    slot->line_number = line_number;
+    w->count++;
+}
+
+/**
+ * Print one line, sep is ':' for selected lines and '-' for context
+ */
+static void print_line(context_window *w, size_t line_number, const char *line, size_t len, char sep)
+{
+    output *out = w->out;
+
+    // The previous group, of this file or an earlier one, does not reach this line
+    if (out->grouped && (w->last_printed == 0 || line_number != w->last_printed + 1))
+    {
+        output_bytes(out, "--\n", strlen("--\n"));
+    }
+
+    if (w->print_filename)
+    {
+        output_bytes(out, w->filename, strlen(w->filename));
+        output_char(out, sep);
+    }
+
+    if (w->line_number)
+    {
+        output_number(out, line_number);
+        output_char(out, sep);
+    }
+
+    // Remembered lines lie before the buffer, counting back from its end covers them too
+    if (w->byte_offset)
+    {
+        output_number(out, w->end_offset - (size_t) (w->end - line));
+        output_char(out, sep);
+    }
+
+    output_span(out, line, len);
+    output_char(out, '\n');
+
+    out->grouped = true;
+    w->last_printed = line_number;
+}
+
+/**
+ * Print a selected line after the remembered lines before it
+ */
+static void select_line(context_window *w,
+                        const char *end,
+                        size_t line_number,
+                        const char *line,
+                        size_t len)
+{
+    for (size_t i = 0; i < w->count; i++)
+    {
+        const context_line *before = &w->ring[(w->start + i) % w->cap];
+        print_line(w, before->line_number, end - before->back, before->len, '-');
+    }
+    w->start = 0;
+    w->count = 0;
+
+    print_line(w, line_number, line, len, ':');
+    w->after_left = w->after;
+}
+
+/**
+ * Print an unselected line as -A context, or remember it in case -B needs it
+ */
+static void skip_line(context_window *w,
+                      const char *end,
+                      size_t line_number,
+                      const char *line,
+                      size_t len)
+{
+    if (w->after_left > 0)
+    {
+        print_line(w, line_number, line, len, '-');
+        w->after_left--;
+    }
+    else if (w->before > 0)
+    {
+        ring_push(w, (size_t) (end - line), len, line_number);
+    }
+}
+
+/**
+ * Pass over the unselected lines of [pos, stop), which ends at a line start or the buffer end
+ * Past the -A lines of the last selected line only the last -B lines are looked at, found from
+ * the back, and the rest are just counted.
+ */
+static void skip_lines(context_window *w,
+                       const char *pos,
+                       const char *stop,
+                       const char *end,
+                       size_t *line_number)
+{
+    while (pos < stop && w->after_left > 0)
+    {
+        const char *line_end = memchr(pos, '\n', (size_t) (stop - pos));
+        line_end = line_end != NULL ? line_end : stop;
+        (*line_number)++;
+
+        skip_line(w, end, *line_number, pos, (size_t) (line_end - pos));
+        pos = line_end < stop ? line_end + 1 : stop;
+    }
+
+    if (pos == stop)
+    {
+        return;
+    }
+
+    size_t lines = scan_count_newlines(pos, (size_t) (stop - pos)) + (stop[-1] != '\n');
+    size_t keep = lines < w->before ? lines : w->before;
+    const char *first = stop;
+
+    for (size_t i = 0; i < keep; i++)
+    {
+        size_t span = (size_t) (first - pos);
+        span -= span > 0 && first[-1] == '\n';
+
+        const char *newline = memrchr(pos, '\n', span);
+        first = newline != NULL ? newline + 1 : pos;
+    }
+    *line_number += lines - keep;
+
+    while (first < stop)
+    {
+        const char *line_end = memchr(first, '\n', (size_t) (stop - first));
+        line_end = line_end != NULL ? line_end : stop;
+        (*line_number)++;
+
+        ring_push(w, (size_t) (end - first), (size_t) (line_end - first), *line_number);
+        first = line_end < stop ? line_end + 1 : stop;
+    }
+}
+
+size_t context_search(context_window *w,
+                      const compiled_pattern *pattern,
+                      const char *buf,
+                      size_t len,
+                      size_t offset,
+                      size_t *line_number,
+                      size_t limit,
+                      bool invert)
+{
+    const char *pos = buf;
+    const char *end = buf + len;
+    size_t match_count = 0;
+
+    w->end = end;
+    w->end_offset = offset + len;
+
+    if (STATS_ON())
+    {
+        STATS_ADD(lines_scanned, scan_count_newlines(buf, len) + (len > 0 && end[-1] != '\n'));
+    }
+
+    // Candidates can only be jumped between when the lines in between are not selected
+    bool jump = !invert && pattern_has_prefilter(pattern);
+
+    // Lines remembered from the previous buffer sit right in front of this one
+    for (size_t i = 0; i < w->count; i++)
+    {
+        w->ring[(w->start + i) % w->cap].back += len;
+    }
+
+    while (pos < end && match_count < limit)
+    {
+        const char *line_start = pos;
+        bool exact = false;
+
+        if (jump)
+        {
+            const char *hit = pattern_find_candidate(pattern, pos, (size_t) (end - pos));
+            if (hit == NULL)
+            {
+                skip_lines(w, pos, end, end, line_number);
+                pos = end;
+                break;
+            }
+            STATS_ADD(candidates, 1);
+
+            line_start = memrchr(pos, '\n', (size_t) (hit - pos));
+            line_start = line_start != NULL ? line_start + 1 : pos;
+            skip_lines(w, pos, line_start, end, line_number);
+            exact = pattern->prefilter_exact;
+        }
+
+        const char *line_end = memchr(line_start, '\n', (size_t) (end - line_start));
+        line_end = line_end != NULL ? line_end : end;
+        size_t line_len = (size_t) (line_end - line_start);
+        (*line_number)++;
+
+        bool match = exact || pattern_matches(pattern, line_start, line_len);
+        STATS_ADD(lines_tested, !exact);
+        STATS_ADD(matches, match);
+
+        if (match != invert)
+        {
+            select_line(w, end, *line_number, line_start, line_len);
+            match_count++;
+
+            // Once output is lost the rest of the buffer is not worth scanning
+            if (output_failed(w->out))
+            {
+                break;
+            }
+        }
+        else
+        {
+            skip_line(w, end, *line_number, line_start, line_len);
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    // Past the limit the lines that follow are context, whether they match or not
+    while (pos < end && w->after_left > 0)
+    {
+        const char *line_end = memchr(pos, '\n', (size_t) (end - pos));
+        line_end = line_end != NULL ? line_end : end;
+        (*line_number)++;
+
+        skip_line(w, end, *line_number, pos, (size_t) (line_end - pos));
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return match_count;
+}
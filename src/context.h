@@ -0,0 +1,91 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "grep.h"
+#include "output.h"
+#include "pattern.h"
+
+/**
+ * One unselected line that may still be printed as -B context
+ */
+typedef struct
+{
+    size_t back;  // distance from the start of the line to the end of the current buffer
+    size_t len;
+    size_t line_number;
+} context_line;
+
+/**
+ * The lines around the selected ones for -A, -B and -C, kept across the buffers of one file
+ * The last -B unselected lines are a ring of spans into the input, nothing is copied. Between
+ * two buffers of a stream the ring points into the tail of the first, which the caller keeps
+ * right in front of the second, see context_kept().
+ */
+typedef struct
+{
+    output *out;
+    const char *filename;
+    bool print_filename;
+    bool line_number;  // -n
+    bool byte_offset;  // -b
+    size_t before;     // -B
+    size_t after;      // -A
+    arena *scratch;  // where the ring lives, NULL for the heap
+    context_line *ring;
+    size_t cap;    // allocated entries, grows up to before
+    size_t start;  // oldest entry
+    size_t count;
+    size_t after_left;    // lines after the last selected one still to print
+    size_t last_printed;  // number of the last line printed, 0 before the first
+    const char *end;      // end of the current buffer
+    size_t end_offset;    // and where that is in the file
+} context_window;
+
+/**
+ * Prepare the window of one file, printed to out, its ring taken from scratch or, when that
+ * is NULL, the heap
+ */
+void context_init(context_window *w,
+                  output *out,
+                  const char *filename,
+                  grep_options opts,
+                  bool print_filename,
+                  arena *scratch);
+
+/**
+ * Free the ring, one from an arena is only given back when the arena is released
+ */
+void context_free(context_window *w);
+
+/**
+ * Bytes at the end of the last buffer the ring still points into, to keep for the next one
+ */
+size_t context_kept(const context_window *w);
+
+/**
+ * Check whether lines after the last selected one are still to be printed, the next buffer
+ * is needed for them even once the limit is reached
+ */
+bool context_pending(const context_window *w);
+
+/**
+ * Search a buffer like search_buffer() and print the selected lines with the lines around
+ * them, with "--" before each group that does not follow on from the last printed line
+ * offset is where the buffer starts in the file. *line_number is always kept up to date. Once
+ * limit lines are selected the lines after the last one are still printed, as context,
+ * without being tested.
+ */
+size_t context_search(context_window *w,
+                      const compiled_pattern *pattern,
+                      const char *buf,
+                      size_t len,
+                      size_t offset,
+                      size_t *line_number,
+                      size_t limit,
+                      bool invert);
+
+#endif
@@ -0,0 +1,532 @@
+#include "decompress.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+// Longest magic number looked at
+#define MAGIC_SIZE 4
+
+/**
+ * Compressed bytes read from the file but not yet fed to the decompressor
+ */
+typedef struct
+{
+    unsigned char data[DECODER_INPUT_SIZE];
+    size_t pos;
+    size_t len;
+    bool eof;
+} input_buffer;
+
+/**
+ * Decompression state of one input, only ever touched by the decoding thread after setup
+ */
+typedef struct
+{
+    input_buffer in;
+    bool in_frame;  // part of a gzip member or compressed frame has been read
+    size_t frames;  // members or frames decoded completely
+    z_stream zlib;
+    bool zlib_ready;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+} codec_state;
+
+/**
+ * Tell the format from the first bytes of the input
+ */
+static compression detect_format(const unsigned char *magic, size_t len)
+{
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    {
+        return COMPRESSION_GZIP;
+    }
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    {
+        return COMPRESSION_ZSTD;
+    }
+    if (len >= 4 && magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18)
+    {
+        return COMPRESSION_LZ4;
+    }
+
+    return COMPRESSION_NONE;
+}
+
+/**
+ * read() that retries interrupted calls, returns -1 on error
+ */
+static ssize_t read_retry(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    do
+    {
+        n = read(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+/**
+ * Read the next piece of compressed input once everything before it was fed
+ * Returns false on a read error, at the end of the input in->eof is set instead.
+ */
+static bool input_fill(decoder *d, input_buffer *in)
+{
+    // Bytes consumed while detecting the format are already at the front
+    if (in->pos < in->len)
+    {
+        return true;
+    }
+
+    ssize_t n = read_retry(d->fd, in->data, sizeof(in->data));
+    if (n < 0)
+    {
+        d->error = "read error";
+        return false;
+    }
+
+    in->pos = 0;
+    in->len = (size_t) n;
+    in->eof = n == 0;
+    return true;
+}
+
+/**
+ * Feed the decompressor once, appending what it writes to out at *produced
+ * Returns false if the data is corrupt.
+ */
+static bool decode_step(decoder *d, codec_state *st, char *out, size_t cap, size_t *produced)
+{
+    input_buffer *in = &st->in;
+
+    switch (d->format)
+    {
+    case COMPRESSION_NONE:
+    {
+        size_t n = in->len - in->pos < cap - *produced ? in->len - in->pos : cap - *produced;
+        memcpy(out + *produced, in->data + in->pos, n);
+        in->pos += n;
+        *produced += n;
+        return true;
+    }
+    case COMPRESSION_GZIP:
+    {
+        z_stream *z = &st->zlib;
+        z->next_in = in->data + in->pos;
+        z->avail_in = (uInt) (in->len - in->pos);
+        z->next_out = (Bytef *) out + *produced;
+        z->avail_out = (uInt) (cap - *produced);
+
+        int rc = inflate(z, Z_NO_FLUSH);
+        in->pos = in->len - z->avail_in;
+        *produced = cap - z->avail_out;
+
+        if (rc == Z_STREAM_END)
+        {
+            // Concatenated members just follow one another
+            st->in_frame = false;
+            st->frames++;
+            inflateReset(z);
+            return true;
+        }
+        if (rc == Z_BUF_ERROR)
+        {
+            // No progress possible without more input
+            return true;
+        }
+        if (rc != Z_OK)
+        {
+            // Like gzip, ignore trailing garbage after complete members
+            if (!st->in_frame && st->frames > 0)
+            {
+                in->pos = in->len;
+                in->eof = true;
+                return true;
+            }
+            d->error = "corrupt gzip data";
+            return false;
+        }
+        st->in_frame = true;
+        return true;
+    }
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+    {
+        ZSTD_inBuffer zin = {in->data, in->len, in->pos};
+        ZSTD_outBuffer zout = {out, cap, *produced};
+        bool progress;
+
+        size_t rc = ZSTD_decompressStream(st->zstd, &zout, &zin);
+        if (ZSTD_isError(rc))
+        {
+            d->error = "corrupt zstd data";
+            return false;
+        }
+        progress = zin.pos != in->pos || zout.pos != *produced;
+        in->pos = zin.pos;
+        *produced = zout.pos;
+
+        // Zero means a frame was decoded and flushed completely
+        if (progress)
+        {
+            st->in_frame = rc != 0;
+        }
+        return true;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case COMPRESSION_LZ4:
+    {
+        size_t dst_len = cap - *produced;
+        size_t src_len = in->len - in->pos;
+
+        size_t rc = LZ4F_decompress(
+            st->lz4, out + *produced, &dst_len, in->data + in->pos, &src_len, NULL);
+        if (LZ4F_isError(rc))
+        {
+            d->error = "corrupt lz4 data";
+            return false;
+        }
+        in->pos += src_len;
+        *produced += dst_len;
+
+        // Zero means a frame was decoded completely
+        if (src_len > 0 || dst_len > 0)
+        {
+            st->in_frame = rc != 0;
+        }
+        return true;
+    }
+#endif
+    default:
+        d->error = "unsupported compression format";
+        return false;
+    }
+}
+
+/**
+ * Decompress into one slot until it is full or the input ends, with *end set then
+ * Returns false on a read error or corrupt data.
+ */
+static bool decode_slot(decoder *d, char *out, size_t cap, size_t *len, bool *end)
+{
+    codec_state *st = d->codec;
+    size_t produced = 0;
+
+    while (produced < cap)
+    {
+        if (!input_fill(d, &st->in))
+        {
+            return false;
+        }
+
+        bool input_done = st->in.eof && st->in.pos == st->in.len;
+        size_t before = produced;
+
+        if (!decode_step(d, st, out, cap, &produced))
+        {
+            return false;
+        }
+
+        // The decompressor may still flush output held back, so stop only once it does not
+        if (input_done && produced == before)
+        {
+            if (st->in_frame)
+            {
+                d->error = "unexpected end of compressed data";
+                return false;
+            }
+            *end = true;
+            break;
+        }
+    }
+
+    *len = produced;
+    return true;
+}
+
+/**
+ * Decoding thread: fill free slots until the input ends, fails or the reader stops
+ */
+static void *decode_thread(void *arg)
+{
+    decoder *d = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&d->lock);
+        while (d->filled == DECODER_SLOTS && !d->stop)
+        {
+            pthread_cond_wait(&d->slot_freed, &d->lock);
+        }
+        bool stop = d->stop;
+        decoder_slot *slot = &d->slots[d->head];
+        pthread_mutex_unlock(&d->lock);
+
+        if (stop)
+        {
+            break;
+        }
+
+        // The slot is free, the reader does not look at it until it is published
+        size_t len = 0;
+        bool end = false;
+        bool ok = decode_slot(d, slot->data, DECODER_SLOT_SIZE, &len, &end);
+
+        pthread_mutex_lock(&d->lock);
+        if (len > 0)
+        {
+            slot->len = len;
+            d->head = (d->head + 1) % DECODER_SLOTS;
+            d->filled++;
+        }
+        d->done = !ok || end;
+        pthread_cond_broadcast(&d->slot_filled);
+        pthread_mutex_unlock(&d->lock);
+
+        if (!ok || end)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Set up the decompressor for the detected format, returns false if memory runs out
+ */
+static bool codec_init(decoder *d, codec_state *st)
+{
+    switch (d->format)
+    {
+    case COMPRESSION_GZIP:
+        // 16 selects the gzip wrapper alone, anything else after a member is garbage
+        st->zlib_ready = inflateInit2(&st->zlib, 15 + 16) == Z_OK;
+        return st->zlib_ready;
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        st->zstd = ZSTD_createDStream();
+        return st->zstd != NULL && !ZSTD_isError(ZSTD_initDStream(st->zstd));
+#endif
+#ifdef HAVE_LZ4
+    case COMPRESSION_LZ4:
+        return !LZ4F_isError(LZ4F_createDecompressionContext(&st->lz4, LZ4F_VERSION));
+#endif
+    default:
+        return true;
+    }
+}
+
+/**
+ * Release whatever codec_init() set up
+ */
+static void codec_free(codec_state *st)
+{
+    if (st->zlib_ready)
+    {
+        inflateEnd(&st->zlib);
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(st->zstd);
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_freeDecompressionContext(st->lz4);
+#endif
+    free(st);
+}
+
+/**
+ * Check that the format was built in, returns the reason when it was not
+ */
+static const char *format_missing(compression format)
+{
+#ifndef HAVE_ZSTD
+    if (format == COMPRESSION_ZSTD)
+    {
+        return "zstd support not built in, rebuild with WITH_ZSTD=1";
+    }
+#endif
+#ifndef HAVE_LZ4
+    if (format == COMPRESSION_LZ4)
+    {
+        return "lz4 support not built in, rebuild with WITH_LZ4=1";
+    }
+#endif
+    (void) format;
+    return NULL;
+}
+
+bool decoder_open(decoder *d, int fd, bool *started, const char **error)
+{
+    unsigned char magic[MAGIC_SIZE];
+    size_t magic_len = 0;
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    *started = false;
+    *error = NULL;
+    memset(d, 0, sizeof(*d));
+    d->fd = fd;
+
+    // Regular files are peeked at without moving the offset, streams cannot be
+    off_t base = regular ? lseek(fd, 0, SEEK_CUR) : 0;
+    while (magic_len < MAGIC_SIZE)
+    {
+        void *dst = magic + magic_len;
+        size_t want = MAGIC_SIZE - magic_len;
+        ssize_t n = regular ? pread(fd, dst, want, base + (off_t) magic_len)
+                            : read_retry(fd, dst, want);
+        if (n < 0)
+        {
+            *error = "read error";
+            return false;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        magic_len += (size_t) n;
+    }
+
+    d->format = detect_format(magic, magic_len);
+    if (regular && d->format == COMPRESSION_NONE)
+    {
+        return true;
+    }
+
+    *error = format_missing(d->format);
+    if (*error != NULL)
+    {
+        return false;
+    }
+
+    codec_state *codec = calloc(1, sizeof(*codec));
+    if (codec == NULL || !codec_init(d, codec))
+    {
+        *error = "out of memory";
+        if (codec != NULL)
+        {
+            codec_free(codec);
+        }
+        return false;
+    }
+    d->codec = codec;
+
+    // What the detection consumed is fed to the decompressor first
+    if (!regular)
+    {
+        memcpy(codec->in.data, magic, magic_len);
+        codec->in.len = magic_len;
+    }
+
+    for (size_t i = 0; i < DECODER_SLOTS; i++)
+    {
+        d->slots[i].data = malloc(DECODER_SLOT_SIZE);
+        if (d->slots[i].data == NULL)
+        {
+            *error = "out of memory";
+            decoder_close(d);
+            return false;
+        }
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->slot_filled, NULL);
+    pthread_cond_init(&d->slot_freed, NULL);
+
+    if (pthread_create(&d->thread, NULL, decode_thread, d) != 0)
+    {
+        *error = "cannot start decompression thread";
+        pthread_cond_destroy(&d->slot_freed);
+        pthread_cond_destroy(&d->slot_filled);
+        pthread_mutex_destroy(&d->lock);
+        decoder_close(d);
+        return false;
+    }
+
+    d->running = true;
+    *started = true;
+    return true;
+}
+
+ssize_t decoder_read(decoder *d, char *buf, size_t cap)
+{
+    pthread_mutex_lock(&d->lock);
+    while (d->filled == 0 && !d->done)
+    {
+        pthread_cond_wait(&d->slot_filled, &d->lock);
+    }
+    if (d->filled == 0)
+    {
+        ssize_t result = d->error != NULL ? -1 : 0;
+        pthread_mutex_unlock(&d->lock);
+        return result;
+    }
+    decoder_slot *slot = &d->slots[d->tail];
+    pthread_mutex_unlock(&d->lock);
+
+    // The thread leaves filled slots alone until they are handed back
+    size_t n = slot->len - d->offset < cap ? slot->len - d->offset : cap;
+    memcpy(buf, slot->data + d->offset, n);
+    d->offset += n;
+
+    if (d->offset == slot->len)
+    {
+        pthread_mutex_lock(&d->lock);
+        d->tail = (d->tail + 1) % DECODER_SLOTS;
+        d->filled--;
+        d->offset = 0;
+        pthread_cond_signal(&d->slot_freed);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    return (ssize_t) n;
+}
+
+void decoder_close(decoder *d)
+{
+    // Only a fully set up decoder has a thread to stop
+    if (d->running)
+    {
+        pthread_mutex_lock(&d->lock);
+        d->stop = true;
+        pthread_cond_signal(&d->slot_freed);
+        pthread_mutex_unlock(&d->lock);
+
+        pthread_join(d->thread, NULL);
+        pthread_cond_destroy(&d->slot_freed);
+        pthread_cond_destroy(&d->slot_filled);
+        pthread_mutex_destroy(&d->lock);
+        d->running = false;
+    }
+
+    for (size_t i = 0; i < DECODER_SLOTS; i++)
+    {
+        free(d->slots[i].data);
+        d->slots[i].data = NULL;
+    }
+    if (d->codec != NULL)
+    {
+        codec_free(d->codec);
+        d->codec = NULL;
+    }
+}
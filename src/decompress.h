@@ -0,0 +1,82 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Buffers of decompressed data between the decoding thread and the search
+#define DECODER_SLOTS     4
+#define DECODER_SLOT_SIZE (256 * 1024)
+
+// Compressed bytes read from the file at a time
+#define DECODER_INPUT_SIZE (64 * 1024)
+
+/**
+ * Formats recognized by their magic number, the last ones only when built in
+ */
+typedef enum
+{
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,  // needs WITH_ZSTD=1
+    COMPRESSION_LZ4,   // needs WITH_LZ4=1, the frame format lz4 writes
+} compression;
+
+/**
+ * One buffer of the ring
+ */
+typedef struct
+{
+    char *data;
+    size_t len;
+} decoder_slot;
+
+/**
+ * A compressed input decompressed on a thread of its own
+ * The thread fills the ring slots while the search reads the ones filled before, so
+ * decompression and matching overlap; it blocks once every slot waits to be read.
+ */
+typedef struct
+{
+    int fd;
+    compression format;
+    void *codec;  // decompression state, input buffer included
+    decoder_slot slots[DECODER_SLOTS];
+    size_t head;    // next slot the thread fills
+    size_t tail;    // slot being read
+    size_t filled;  // slots ready to be read
+    size_t offset;  // bytes of the tail slot already read
+    bool done;      // the thread has published its last slot
+    bool stop;      // the reader has gone away
+    const char *error;  // why decompression failed, NULL if it did not
+    pthread_mutex_t lock;
+    pthread_cond_t slot_filled;
+    pthread_cond_t slot_freed;
+    pthread_t thread;
+    bool running;  // the thread was started and not joined yet
+} decoder;
+
+/**
+ * Check whether the input behind fd is compressed and start decompressing it
+ * A regular file without a known magic number is left untouched, with *started false, so it
+ * can still be mapped. Any other input has its first bytes consumed and is passed through as
+ * it is when not compressed. Returns false on failure, with *error describing it; the reasons
+ * include a format that is recognized but not built in.
+ */
+bool decoder_open(decoder *d, int fd, bool *started, const char **error);
+
+/**
+ * Copy up to cap decompressed bytes to buf as read() would, blocking until some are ready
+ * Returns 0 at the end of the data and -1 when decompression failed, see d->error.
+ */
+ssize_t decoder_read(decoder *d, char *buf, size_t cap);
+
+/**
+ * Stop the decoding thread, even halfway through the input, and release everything
+ * The descriptor is left open.
+ */
+void decoder_close(decoder *d);
+
+#endif
@@ -0,0 +1,572 @@
+#include "fetch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Where a file is on its way to the search
+ */
+typedef enum
+{
+    SLOT_FREE,
+    SLOT_QUEUED,  // waiting for a fetch thread
+    SLOT_STAT,    // io_uring: statx in flight
+    SLOT_OPEN,    // io_uring: openat in flight
+    SLOT_READ,    // io_uring: read in flight
+    SLOT_DONE,
+} slot_state;
+
+/**
+ * One pending file and the buffer its first bytes are read into
+ */
+typedef struct
+{
+    fetched_file file;
+    char *buf;
+    slot_state state;
+#ifdef HAVE_IO_URING
+    struct statx stx;
+#endif
+} fetch_slot;
+
+#ifdef HAVE_IO_URING
+/**
+ * The submission and completion rings shared with the kernel
+ */
+typedef struct
+{
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;  // the same mapping as sq_ring on kernels that allow it
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned unsubmitted;  // queued entries the kernel has not been told about
+} uring;
+#endif
+
+struct fetcher
+{
+    fetch_slot slots[FETCH_DEPTH];
+    size_t head;   // oldest pending slot
+    size_t count;  // pending slots, only the searching thread touches head and count
+#ifdef HAVE_IO_URING
+    uring ring;
+    bool use_ring;
+#endif
+    pthread_t threads[FETCH_THREADS];
+    size_t thread_count;
+    size_t next;    // slot the next free thread takes
+    size_t queued;  // slots no thread has taken yet
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_queued;
+    pthread_cond_t slot_done;
+};
+
+/**
+ * Check whether reading size bytes from the start got the whole file
+ * Files that claim to be empty, like those in /proc, are left to the usual reading.
+ */
+static bool read_whole(uint64_t size, ssize_t n)
+{
+    return n > 0 && (uint64_t) n == size && n < FETCH_BUFFER_SIZE;
+}
+
+/**
+ * Stat, open and read a file on the calling thread
+ */
+static void fetch_sync(fetch_slot *slot)
+{
+    fetched_file *file = &slot->file;
+    struct stat st;
+    ssize_t n;
+
+    if (stat(file->name, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return;
+    }
+
+    file->fd = open(file->name, O_RDONLY);
+    if (file->fd < 0 || st.st_size == 0)
+    {
+        return;
+    }
+
+    do
+    {
+        n = pread(file->fd, slot->buf, FETCH_BUFFER_SIZE, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+    {
+        file->len = (size_t) n;
+        file->complete = read_whole((uint64_t) st.st_size, n);
+    }
+}
+
+/**
+ * Fetch thread: take queued slots in order and fetch them one at a time
+ */
+static void *fetch_thread(void *arg)
+{
+    fetcher *f = arg;
+
+    pthread_mutex_lock(&f->lock);
+    for (;;)
+    {
+        while (f->queued == 0 && !f->stop)
+        {
+            pthread_cond_wait(&f->slot_queued, &f->lock);
+        }
+        if (f->stop)
+        {
+            break;
+        }
+
+        fetch_slot *slot = &f->slots[f->next];
+        f->next = (f->next + 1) % FETCH_DEPTH;
+        f->queued--;
+        pthread_mutex_unlock(&f->lock);
+
+        fetch_sync(slot);
+
+        pthread_mutex_lock(&f->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&f->slot_done);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Unmap the rings and close the ring descriptor
+ */
+static void ring_free(uring *r)
+{
+    if (r->sqes != NULL)
+    {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+    {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring != NULL)
+    {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->fd);
+}
+
+/**
+ * Map one region of the ring, NULL on failure
+ */
+static void *ring_map(int fd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p != MAP_FAILED ? p : NULL;
+}
+
+/**
+ * Set up a ring with room for one request per slot
+ * Returns false when io_uring is missing or not allowed, seccomp filters often block it.
+ */
+static bool ring_setup(uring *r)
+{
+    struct io_uring_params params;
+
+    memset(r, 0, sizeof(*r));
+    memset(&params, 0, sizeof(params));
+
+    r->fd = (int) syscall(__NR_io_uring_setup, FETCH_DEPTH, &params);
+    if (r->fd < 0)
+    {
+        return false;
+    }
+
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        size_t size = r->sq_ring_size > r->cq_ring_size ? r->sq_ring_size : r->cq_ring_size;
+        r->sq_ring_size = size;
+        r->cq_ring_size = size;
+        r->sq_ring = ring_map(r->fd, size, IORING_OFF_SQ_RING);
+        r->cq_ring = r->sq_ring;
+    }
+    else
+    {
+        r->sq_ring = ring_map(r->fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+        r->cq_ring = ring_map(r->fd, r->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    r->sqes = ring_map(r->fd, r->sqes_size, IORING_OFF_SQES);
+
+    if (r->sq_ring == NULL || r->cq_ring == NULL || r->sqes == NULL)
+    {
+        ring_free(r);
+        return false;
+    }
+
+    char *sq = r->sq_ring;
+    char *cq = r->cq_ring;
+    r->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + params.sq_off.array);
+    r->cq_head = (unsigned *) (cq + params.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+/**
+ * Add a request to the submission ring, the kernel sees it at the next ring_enter
+ */
+static void ring_queue(uring *r, const struct io_uring_sqe *sqe)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+
+    r->sqes[index] = *sqe;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->unsubmitted++;
+}
+
+/**
+ * Submit the queued requests and wait for at least wait completions
+ */
+static bool ring_enter(uring *r, unsigned wait)
+{
+    for (;;)
+    {
+        long n = syscall(__NR_io_uring_enter,
+                         r->fd,
+                         r->unsubmitted,
+                         wait,
+                         wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                         NULL,
+                         0);
+        if (n >= 0)
+        {
+            r->unsubmitted -= (unsigned) n;
+            return true;
+        }
+        if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+/**
+ * Move a slot on to its next request once the previous one completed with res
+ */
+static void ring_advance(fetcher *f, fetch_slot *slot, int res)
+{
+    fetched_file *file = &slot->file;
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = (uint64_t) (slot - f->slots);
+
+    switch (slot->state)
+    {
+    case SLOT_STAT:
+        // Pipes and devices are never opened ahead, opening a FIFO could block for good
+        if (res < 0 || !S_ISREG(slot->stx.stx_mode))
+        {
+            slot->state = SLOT_DONE;
+            return;
+        }
+        sqe.opcode = IORING_OP_OPENAT;
+        sqe.fd = AT_FDCWD;
+        sqe.addr = (uint64_t) (uintptr_t) file->name;
+        sqe.open_flags = O_RDONLY;
+        slot->state = SLOT_OPEN;
+        break;
+    case SLOT_OPEN:
+        if (res < 0 || slot->stx.stx_size == 0)
+        {
+            file->fd = res < 0 ? -1 : res;
+            slot->state = SLOT_DONE;
+            return;
+        }
+        file->fd = res;
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = res;
+        sqe.addr = (uint64_t) (uintptr_t) slot->buf;
+        sqe.len = FETCH_BUFFER_SIZE;
+        sqe.off = 0;
+        slot->state = SLOT_READ;
+        break;
+    case SLOT_READ:
+        if (res > 0)
+        {
+            file->len = (size_t) res;
+            file->complete = read_whole(slot->stx.stx_size, res);
+        }
+        slot->state = SLOT_DONE;
+        return;
+    default:
+        return;
+    }
+
+    ring_queue(&f->ring, &sqe);
+}
+
+/**
+ * Handle every completion the kernel has posted
+ */
+static void ring_reap(fetcher *f)
+{
+    uring *r = &f->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        ring_advance(f, &f->slots[cqe->user_data], cqe->res);
+        head++;
+    }
+
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Give up on the ring, every slot still in flight is handed out as far as it got
+ */
+static void ring_fail(fetcher *f)
+{
+    ring_free(&f->ring);
+    f->use_ring = false;
+
+    for (size_t i = 0; i < FETCH_DEPTH; i++)
+    {
+        if (f->slots[i].state != SLOT_FREE)
+        {
+            f->slots[i].state = SLOT_DONE;
+        }
+    }
+}
+
+/**
+ * Submit what is queued, wait for completions if asked to, and advance the slots
+ * Requests queued by the completions are submitted right away so they never sit idle.
+ */
+static void ring_progress(fetcher *f, unsigned wait)
+{
+    if (!ring_enter(&f->ring, wait))
+    {
+        ring_fail(f);
+        return;
+    }
+
+    ring_reap(f);
+
+    if (f->ring.unsubmitted > 0 && !ring_enter(&f->ring, 0))
+    {
+        ring_fail(f);
+    }
+}
+
+/**
+ * Start fetching a slot with a statx request
+ */
+static void ring_start(fetcher *f, fetch_slot *slot)
+{
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = (uint64_t) (uintptr_t) slot->file.name;
+    sqe.len = STATX_TYPE | STATX_SIZE;
+    sqe.off = (uint64_t) (uintptr_t) &slot->stx;
+    sqe.user_data = (uint64_t) (slot - f->slots);
+
+    slot->state = SLOT_STAT;
+    ring_queue(&f->ring, &sqe);
+    ring_progress(f, 0);
+}
+#endif
+
+fetcher *fetch_create(void)
+{
+    fetcher *f = calloc(1, sizeof(*f));
+    if (f == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->slot_queued, NULL);
+    pthread_cond_init(&f->slot_done, NULL);
+
+    for (size_t i = 0; i < FETCH_DEPTH; i++)
+    {
+        f->slots[i].buf = malloc(FETCH_BUFFER_SIZE);
+        if (f->slots[i].buf == NULL)
+        {
+            fetch_destroy(f);
+            return NULL;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    f->use_ring = ring_setup(&f->ring);
+    if (f->use_ring)
+    {
+        return f;
+    }
+#endif
+
+    // Without threads every file is fetched when it is pushed, which still works
+    while (f->thread_count < FETCH_THREADS
+           && pthread_create(&f->threads[f->thread_count], NULL, fetch_thread, f) == 0)
+    {
+        f->thread_count++;
+    }
+
+    return f;
+}
+
+size_t fetch_pending(const fetcher *f)
+{
+    return f->count;
+}
+
+void fetch_push(fetcher *f, const char *name, void *arg)
+{
+    fetch_slot *slot = &f->slots[(f->head + f->count) % FETCH_DEPTH];
+
+    f->count++;
+    slot->file.name = name;
+    slot->file.arg = arg;
+    slot->file.fd = -1;
+    slot->file.data = slot->buf;
+    slot->file.len = 0;
+    slot->file.complete = false;
+
+#ifdef HAVE_IO_URING
+    if (f->use_ring)
+    {
+        ring_start(f, slot);
+        return;
+    }
+#endif
+
+    if (f->thread_count == 0)
+    {
+        fetch_sync(slot);
+        slot->state = SLOT_DONE;
+        return;
+    }
+
+    pthread_mutex_lock(&f->lock);
+    slot->state = SLOT_QUEUED;
+    f->queued++;
+    pthread_cond_signal(&f->slot_queued);
+    pthread_mutex_unlock(&f->lock);
+}
+
+void fetch_pop(fetcher *f, fetched_file *file)
+{
+    fetch_slot *slot = &f->slots[f->head];
+
+#ifdef HAVE_IO_URING
+    while (f->use_ring && slot->state != SLOT_DONE)
+    {
+        ring_progress(f, 1);
+    }
+#endif
+
+    pthread_mutex_lock(&f->lock);
+
+    // No thread got to it yet, fetching it here beats waiting for one
+    if (slot->state == SLOT_QUEUED && f->next == f->head)
+    {
+        f->next = (f->next + 1) % FETCH_DEPTH;
+        f->queued--;
+        pthread_mutex_unlock(&f->lock);
+
+        fetch_sync(slot);
+
+        pthread_mutex_lock(&f->lock);
+        slot->state = SLOT_DONE;
+    }
+
+    while (slot->state != SLOT_DONE)
+    {
+        pthread_cond_wait(&f->slot_done, &f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    *file = slot->file;
+}
+
+void fetch_release(fetcher *f)
+{
+    f->slots[f->head].state = SLOT_FREE;
+    f->head = (f->head + 1) % FETCH_DEPTH;
+    f->count--;
+}
+
+void fetch_destroy(fetcher *f)
+{
+    if (f->thread_count > 0)
+    {
+        pthread_mutex_lock(&f->lock);
+        f->stop = true;
+        pthread_cond_broadcast(&f->slot_queued);
+        pthread_mutex_unlock(&f->lock);
+
+        for (size_t i = 0; i < f->thread_count; i++)
+        {
+            pthread_join(f->threads[i], NULL);
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (f->use_ring)
+    {
+        ring_free(&f->ring);
+    }
+#endif
+
+    for (size_t i = 0; i < FETCH_DEPTH; i++)
+    {
+        free(f->slots[i].buf);
+    }
+
+    pthread_cond_destroy(&f->slot_done);
+    pthread_cond_destroy(&f->slot_queued);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
@@ -0,0 +1,66 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Files kept in flight at once
+#define FETCH_DEPTH 32
+
+// Bytes read ahead of every file, files smaller than this arrive whole
+#define FETCH_BUFFER_SIZE (128 * 1024)
+
+// Threads opening and reading files when io_uring is not available
+#define FETCH_THREADS 8
+
+/**
+ * A file opened and read ahead of its search
+ * Only regular files are opened ahead, anything else, or a file that failed to open, comes
+ * back with fd at -1 and is searched by name as usual. A failed read only leaves data empty.
+ */
+typedef struct
+{
+    const char *name;
+    void *arg;  // given to fetch_push, handed back untouched
+    int fd;     // open at offset 0, owned by whoever pops the file
+    const char *data;  // the first bytes of the file
+    size_t len;
+    bool complete;  // data holds the whole file, there is nothing left to read
+} fetched_file;
+
+typedef struct fetcher fetcher;
+
+/**
+ * Start a fetcher, on io_uring when the kernel allows it and on threads of its own otherwise
+ * Returns NULL on failure.
+ */
+fetcher *fetch_create(void);
+
+/**
+ * Number of files pushed and not popped yet
+ */
+size_t fetch_pending(const fetcher *f);
+
+/**
+ * Start opening and reading a file, only while fewer than FETCH_DEPTH are pending
+ * The name must stay valid until the file is released.
+ */
+void fetch_push(fetcher *f, const char *name, void *arg);
+
+/**
+ * Wait for the oldest pending file
+ * Its data stays valid until fetch_release, which must come before the next pop.
+ */
+void fetch_pop(fetcher *f, fetched_file *file);
+
+/**
+ * Give back the buffer of the file popped last
+ */
+void fetch_release(fetcher *f);
+
+/**
+ * Stop the fetcher and free it, every file pushed must have been popped and released
+ */
+void fetch_destroy(fetcher *f);
+
+#endif
@@ -0,0 +1,435 @@
+#include "follow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "reader.h"
+
+// Events on a followed file: data appended, the file cut short, renamed or unlinked
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+// Events on its directory that may bring another file under its name
+#define DIR_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+// Room for a batch of events, each at least one struct inotify_event
+#define EVENT_BUFFER_SIZE 4096
+
+/**
+ * One file given to --follow, and the file currently open under its name
+ */
+typedef struct
+{
+    const char *name;
+    const char *base;  // name without its directory, as the directory events report it
+    int fd;            // -1 while nothing is open under the name
+    int wd;            // watch on the open file, -1 without one
+    int dir_wd;        // watch on the directory, -1 without one
+    dev_t dev;
+    ino_t ino;
+    stream_reader reader;
+    context_window window;
+    size_t offset;  // bytes searched so far, for -b
+    size_t line_number;
+    size_t match_count;
+    bool changed;  // an event came in since the file was last looked at
+    bool done;     // the limit is reached, or the file cannot be followed
+} followed_file;
+
+/**
+ * Everything follow_files() hands down to each file
+ */
+typedef struct
+{
+    const search_context *ctx;
+    output *out;
+    int inotify_fd;
+    followed_file *files;
+    size_t count;
+    size_t limit;  // lines to select per file
+    bool context;  // -A, -B or -C lines are printed
+} follow_state;
+
+/**
+ * Watch the directory a file is in, so the file can be noticed coming back under its name
+ */
+static bool watch_directory(follow_state *state, followed_file *f)
+{
+    const char *slash = strrchr(f->name, '/');
+    f->base = slash != NULL ? slash + 1 : f->name;
+
+    if (slash == NULL)
+    {
+        f->dir_wd = inotify_add_watch(state->inotify_fd, ".", DIR_EVENTS);
+        return f->dir_wd >= 0;
+    }
+
+    // "/log" is in "/", not in ""
+    size_t len = slash > f->name ? (size_t) (slash - f->name) : 1;
+    char *dir = strndup(f->name, len);
+    if (dir == NULL)
+    {
+        return false;
+    }
+
+    f->dir_wd = inotify_add_watch(state->inotify_fd, dir, DIR_EVENTS);
+    free(dir);
+    return f->dir_wd >= 0;
+}
+
+/**
+ * Open the file under f->name and start watching it, the search starts at its first line
+ * Returns false when there is no file to follow under the name, setting done when there will
+ * never be one.
+ */
+static bool follow_open(follow_state *state, followed_file *f)
+{
+    struct stat st;
+
+    // A missing file is waited for, one that cannot be read is given up on
+    int fd = open(f->name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno != ENOENT)
+    {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", f->name);
+        atomic_store(state->ctx->failed, true);
+        f->done = true;
+    }
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Error: Cannot follow '%s', not a regular file\n", f->name);
+        atomic_store(state->ctx->failed, true);
+        close(fd);
+        f->done = true;
+        return false;
+    }
+    if (!stream_reader_init(&f->reader, fd, NULL))
+    {
+        fprintf(stderr, "Error: Out of memory reading '%s'\n", f->name);
+        atomic_store(state->ctx->failed, true);
+        stream_reader_free(&f->reader);
+        close(fd);
+        f->done = true;
+        return false;
+    }
+
+    // Watched before the first read, nothing written in between goes unnoticed
+    f->wd = inotify_add_watch(state->inotify_fd, f->name, FILE_EVENTS);
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->reader.follow = true;
+    f->offset = 0;
+    f->line_number = 0;
+    context_init(&f->window,
+                 state->out,
+                 f->name,
+                 state->ctx->opts,
+                 state->ctx->print_filename,
+                 NULL);
+    return true;
+}
+
+/**
+ * Stop following the open file, its watch goes unless another argument names the same file
+ */
+static void follow_close(follow_state *state, followed_file *f)
+{
+    bool shared = false;
+    for (size_t i = 0; i < state->count; i++)
+    {
+        shared = shared || (&state->files[i] != f && state->files[i].wd == f->wd);
+    }
+    if (f->wd >= 0 && !shared)
+    {
+        inotify_rm_watch(state->inotify_fd, f->wd);
+    }
+
+    context_free(&f->window);
+    stream_reader_free(&f->reader);
+    close(f->fd);
+    f->fd = -1;
+    f->wd = -1;
+}
+
+/**
+ * Search what was appended to the open file since the last read, up to its last whole line
+ */
+static void follow_read(follow_state *state, followed_file *f)
+{
+    const search_context *ctx = state->ctx;
+    const char *block;
+    size_t len;
+
+    while ((f->match_count < state->limit || context_pending(&f->window))
+           && stream_reader_next(&f->reader, &block, &len))
+    {
+        size_t limit = state->limit - f->match_count;
+        f->match_count += state->context ? context_search(&f->window,
+                                                          ctx->pattern,
+                                                          block,
+                                                          len,
+                                                          f->offset,
+                                                          &f->line_number,
+                                                          limit,
+                                                          ctx->opts.invert_match)
+                                         : search_buffer(ctx->pattern,
+                                                         state->out,
+                                                         f->name,
+                                                         block,
+                                                         len,
+                                                         f->offset,
+                                                         &f->line_number,
+                                                         limit,
+                                                         ctx->opts,
+                                                         ctx->print_filename);
+        f->offset += len;
+
+        // The block is read over on the next step, the lines printed from it go out first
+        output_sync(state->out);
+        f->reader.keep = context_kept(&f->window);
+    }
+
+    if (f->reader.error)
+    {
+        fprintf(stderr, "Error: Cannot read file '%s'\n", f->name);
+        atomic_store(ctx->failed, true);
+        f->done = true;
+    }
+    else if (f->match_count >= state->limit && !context_pending(&f->window))
+    {
+        f->done = true;
+    }
+
+    if (f->done && ctx->opts.list_files && f->match_count > 0)
+    {
+        output_bytes(state->out, f->name, strlen(f->name));
+        output_char(state->out, '\n');
+    }
+}
+
+/**
+ * Bring one file up to date after an event: read what was appended, start over after a
+ * truncation, move on to the new file after a rotation
+ */
+static void follow_update(follow_state *state, followed_file *f)
+{
+    struct stat st;
+
+    f->changed = false;
+    if (f->fd >= 0)
+    {
+        follow_read(state, f);
+
+        // Cut shorter than what was read, the file is searched again from scratch
+        off_t pos = lseek(f->fd, 0, SEEK_CUR);
+        if (!f->done && fstat(f->fd, &st) == 0 && st.st_size < pos)
+        {
+            lseek(f->fd, 0, SEEK_SET);
+            stream_reader_reset(&f->reader);
+            context_free(&f->window);
+            context_init(&f->window,
+                         state->out,
+                         f->name,
+                         state->ctx->opts,
+                         state->ctx->print_filename,
+                         NULL);
+            f->offset = 0;
+            f->line_number = 0;
+            follow_read(state, f);
+        }
+
+        // Once the name leads elsewhere the old file is finished, its last line included
+        bool moved = stat(f->name, &st) != 0 || st.st_dev != f->dev || st.st_ino != f->ino;
+        if (!f->done && moved)
+        {
+            f->reader.follow = false;
+            follow_read(state, f);
+        }
+        if (f->done || moved)
+        {
+            follow_close(state, f);
+        }
+    }
+
+    if (!f->done && f->fd < 0 && follow_open(state, f))
+    {
+        follow_read(state, f);
+        if (f->done)
+        {
+            follow_close(state, f);
+        }
+    }
+}
+
+/**
+ * Mark the files a batch of events is about
+ */
+static void dispatch_events(follow_state *state, const char *events, size_t len)
+{
+    const char *pos = events;
+
+    while (pos < events + len)
+    {
+        const struct inotify_event *event = (const struct inotify_event *) pos;
+
+        for (size_t i = 0; i < state->count; i++)
+        {
+            followed_file *f = &state->files[i];
+
+            // Events were dropped, any file may have changed
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                f->changed = true;
+            }
+            else if (event->wd == f->wd)
+            {
+                f->changed = true;
+                f->wd = (event->mask & IN_IGNORED) ? -1 : f->wd;
+            }
+            else if (event->wd == f->dir_wd && event->len > 0 && strcmp(event->name, f->base) == 0)
+            {
+                f->changed = true;
+            }
+        }
+
+        pos += sizeof(*event) + event->len;
+    }
+}
+
+/**
+ * Check whether following can stop, every file has its answer or -q has the only one needed
+ */
+static bool follow_finished(const follow_state *state)
+{
+    bool finished = true;
+
+    for (size_t i = 0; i < state->count; i++)
+    {
+        if (state->ctx->opts.quiet && state->files[i].match_count > 0)
+        {
+            return true;
+        }
+        finished = finished && state->files[i].done;
+    }
+
+    return finished;
+}
+
+bool follow_files(const search_context *ctx, const char *const *files, size_t count, output *out)
+{
+    grep_options opts = ctx->opts;
+    follow_state state = {ctx, out, -1, NULL, count, opts.max_count, false};
+    bool matched = false;
+
+    // One line is enough to know the file matches, unless -m 0 allows none
+    if ((opts.quiet || opts.list_files) && state.limit > 1)
+    {
+        state.limit = 1;
+    }
+    state.context = opts.context && !opts.quiet && !opts.list_files;
+
+    state.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (state.inotify_fd < 0)
+    {
+        fprintf(stderr, "Error: Cannot watch files: %s\n", strerror(errno));
+        atomic_store(ctx->failed, true);
+        return false;
+    }
+
+    state.files = calloc(count, sizeof(*state.files));
+    if (state.files == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory\n");
+        atomic_store(ctx->failed, true);
+        close(state.inotify_fd);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        followed_file *f = &state.files[i];
+        f->name = files[i];
+        f->fd = -1;
+        f->wd = -1;
+        f->dir_wd = -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        followed_file *f = &state.files[i];
+
+        if (strcmp(f->name, "-") == 0)
+        {
+            fprintf(stderr, "Error: Cannot follow stdin\n");
+            atomic_store(ctx->failed, true);
+            f->done = true;
+        }
+        else if (!watch_directory(&state, f))
+        {
+            fprintf(stderr, "Error: Cannot watch the directory of '%s'\n", f->name);
+            atomic_store(ctx->failed, true);
+            f->done = true;
+        }
+        else
+        {
+            if (access(f->name, F_OK) != 0)
+            {
+                fprintf(stderr, "Error: Cannot open file '%s', waiting for it\n", f->name);
+            }
+            follow_update(&state, f);
+        }
+    }
+    output_flush(out);
+
+    char events[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    // Output that can no longer be written ends following too
+    while (!follow_finished(&state) && !output_failed(out))
+    {
+        ssize_t n = read(state.inotify_fd, events, sizeof(events));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            fprintf(stderr, "Error: Cannot watch files: %s\n", strerror(errno));
+            atomic_store(ctx->failed, true);
+            break;
+        }
+
+        dispatch_events(&state, events, (size_t) n);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (state.files[i].changed && !state.files[i].done)
+            {
+                follow_update(&state, &state.files[i]);
+            }
+        }
+
+        // Matches go out as soon as they are found, not once the batch fills up
+        output_flush(out);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (state.files[i].fd >= 0)
+        {
+            follow_close(&state, &state.files[i]);
+        }
+        matched = matched || state.files[i].match_count > 0;
+    }
+    free(state.files);
+    close(state.inotify_fd);
+
+    return matched;
+}
@@ -0,0 +1,20 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "output.h"
+#include "search.h"
+
+/**
+ * Search files to their end, then keep searching what gets appended to them, for --follow
+ * The files are watched with inotify, nothing is polled. A file cut short is searched again
+ * from its start; once another file takes its name, after logrotate for one, the old file is
+ * finished, its last unterminated line included, and the new one followed from its start.
+ * Following stops once every file has its -m lines, or one line under -q and -l, and never
+ * otherwise. Returns true if any line was selected.
+ */
+bool follow_files(const search_context *ctx, const char *const *files, size_t count, output *out);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Exit status for errors, as with grep: 0 means a line was selected and 1 that none was
+#define EXIT_TROUBLE 2
+
+/**
+ * What to do with files that look binary, chosen with --binary-files or -I
+ */
+typedef enum
+{
+    BINARY_MATCHES,  // only report whether the file matches, the default
+    BINARY_SKIP,     // treat the file as not matching without searching it
+    BINARY_TEXT,     // search and print it like any other file
+} binary_mode;
+
+typedef struct
+{
+    bool ignore_case;    // -i
+    bool line_number;    // -n
+    bool count_only;     // -c
+    bool invert_match;   // -v
+    bool use_wildcards;  // -w
+    bool use_anchors;    // -a
+    bool use_regex;      // -E, extended regular expressions
+    bool quiet;          // -q
+    bool list_files;     // -l
+    size_t max_count;    // -m, SIZE_MAX when there is no limit
+    bool recursive;      // -r, search directories recursively
+    binary_mode binary_files;  // --binary-files and -I
+    bool decompress;     // -z, search compressed files decompressed
+    size_t jobs;         // -j, number of files searched in parallel
+    size_t before_context;  // -B, lines printed before each selected line
+    size_t after_context;   // -A, lines printed after each selected line
+    bool context;        // -A, -B or -C given, groups of printed lines are set apart by "--"
+    bool follow;         // --follow, keep searching the files as they grow
+    bool byte_offset;    // -b, print the byte offset of each line, or of each match under -o
+    bool only_matching;  // -o, print each match on its own instead of the whole line
+} grep_options;
+
+#endif
@@ -0,0 +1,782 @@
+#include "index.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "reader.h"
+#include "scan.h"
+
+// Number of distinct trigrams, one per value of three bytes
+#define TRIGRAM_SPACE (1u << 24)
+
+/**
+ * Paths collected for indexing
+ */
+typedef struct
+{
+    char **items;
+    size_t count;
+    size_t cap;
+} path_list;
+
+/**
+ * Everything gathered while reading the files, written out once all of them are read
+ */
+typedef struct
+{
+    path_list paths;
+    index_file *files;
+    size_t file_count;
+    size_t file_cap;
+    index_block *blocks;
+    size_t block_count;
+    size_t block_cap;
+    uint32_t *trigrams;  // the distinct trigrams of each block, block after block
+    size_t trigram_count;
+    size_t trigram_cap;
+    size_t *block_trigrams;  // block i owns trigrams[block_trigrams[i]] up to [i + 1]
+    size_t block_trigram_cap;
+    char *strings;
+    size_t strings_size;
+    size_t strings_cap;
+    uint8_t *seen;  // one bit per trigram, set for those already found in the current block
+    bool failed;    // memory ran out
+} index_builder;
+
+/**
+ * Grow *items so that it holds at least need elements of size bytes
+ */
+static bool reserve(void **items, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap)
+    {
+        return true;
+    }
+
+    size_t grown = *cap > 0 ? *cap * 2 : 64;
+    while (grown < need)
+    {
+        grown *= 2;
+    }
+
+    void *larger = realloc(*items, grown * size);
+    if (larger == NULL)
+    {
+        return false;
+    }
+    *items = larger;
+    *cap = grown;
+    return true;
+}
+
+/**
+ * Lower-case one byte the way -i folds it
+ */
+static uint32_t fold_byte(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? (uint32_t) (c - 'A' + 'a') : c;
+}
+
+/**
+ * Add a path to index, taking it over
+ */
+static void add_path(index_builder *b, char *path)
+{
+    if (path == NULL
+        || !reserve((void **) &b->paths.items,
+                    &b->paths.cap,
+                    b->paths.count + 1,
+                    sizeof(*b->paths.items)))
+    {
+        free(path);
+        b->failed = true;
+        return;
+    }
+
+    b->paths.items[b->paths.count++] = path;
+}
+
+/**
+ * Walk callback, the walk runs on this thread so nothing needs locking
+ */
+static void visit_path(void *arg, char *path)
+{
+    add_path(arg, path);
+}
+
+/**
+ * Order paths byte by byte, as index_find_file() searches them
+ */
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Collect the distinct trigrams of one block, none of them spanning a newline
+ */
+static bool add_block_trigrams(index_builder *b, const unsigned char *data, size_t len)
+{
+    size_t start = b->trigram_count;
+    uint32_t trigram = 0;
+    size_t run = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i] == '\n')
+        {
+            run = 0;
+            continue;
+        }
+
+        trigram = ((trigram << 8) | fold_byte(data[i])) & (TRIGRAM_SPACE - 1);
+        if (++run < 3 || (b->seen[trigram >> 3] & (1u << (trigram & 7))) != 0)
+        {
+            continue;
+        }
+
+        if (!reserve((void **) &b->trigrams,
+                     &b->trigram_cap,
+                     b->trigram_count + 1,
+                     sizeof(*b->trigrams)))
+        {
+            return false;
+        }
+        b->seen[trigram >> 3] |= (uint8_t) (1u << (trigram & 7));
+        b->trigrams[b->trigram_count++] = trigram;
+    }
+
+    // Clearing only the bits set is far cheaper than wiping the whole bitmap
+    for (size_t i = start; i < b->trigram_count; i++)
+    {
+        b->seen[b->trigrams[i] >> 3] = 0;
+    }
+
+    return true;
+}
+
+/**
+ * Cut one file into blocks of whole lines and collect the trigrams of each
+ * Returns false if memory runs out, files that cannot be read are reported and skipped.
+ */
+static bool add_file(index_builder *b, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    mapped_file map;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !map_file(fd, &map))
+    {
+        fprintf(stderr, "Error: Cannot index file '%s'\n", path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return true;
+    }
+    close(fd);
+
+    size_t path_len = strlen(path);
+    bool ok = reserve((void **) &b->files, &b->file_cap, b->file_count + 1, sizeof(*b->files))
+              && reserve((void **) &b->strings,
+                         &b->strings_cap,
+                         b->strings_size + path_len,
+                         sizeof(*b->strings));
+
+    index_file *file = ok ? &b->files[b->file_count] : NULL;
+    if (ok)
+    {
+        memset(file, 0, sizeof(*file));
+        file->path_offset = b->strings_size;
+        file->path_len = (uint32_t) path_len;
+        file->size = map.size;
+        file->mtime_sec = st.st_mtim.tv_sec;
+        file->mtime_nsec = st.st_mtim.tv_nsec;
+        file->first_block = (uint32_t) b->block_count;
+
+        memcpy(b->strings + b->strings_size, path, path_len);
+        b->strings_size += path_len;
+    }
+
+    size_t pos = 0;
+    uint64_t lines = 0;
+
+    while (ok && pos < map.size)
+    {
+        size_t end = map.size - pos > INDEX_BLOCK_SIZE ? pos + INDEX_BLOCK_SIZE : map.size;
+        if (end < map.size)
+        {
+            const char *newline = memchr(map.data + end, '\n', map.size - end);
+            end = newline != NULL ? (size_t) (newline - map.data) + 1 : map.size;
+        }
+
+        ok = b->block_count < UINT32_MAX
+             && reserve((void **) &b->blocks,
+                        &b->block_cap,
+                        b->block_count + 1,
+                        sizeof(*b->blocks))
+             && reserve((void **) &b->block_trigrams,
+                        &b->block_trigram_cap,
+                        b->block_count + 2,
+                        sizeof(*b->block_trigrams))
+             && add_block_trigrams(b, (const unsigned char *) map.data + pos, end - pos);
+        if (!ok)
+        {
+            break;
+        }
+
+        index_block *block = &b->blocks[b->block_count];
+        block->offset = pos;
+        block->len = end - pos;
+        block->first_line = lines;
+        lines += scan_count_newlines(map.data + pos, end - pos);
+
+        b->block_count++;
+        b->block_trigrams[b->block_count] = b->trigram_count;
+        file->block_count++;
+        pos = end;
+    }
+
+    unmap_file(&map);
+    if (ok)
+    {
+        b->file_count++;
+    }
+    return ok;
+}
+
+/**
+ * Write count items of size bytes, an empty section may have no buffer at all
+ */
+static bool write_all(FILE *file, const void *items, size_t size, size_t count)
+{
+    return count == 0 || fwrite(items, size, count, file) == count;
+}
+
+/**
+ * Write the header and every section to path, through a temporary file renamed at the end
+ */
+static bool write_sections(const index_builder *b,
+                           const char *path,
+                           const index_trigram *table,
+                           size_t distinct,
+                           const uint32_t *postings)
+{
+    index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.block_size = INDEX_BLOCK_SIZE;
+    header.file_count = b->file_count;
+    header.block_count = b->block_count;
+    header.trigram_count = distinct;
+    header.posting_count = b->trigram_count;
+    header.strings_size = b->strings_size;
+
+    // A search never sees half an index
+    size_t path_len = strlen(path);
+    char *temp = malloc(path_len + sizeof(".tmp"));
+    if (temp == NULL)
+    {
+        return false;
+    }
+    memcpy(temp, path, path_len);
+    memcpy(temp + path_len, ".tmp", sizeof(".tmp"));
+
+    bool ok = false;
+    FILE *file = fopen(temp, "wb");
+    if (file != NULL)
+    {
+        ok = write_all(file, &header, sizeof(header), 1)
+             && write_all(file, b->files, sizeof(*b->files), b->file_count)
+             && write_all(file, b->blocks, sizeof(*b->blocks), b->block_count)
+             && write_all(file, table, sizeof(*table), distinct)
+             && write_all(file, postings, sizeof(*postings), b->trigram_count)
+             && write_all(file, b->strings, 1, b->strings_size);
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(temp, path) == 0;
+        if (!ok)
+        {
+            unlink(temp);
+        }
+    }
+
+    free(temp);
+    return ok;
+}
+
+/**
+ * Sort the collected trigrams into posting lists and write the index to path
+ */
+static bool write_index(const index_builder *b, const char *path)
+{
+    uint32_t *counts = calloc(TRIGRAM_SPACE, sizeof(*counts));
+    uint32_t *postings = malloc((b->trigram_count > 0 ? b->trigram_count : 1) * sizeof(*postings));
+    index_trigram *table = NULL;
+    size_t distinct = 0;
+    bool ok = false;
+
+    if (counts != NULL && postings != NULL)
+    {
+        for (size_t i = 0; i < b->trigram_count; i++)
+        {
+            counts[b->trigrams[i]]++;
+        }
+        for (size_t t = 0; t < TRIGRAM_SPACE; t++)
+        {
+            distinct += counts[t] > 0;
+        }
+        table = malloc((distinct > 0 ? distinct : 1) * sizeof(*table));
+    }
+
+    if (table != NULL)
+    {
+        // A counting sort on the trigram, blocks stay in ascending order within each list
+        size_t next = 0;
+        size_t offset = 0;
+        for (size_t t = 0; t < TRIGRAM_SPACE; t++)
+        {
+            if (counts[t] > 0)
+            {
+                table[next].trigram = (uint32_t) t;
+                table[next].count = counts[t];
+                table[next].first_posting = offset;
+                offset += counts[t];
+                counts[t] = (uint32_t) table[next].first_posting;
+                next++;
+            }
+        }
+
+        for (size_t block = 0; block < b->block_count; block++)
+        {
+            for (size_t i = b->block_trigrams[block]; i < b->block_trigrams[block + 1]; i++)
+            {
+                postings[counts[b->trigrams[i]]++] = (uint32_t) block;
+            }
+        }
+
+        ok = write_sections(b, path, table, distinct, postings);
+    }
+
+    free(counts);
+    free(postings);
+    free(table);
+    return ok;
+}
+
+bool index_build(const char *path,
+                 const char *const *files,
+                 size_t count,
+                 const walk_filters *filters)
+{
+    index_builder b;
+    atomic_bool stop = false;
+    atomic_bool unreadable = false;  // directories are reported and skipped like files
+    bool ok;
+
+    memset(&b, 0, sizeof(b));
+    b.seen = calloc(TRIGRAM_SPACE / 8, 1);
+    ok = b.seen != NULL
+         && reserve((void **) &b.block_trigrams,
+                    &b.block_trigram_cap,
+                    1,
+                    sizeof(*b.block_trigrams));
+    if (ok)
+    {
+        b.block_trigrams[0] = 0;
+    }
+
+    for (size_t i = 0; ok && i < count; i++)
+    {
+        struct stat st;
+
+        if (*files[i] == '\0' || (stat(files[i], &st) == 0 && S_ISDIR(st.st_mode)))
+        {
+            walk_tree(files[i], filters, NULL, &stop, &unreadable, visit_path, &b);
+        }
+        else
+        {
+            add_path(&b, strdup(files[i]));
+        }
+        ok = !b.failed;
+    }
+
+    // Searches look files up by their real path, whichever way they were named
+    for (size_t i = 0; ok && i < b.paths.count; i++)
+    {
+        char *real = realpath(b.paths.items[i], NULL);
+        if (real != NULL)
+        {
+            free(b.paths.items[i]);
+            b.paths.items[i] = real;
+        }
+    }
+    if (ok)
+    {
+        qsort(b.paths.items, b.paths.count, sizeof(*b.paths.items), compare_paths);
+    }
+
+    for (size_t i = 0; ok && i < b.paths.count; i++)
+    {
+        if (i > 0 && strcmp(b.paths.items[i], b.paths.items[i - 1]) == 0)
+        {
+            continue;
+        }
+        ok = add_file(&b, b.paths.items[i]);
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Out of memory building index\n");
+    }
+    else if (!write_index(&b, path))
+    {
+        fprintf(stderr, "Error: Cannot write index '%s'\n", path);
+        ok = false;
+    }
+
+    for (size_t i = 0; i < b.paths.count; i++)
+    {
+        free(b.paths.items[i]);
+    }
+    free(b.paths.items);
+    free(b.files);
+    free(b.blocks);
+    free(b.trigrams);
+    free(b.block_trigrams);
+    free(b.strings);
+    free(b.seen);
+    return ok;
+}
+
+/**
+ * Check that every offset in the index stays inside it, so later lookups need no checks
+ */
+static bool index_valid(const trigram_index *index)
+{
+    const index_header *h = index->header;
+
+    for (size_t i = 0; i < h->file_count; i++)
+    {
+        const index_file *file = &index->files[i];
+
+        if (file->path_offset > h->strings_size
+            || file->path_len > h->strings_size - file->path_offset
+            || file->first_block > h->block_count
+            || file->block_count > h->block_count - file->first_block)
+        {
+            return false;
+        }
+
+        for (size_t j = 0; j < file->block_count; j++)
+        {
+            const index_block *block = &index->blocks[file->first_block + j];
+            if (block->offset > file->size || block->len > file->size - block->offset)
+            {
+                return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < h->trigram_count; i++)
+    {
+        const index_trigram *t = &index->trigrams[i];
+        if (t->first_posting > h->posting_count || t->count > h->posting_count - t->first_posting)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool index_open(trigram_index *index, const char *path)
+{
+    mapped_file map;
+    int fd = open(path, O_RDONLY);
+
+    memset(index, 0, sizeof(*index));
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool mapped = map_file(fd, &map);
+    close(fd);
+    if (!mapped)
+    {
+        return false;
+    }
+
+    index->data = map.data;
+    index->size = map.size;
+    index->header = (const index_header *) map.data;
+
+    const index_header *h = index->header;
+    size_t size = map.size;
+
+    // Each count is bounded by the file size first, so the sums below cannot overflow
+    bool ok = size >= sizeof(*h) && memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) == 0
+              && h->version == INDEX_VERSION && h->file_count <= size && h->block_count <= size
+              && h->trigram_count <= size && h->posting_count <= size && h->strings_size <= size
+              && sizeof(*h) + h->file_count * sizeof(index_file)
+                         + h->block_count * sizeof(index_block)
+                         + h->trigram_count * sizeof(index_trigram)
+                         + h->posting_count * sizeof(uint32_t) + h->strings_size
+                     == size;
+
+    if (ok)
+    {
+        index->files = (const index_file *) (h + 1);
+        index->blocks = (const index_block *) (index->files + h->file_count);
+        index->trigrams = (const index_trigram *) (index->blocks + h->block_count);
+        index->postings = (const uint32_t *) (index->trigrams + h->trigram_count);
+        index->strings = (const char *) (index->postings + h->posting_count);
+        ok = index_valid(index);
+    }
+
+    if (!ok)
+    {
+        index_close(index);
+    }
+    return ok;
+}
+
+void index_close(trigram_index *index)
+{
+    mapped_file map = {index->data, index->size};
+
+    unmap_file(&map);
+    memset(index, 0, sizeof(*index));
+}
+
+const index_file *index_find_file(const trigram_index *index,
+                                  const char *real_path,
+                                  const struct stat *st)
+{
+    size_t len = strlen(real_path);
+    size_t lo = 0;
+    size_t hi = index->header->file_count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const index_file *file = &index->files[mid];
+        size_t common = file->path_len < len ? file->path_len : len;
+        int order = memcmp(index->strings + file->path_offset, real_path, common);
+
+        if (order == 0)
+        {
+            order = file->path_len < len ? -1 : file->path_len > len;
+        }
+        if (order == 0)
+        {
+            // A file changed since it was indexed is searched in full
+            bool current = file->size == (uint64_t) st->st_size
+                           && file->mtime_sec == st->st_mtim.tv_sec
+                           && file->mtime_nsec == st->st_mtim.tv_nsec;
+            return current ? file : NULL;
+        }
+
+        if (order < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Order trigrams numerically
+ */
+static int compare_trigrams(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+bool index_query_init(index_query *query, const compiled_pattern *pattern)
+{
+    size_t count = pattern_literal_count(pattern);
+    size_t total = 0;
+
+    memset(query, 0, sizeof(*query));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len;
+        pattern_literal(pattern, i, &len);
+
+        // A literal without a trigram could be anywhere
+        if (len < 3)
+        {
+            return false;
+        }
+        total += len - 2;
+    }
+    if (count == 0)
+    {
+        return false;
+    }
+
+    query->trigrams = malloc(total * sizeof(*query->trigrams));
+    query->starts = malloc((count + 1) * sizeof(*query->starts));
+    if (query->trigrams == NULL || query->starts == NULL)
+    {
+        index_query_free(query);
+        return false;
+    }
+
+    size_t next = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len;
+        const unsigned char *text = (const unsigned char *) pattern_literal(pattern, i, &len);
+        uint32_t *own = query->trigrams + next;
+        size_t own_count = 0;
+
+        query->starts[i] = next;
+        for (size_t j = 0; j + 2 < len; j++)
+        {
+            own[own_count++] = fold_byte(text[j]) << 16 | fold_byte(text[j + 1]) << 8
+                               | fold_byte(text[j + 2]);
+        }
+
+        // Each trigram is counted once per block, so each has to be asked for once
+        qsort(own, own_count, sizeof(*own), compare_trigrams);
+        size_t unique = 0;
+        for (size_t j = 0; j < own_count; j++)
+        {
+            if (unique == 0 || own[unique - 1] != own[j])
+            {
+                own[unique++] = own[j];
+            }
+        }
+        next += unique;
+    }
+    query->starts[count] = next;
+    query->literal_count = count;
+    return true;
+}
+
+void index_query_free(index_query *query)
+{
+    free(query->trigrams);
+    free(query->starts);
+    query->trigrams = NULL;
+    query->starts = NULL;
+    query->literal_count = 0;
+}
+
+/**
+ * Find the posting list of a trigram, NULL if no block holds it
+ */
+static const index_trigram *find_trigram(const trigram_index *index, uint32_t trigram)
+{
+    size_t lo = 0;
+    size_t hi = index->header->trigram_count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (index->trigrams[mid].trigram == trigram)
+        {
+            return &index->trigrams[mid];
+        }
+        if (index->trigrams[mid].trigram < trigram)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+bool index_candidates(const trigram_index *index,
+                      const index_file *file,
+                      const index_query *query,
+                      uint8_t *candidates)
+{
+    size_t n = file->block_count;
+    uint32_t first = file->first_block;
+    uint32_t *hits = malloc((n > 0 ? n : 1) * sizeof(*hits));
+
+    if (hits == NULL)
+    {
+        return false;
+    }
+    memset(candidates, 0, n);
+
+    for (size_t i = 0; i < query->literal_count; i++)
+    {
+        size_t needed = query->starts[i + 1] - query->starts[i];
+        memset(hits, 0, n * sizeof(*hits));
+
+        // A block holds the literal's trigrams when it shows up in all of their lists
+        size_t t = query->starts[i];
+        for (; t < query->starts[i + 1]; t++)
+        {
+            const index_trigram *entry = find_trigram(index, query->trigrams[t]);
+            if (entry == NULL)
+            {
+                break;
+            }
+
+            const uint32_t *list = index->postings + entry->first_posting;
+            size_t lo = 0;
+            size_t hi = entry->count;
+
+            // Postings are ascending, skip straight to this file's blocks
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                if (list[mid] < first)
+                {
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid;
+                }
+            }
+
+            bool any = false;
+            for (size_t p = lo; p < entry->count && list[p] - first < n; p++)
+            {
+                hits[list[p] - first]++;
+                any = true;
+            }
+            if (!any)
+            {
+                break;
+            }
+        }
+
+        // Stopping early means some trigram is missing from every block
+        if (t == query->starts[i + 1])
+        {
+            for (size_t b = 0; b < n; b++)
+            {
+                candidates[b] |= hits[b] == needed;
+            }
+        }
+    }
+
+    free(hits);
+    return true;
+}
@@ -0,0 +1,141 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "pattern.h"
+#include "walk.h"
+
+// Files are indexed in blocks of about this many bytes, each cut just past a newline
+#define INDEX_BLOCK_SIZE (64 * 1024)
+
+#define INDEX_MAGIC   "GRPTRI1"
+#define INDEX_VERSION 1
+
+/**
+ * Start of an index file, the sections follow in this order right after it
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t file_count;
+    uint64_t block_count;
+    uint64_t trigram_count;
+    uint64_t posting_count;
+    uint64_t strings_size;
+} index_header;
+
+/**
+ * One indexed file, sorted by path
+ * The entry only applies while the size and modification time still agree with the file.
+ */
+typedef struct
+{
+    uint64_t path_offset;  // into the strings section, an absolute path without symlinks
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path_len;
+    uint32_t first_block;  // the file's blocks are numbered consecutively from here
+    uint32_t block_count;
+    uint32_t reserved;
+} index_file;
+
+/**
+ * A run of whole lines of a file
+ */
+typedef struct
+{
+    uint64_t offset;
+    uint64_t len;
+    uint64_t first_line;  // lines of the file before this block
+} index_block;
+
+/**
+ * The blocks holding one trigram, bytes folded to lower case
+ */
+typedef struct
+{
+    uint32_t trigram;  // the three bytes, first one highest
+    uint32_t count;
+    uint64_t first_posting;  // block numbers, ascending
+} index_trigram;
+
+/**
+ * An index mapped read-only into memory
+ */
+typedef struct
+{
+    const char *data;
+    size_t size;
+    const index_header *header;
+    const index_file *files;
+    const index_block *blocks;
+    const index_trigram *trigrams;
+    const uint32_t *postings;
+    const char *strings;
+} trigram_index;
+
+/**
+ * The trigrams of the literals one of which every match of a pattern contains
+ */
+typedef struct
+{
+    uint32_t *trigrams;   // the trigrams of every literal one after the other
+    size_t *starts;       // literal i owns trigrams[starts[i]] up to trigrams[starts[i + 1]]
+    size_t literal_count;
+} index_query;
+
+/**
+ * Index every regular file among files, walking directories as -r does with filters, and
+ * write the index to path. "" stands for the current directory. Files that cannot be read
+ * are reported and left out. Returns false if the index could not be written.
+ */
+bool index_build(const char *path,
+                 const char *const *files,
+                 size_t count,
+                 const walk_filters *filters);
+
+/**
+ * Map the index at path and check its layout, returns false if it is missing or invalid
+ */
+bool index_open(trigram_index *index, const char *path);
+
+/**
+ * Unmap an index opened with index_open()
+ */
+void index_close(trigram_index *index);
+
+/**
+ * Find the entry of the file at real_path, NULL unless it is indexed and still current
+ */
+const index_file *index_find_file(const trigram_index *index,
+                                  const char *real_path,
+                                  const struct stat *st);
+
+/**
+ * Prepare the lookups for pattern, returns false when the index cannot narrow the search
+ * That is the case without required literals or when one is too short to hold a trigram.
+ */
+bool index_query_init(index_query *query, const compiled_pattern *pattern);
+
+/**
+ * Release the query trigrams
+ */
+void index_query_free(index_query *query);
+
+/**
+ * Set candidates[i] for each block i of file that holds every trigram of some literal
+ * Only those blocks can contain a matching line. Returns false if memory runs out.
+ */
+bool index_candidates(const trigram_index *index,
+                      const index_file *file,
+                      const index_query *query,
+                      uint8_t *candidates);
+
+#endif
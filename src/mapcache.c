@@ -0,0 +1,236 @@
+#include "mapcache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+/**
+ * One mapped file, a free slot when data is NULL
+ */
+typedef struct
+{
+    mapped_file map;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    size_t refs;        // searches using the mapping right now
+    uint64_t last_use;  // for least recently used eviction
+    bool stale;  // the file changed since, unmapped once the last search is done with it
+} cached_map;
+
+struct map_cache
+{
+    pthread_mutex_t lock;
+    cached_map entries[MAP_CACHE_FILES];
+    size_t bytes;  // mapped by the entries, stale ones included
+    uint64_t clock;
+};
+
+map_cache *map_cache_create(void)
+{
+    map_cache *cache = calloc(1, sizeof(*cache));
+
+    if (cache != NULL)
+    {
+        pthread_mutex_init(&cache->lock, NULL);
+    }
+    return cache;
+}
+
+static bool same_time(struct timespec a, struct timespec b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/**
+ * Unmap an entry and free its slot
+ */
+static void drop_entry(map_cache *cache, cached_map *entry)
+{
+    cache->bytes -= entry->map.size;
+    unmap_file(&entry->map);
+    entry->stale = false;
+}
+
+/**
+ * Find the current mapping of the file st describes, retiring any of an older version of it
+ */
+static cached_map *find_entry(map_cache *cache, const struct stat *st)
+{
+    cached_map *found = NULL;
+
+    for (size_t i = 0; i < MAP_CACHE_FILES; i++)
+    {
+        cached_map *entry = &cache->entries[i];
+
+        if (entry->map.data == NULL || entry->stale || entry->dev != st->st_dev
+            || entry->ino != st->st_ino)
+        {
+            continue;
+        }
+
+        // Written to since it was mapped, the pages past a truncation would fault
+        if (entry->map.size != (size_t) st->st_size || !same_time(entry->mtime, st->st_mtim)
+            || !same_time(entry->ctime, st->st_ctim))
+        {
+            entry->stale = true;
+            if (entry->refs == 0)
+            {
+                drop_entry(cache, entry);
+            }
+            continue;
+        }
+
+        found = entry;
+    }
+
+    return found;
+}
+
+/**
+ * Make room for size more bytes, returns a free slot or NULL if every mapping is in use
+ */
+static cached_map *evict_for(map_cache *cache, size_t size)
+{
+    for (;;)
+    {
+        cached_map *free_slot = NULL;
+        cached_map *oldest = NULL;
+
+        for (size_t i = 0; i < MAP_CACHE_FILES; i++)
+        {
+            cached_map *entry = &cache->entries[i];
+
+            if (entry->map.data == NULL)
+            {
+                free_slot = free_slot != NULL ? free_slot : entry;
+            }
+            else if (entry->refs == 0 && (oldest == NULL || entry->last_use < oldest->last_use))
+            {
+                oldest = entry;
+            }
+        }
+
+        if (free_slot != NULL && cache->bytes + size <= MAP_CACHE_BYTES)
+        {
+            return free_slot;
+        }
+        if (oldest == NULL)
+        {
+            return NULL;
+        }
+        drop_entry(cache, oldest);
+    }
+}
+
+bool map_cache_get(map_cache *cache, int fd, mapped_file *map)
+{
+    struct stat st;
+
+    // Empty files need no mapping, files over the budget would push out everything else
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || (uint64_t) st.st_size > MAP_CACHE_BYTES)
+    {
+        return map_file(fd, map);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cached_map *entry = find_entry(cache, &st);
+    if (entry != NULL)
+    {
+        entry->refs++;
+        entry->last_use = ++cache->clock;
+        *map = entry->map;
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Mapped without the lock, other threads keep searching their files meanwhile
+    if (!map_file(fd, map))
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    // Another thread may have mapped the same file meanwhile, its mapping is the one kept
+    entry = find_entry(cache, &st);
+    if (entry == NULL)
+    {
+        // With every mapping in use this one is not kept, map_cache_put() unmaps it
+        entry = evict_for(cache, map->size);
+        if (entry != NULL)
+        {
+            entry->map = *map;
+            entry->dev = st.st_dev;
+            entry->ino = st.st_ino;
+            entry->mtime = st.st_mtim;
+            entry->ctime = st.st_ctim;
+            entry->refs = 0;
+            cache->bytes += map->size;
+        }
+    }
+    else
+    {
+        unmap_file(map);
+        *map = entry->map;
+    }
+
+    if (entry != NULL)
+    {
+        entry->refs++;
+        entry->last_use = ++cache->clock;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+void map_cache_put(map_cache *cache, mapped_file *map)
+{
+    bool cached = false;
+
+    if (map->data == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < MAP_CACHE_FILES && !cached; i++)
+    {
+        cached_map *entry = &cache->entries[i];
+
+        if (entry->map.data == map->data)
+        {
+            cached = true;
+            entry->refs--;
+            if (entry->stale && entry->refs == 0)
+            {
+                drop_entry(cache, entry);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!cached)
+    {
+        unmap_file(map);
+    }
+    map->data = NULL;
+    map->size = 0;
+}
+
+void map_cache_destroy(map_cache *cache)
+{
+    for (size_t i = 0; i < MAP_CACHE_FILES; i++)
+    {
+        if (cache->entries[i].map.data != NULL)
+        {
+            drop_entry(cache, &cache->entries[i]);
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
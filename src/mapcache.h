@@ -0,0 +1,41 @@
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "reader.h"
+
+// Files a cache keeps mapped at most, the least recently searched one goes first
+#define MAP_CACHE_FILES 256
+
+// Bytes a cache keeps mapped at most, a larger file is mapped for its search only
+#define MAP_CACHE_BYTES ((size_t) 1 << 30)
+
+typedef struct map_cache map_cache;
+
+/**
+ * Start an empty cache of file mappings, shared by every thread of a server
+ * Returns NULL if memory runs out.
+ */
+map_cache *map_cache_create(void);
+
+/**
+ * Map the regular file behind fd like map_file(), reusing the mapping of an earlier search when
+ * the file is still the same: same device, inode, size and modification time. The mapping
+ * stays valid until map_cache_put(), however many threads search the file at the same time.
+ */
+bool map_cache_get(map_cache *cache, int fd, mapped_file *map);
+
+/**
+ * Done with a mapping from map_cache_get(), it stays mapped for the next search unless the
+ * cache has given up on it
+ */
+void map_cache_put(map_cache *cache, mapped_file *map);
+
+/**
+ * Unmap every file and free the cache, no mapping may be in use any more
+ */
+void map_cache_destroy(map_cache *cache);
+
+#endif
@@ -0,0 +1,519 @@
+#include "options.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/**
+ * Values of the long options that have no short form
+ */
+enum
+{
+    OPT_INCLUDE = 256,
+    OPT_EXCLUDE,
+    OPT_EXCLUDE_DIR,
+    OPT_NO_IGNORE,
+    OPT_BINARY_FILES,
+    OPT_INDEX,
+    OPT_BUILD_INDEX,
+    OPT_STATS,
+    OPT_FOLLOW,
+    OPT_SERVE,
+    OPT_CONNECT,
+};
+
+static const struct option long_options[] = {
+    {"after-context", required_argument, NULL, 'A'},
+    {"before-context", required_argument, NULL, 'B'},
+    {"context", required_argument, NULL, 'C'},
+    {"byte-offset", no_argument, NULL, 'b'},
+    {"only-matching", no_argument, NULL, 'o'},
+    {"recursive", no_argument, NULL, 'r'},
+    {"include", required_argument, NULL, OPT_INCLUDE},
+    {"exclude", required_argument, NULL, OPT_EXCLUDE},
+    {"exclude-dir", required_argument, NULL, OPT_EXCLUDE_DIR},
+    {"no-ignore", no_argument, NULL, OPT_NO_IGNORE},
+    {"binary-files", required_argument, NULL, OPT_BINARY_FILES},
+    {"decompress", no_argument, NULL, 'z'},
+    {"index", required_argument, NULL, OPT_INDEX},
+    {"build-index", required_argument, NULL, OPT_BUILD_INDEX},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"follow", no_argument, NULL, OPT_FOLLOW},
+    {"serve", required_argument, NULL, OPT_SERVE},
+    {"connect", required_argument, NULL, OPT_CONNECT},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+/**
+ * Append a copy of text to the list, returns false if memory runs out
+ */
+static bool add_pattern(pattern_list *list, const char *text, size_t len)
+{
+    if (list->count == list->cap)
+    {
+        size_t cap = list->cap > 0 ? list->cap * 2 : 16;
+        char **items = realloc(list->items, cap * sizeof(*items));
+        if (items == NULL)
+        {
+            return false;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+
+    char *copy = malloc(len + 1);
+    if (copy == NULL)
+    {
+        return false;
+    }
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+
+    list->items[list->count++] = copy;
+    return true;
+}
+
+/**
+ * Add every line of a file as a pattern, returns false on error
+ */
+static bool read_pattern_file(pattern_list *list, const char *filename)
+{
+    FILE *file = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = true;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+        return false;
+    }
+
+    while (ok && (len = getline(&line, &cap, file)) >= 0)
+    {
+        if (len > 0 && line[len - 1] == '\n')
+        {
+            len--;
+        }
+        ok = add_pattern(list, line, (size_t) len);
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Out of memory reading '%s'\n", filename);
+    }
+
+    free(line);
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    return ok;
+}
+
+/**
+ * Free the list and every pattern in it
+ */
+static void free_patterns(pattern_list *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->items[i]);
+    }
+    free(list->items);
+}
+
+/**
+ * Parse the number of lines given to -A, -B or -C
+ */
+static bool parse_context_length(const char *arg, size_t *lines)
+{
+    char *end;
+    long long value = strtoll(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || value < 0)
+    {
+        fprintf(stderr, "Error: Invalid context length '%s'\n", arg);
+        return false;
+    }
+
+    *lines = (size_t) value;
+    return true;
+}
+
+/**
+ * Print usage information
+ */
+static void print_usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] PATTERN [FILE...]\n", program_name);
+    fprintf(stderr, "       %s [OPTIONS] -e PATTERN... [-f FILE...] [FILE...]\n", program_name);
+    fprintf(stderr, "       %s --build-index=INDEX [FILE|DIR...]\n", program_name);
+    fprintf(stderr, "       %s --serve=SOCKET [-j N]\n", program_name);
+    fprintf(stderr, "       %s --connect=SOCKET [OPTIONS] PATTERN [FILE...]\n", program_name);
+    fprintf(stderr, "Search for PATTERN in each FILE.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -i       Ignore case distinctions\n");
+    fprintf(stderr, "  -n       Print line number with output lines\n");
+    fprintf(stderr, "  -b       Print the byte offset of each line, or of each match with -o\n");
+    fprintf(stderr, "  -o       Print only the matching parts of lines, one per output line\n");
+    fprintf(stderr, "  -c       Print only a count of matching lines per file\n");
+    fprintf(stderr, "  -v       Invert the sense of matching, to select non-matching lines\n");
+    fprintf(stderr, "  -w       Use wildcard pattern matching (* and ?)\n");
+    fprintf(stderr, "  -a       Enable anchor matching (^ for start of line, $ for end of line)\n");
+    fprintf(stderr, "  -E       Interpret patterns as extended regular expressions\n");
+    fprintf(stderr, "  -q       Quiet, print nothing and exit with status 0 on the first match\n");
+    fprintf(stderr, "  -l       Print only the names of files with a match\n");
+    fprintf(stderr, "  -m NUM   Stop reading a file after NUM selected lines\n");
+    fprintf(stderr, "  -A NUM   Print NUM lines of context after each selected line\n");
+    fprintf(stderr, "  -B NUM   Print NUM lines of context before each selected line\n");
+    fprintf(stderr, "  -C NUM   Print NUM lines of context on both sides, -A and -B win over it\n");
+    fprintf(stderr, "  -e PAT   Search for PAT, may be given several times\n");
+    fprintf(stderr, "  -f FILE  Search for every pattern listed in FILE, one per line\n");
+    fprintf(stderr, "  -j N     Search up to N files in parallel\n");
+    fprintf(stderr, "  -I       Skip binary files, same as --binary-files=without-match\n");
+    fprintf(stderr, "  --binary-files=TYPE\n");
+    fprintf(stderr, "           Files with a NUL byte near the start are binary: 'binary' only\n");
+    fprintf(stderr, "           says whether they match, 'without-match' skips them and 'text'\n");
+    fprintf(stderr, "           prints their lines like any other file\n");
+    fprintf(stderr, "  -z, --decompress\n");
+    fprintf(stderr, "           Search gzip, zstd and lz4 compressed files decompressed\n");
+    fprintf(stderr, "  -r, --recursive\n");
+    fprintf(stderr, "           Search the files below each directory, or the current one\n");
+    fprintf(stderr, "  --include=GLOB\n");
+    fprintf(stderr, "           Under -r, only search files whose name matches GLOB\n");
+    fprintf(stderr, "  --exclude=GLOB\n");
+    fprintf(stderr, "           Under -r, skip files whose name matches GLOB\n");
+    fprintf(stderr, "  --exclude-dir=GLOB\n");
+    fprintf(stderr, "           Under -r, skip directories whose name matches GLOB\n");
+    fprintf(stderr, "  --no-ignore\n");
+    fprintf(stderr, "           Under -r, do not honor .gitignore files or skip .git\n");
+    fprintf(stderr, "  --index=INDEX\n");
+    fprintf(stderr, "           Only search the parts of indexed files that can hold a match\n");
+    fprintf(stderr, "  --build-index=INDEX\n");
+    fprintf(stderr, "           Write a trigram index of the files and directories to INDEX\n");
+    fprintf(stderr, "  --follow\n");
+    fprintf(stderr, "           Search files as they grow, across rotation and truncation\n");
+    fprintf(stderr, "  --serve=SOCKET\n");
+    fprintf(stderr, "           Answer the queries sent to SOCKET, -j N workers search them\n");
+    fprintf(stderr, "  --connect=SOCKET\n");
+    fprintf(stderr, "           Given first, have the server on SOCKET run the rest of the line\n");
+    fprintf(stderr, "  --stats  Report counters, timings and per-file throughput on stderr\n");
+    fprintf(stderr, "  -h       Display this help and exit\n");
+}
+
+/**
+ * Give up on a command line, freeing what was parsed of it
+ */
+static bool stop_parsing(command_line *cmd, int *exit_status, int status)
+{
+    command_line_free(cmd);
+    *exit_status = status;
+    return false;
+}
+
+bool command_line_parse(command_line *cmd, int argc, char **argv, int *exit_status)
+{
+    static const char *const current_directory[] = {""};
+    static const char *const standard_input[] = {"-"};
+    grep_options *options = &cmd->options;
+    bool have_pattern_option = false;
+    size_t after_context = SIZE_MAX;
+    size_t before_context = SIZE_MAX;
+    size_t both_context = 0;
+    int opt;
+
+    memset(cmd, 0, sizeof(*cmd));
+    options->max_count = SIZE_MAX;
+    options->binary_files = BINARY_MATCHES;
+    options->jobs = 1;
+    cmd->filters.gitignore = true;
+
+    // 0 rather than 1 makes getopt start over, a previous command line included
+    optind = 0;
+
+    while ((opt = getopt_long(argc, argv, "incvwaEe:f:qlm:boA:B:C:j:rIzh", long_options, NULL))
+           != -1)
+    {
+        glob_list *globs = NULL;
+
+        switch (opt)
+        {
+        case 'i':
+            options->ignore_case = true;
+            break;
+        case 'n':
+            options->line_number = true;
+            break;
+        case 'b':
+            options->byte_offset = true;
+            break;
+        case 'o':
+            options->only_matching = true;
+            break;
+        case 'c':
+            options->count_only = true;
+            break;
+        case 'v':
+            options->invert_match = true;
+            break;
+        case 'w':
+            options->use_wildcards = true;
+            break;
+        case 'a':
+            options->use_anchors = true;
+            break;
+        case 'E':
+            options->use_regex = true;
+            break;
+        case 'e':
+            have_pattern_option = true;
+            if (!add_pattern(&cmd->patterns, optarg, strlen(optarg)))
+            {
+                fprintf(stderr, "Error: Out of memory\n");
+                return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+            }
+            break;
+        case 'f':
+            have_pattern_option = true;
+            cmd->stdin_patterns |= strcmp(optarg, "-") == 0;
+            if (!read_pattern_file(&cmd->patterns, optarg))
+            {
+                return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+            }
+            break;
+        case 'q':
+            options->quiet = true;
+            break;
+        case 'l':
+            options->list_files = true;
+            break;
+        case 'm':
+        {
+            char *end;
+            long long max_count = strtoll(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || max_count < 0)
+            {
+                fprintf(stderr, "Error: Invalid match count '%s'\n", optarg);
+                return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+            }
+            options->max_count = (size_t) max_count;
+            break;
+        }
+        case 'A':
+        case 'B':
+        case 'C':
+        {
+            size_t *lines = opt == 'A' ? &after_context
+                            : opt == 'B' ? &before_context
+                                         : &both_context;
+            if (!parse_context_length(optarg, lines))
+            {
+                return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+            }
+            options->context = true;
+            break;
+        }
+        case 'j':
+        {
+            char *end;
+            long jobs = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || jobs < 1)
+            {
+                fprintf(stderr, "Error: Invalid number of jobs '%s'\n", optarg);
+                return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+            }
+            options->jobs = (size_t) jobs;
+            break;
+        }
+        case 'r':
+            options->recursive = true;
+            break;
+        case OPT_INCLUDE:
+            globs = &cmd->filters.include;
+            break;
+        case OPT_EXCLUDE:
+            globs = &cmd->filters.exclude;
+            break;
+        case OPT_EXCLUDE_DIR:
+            globs = &cmd->filters.exclude_dir;
+            break;
+        case OPT_NO_IGNORE:
+            cmd->filters.gitignore = false;
+            break;
+        case 'z':
+            options->decompress = true;
+            break;
+        case 'I':
+            options->binary_files = BINARY_SKIP;
+            break;
+        case OPT_BINARY_FILES:
+            if (strcmp(optarg, "binary") == 0)
+            {
+                options->binary_files = BINARY_MATCHES;
+            }
+            else if (strcmp(optarg, "without-match") == 0)
+            {
+                options->binary_files = BINARY_SKIP;
+            }
+            else if (strcmp(optarg, "text") == 0)
+            {
+                options->binary_files = BINARY_TEXT;
+            }
+            else
+            {
+                fprintf(stderr, "Error: Invalid binary files type '%s'\n", optarg);
+                return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+            }
+            break;
+        case OPT_INDEX:
+            cmd->index_path = optarg;
+            break;
+        case OPT_BUILD_INDEX:
+            cmd->build_index_path = optarg;
+            break;
+        case OPT_FOLLOW:
+            options->follow = true;
+            break;
+        case OPT_SERVE:
+            cmd->serve_path = optarg;
+            break;
+        case OPT_CONNECT:
+            // main() takes the rest of the line as it is, nothing after it is parsed here
+            fprintf(stderr, "Error: --connect has to come before every other argument\n");
+            return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+        case OPT_STATS:
+#ifdef GREP_STATS
+            cmd->stats = true;
+            break;
+#else
+            fprintf(stderr, "Error: --stats is not built in, rebuild with WITH_STATS=1\n");
+            return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+#endif
+        case 'h':
+            print_usage(argv[0]);
+            return stop_parsing(cmd, exit_status, EXIT_SUCCESS);
+        default:
+            print_usage(argv[0]);
+            return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+        }
+
+        if (globs != NULL && !walk_add_glob(globs, optarg))
+        {
+            fprintf(stderr, "Error: Out of memory\n");
+            return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+        }
+    }
+
+    // -A and -B win over -C whatever their order
+    options->after_context = after_context != SIZE_MAX ? after_context : both_context;
+    options->before_context = before_context != SIZE_MAX ? before_context : both_context;
+
+    // Matches printed on their own have no lines around them
+    if (options->only_matching)
+    {
+        options->context = false;
+        options->after_context = 0;
+        options->before_context = 0;
+    }
+
+    // A followed file is never done, there is no count or end of input to wait for
+    if (options->follow
+        && (options->count_only || options->recursive || options->decompress
+            || cmd->index_path != NULL || cmd->build_index_path != NULL))
+    {
+        fprintf(stderr, "Error: --follow cannot be combined with -c, -r, -z or an index\n");
+        return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+    }
+
+    // The queries bring their own patterns and files
+    if (cmd->serve_path != NULL && optind < argc)
+    {
+        fprintf(stderr, "Error: --serve takes no pattern or files, the queries bring them\n");
+        return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+    }
+
+    // Building an index takes no pattern, only what to index
+    if (cmd->build_index_path != NULL || cmd->serve_path != NULL)
+    {
+        cmd->files = optind < argc ? (const char *const *) argv + optind : current_directory;
+        cmd->file_count = optind < argc ? (size_t) (argc - optind) : 1;
+        return true;
+    }
+
+    // Without -e or -f the first argument is the pattern
+    if (!have_pattern_option)
+    {
+        // Check if we have enough non-option arguments
+        if (optind >= argc)
+        {
+            fprintf(stderr, "Expected pattern argument\n");
+            print_usage(argv[0]);
+            return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+        }
+
+        if (!add_pattern(&cmd->patterns, argv[optind], strlen(argv[optind])))
+        {
+            fprintf(stderr, "Error: Out of memory\n");
+            return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+        }
+        optind++;
+    }
+
+    if (options->follow && optind >= argc)
+    {
+        fprintf(stderr, "Error: --follow needs files to follow\n");
+        return stop_parsing(cmd, exit_status, EXIT_TROUBLE);
+    }
+
+    // If no files are specified, read from stdin, or walk the current directory under -r
+    if (optind >= argc)
+    {
+        cmd->files = options->recursive ? current_directory : standard_input;
+        cmd->file_count = 1;
+    }
+    else
+    {
+        cmd->files = (const char *const *) argv + optind;
+        cmd->file_count = (size_t) (argc - optind);
+        cmd->print_filename = argc - optind > 1;
+    }
+
+    return true;
+}
+
+bool command_line_compile(const command_line *cmd, compiled_pattern *pattern)
+{
+    // Preprocess the patterns once, the search loop only ever reads the compiled form
+    if (pattern_compile_set(
+            pattern, (const char *const *) cmd->patterns.items, cmd->patterns.count, &cmd->options))
+    {
+        return true;
+    }
+
+    if (pattern->error != NULL)
+    {
+        fprintf(stderr, "Error: Invalid regular expression: %s\n", pattern->error);
+    }
+    else
+    {
+        fprintf(stderr, "Error: Out of memory compiling pattern\n");
+    }
+    return false;
+}
+
+void command_line_free(command_line *cmd)
+{
+    free_patterns(&cmd->patterns);
+    walk_filters_free(&cmd->filters);
+    cmd->patterns.items = NULL;
+    cmd->patterns.count = 0;
+    cmd->patterns.cap = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "grep.h"
+#include "pattern.h"
+#include "walk.h"
+
+/**
+ * Patterns collected from -e and -f
+ */
+typedef struct
+{
+    char **items;
+    size_t count;
+    size_t cap;
+} pattern_list;
+
+/**
+ * Everything a command line asks for, parsed once by main() or by the server for each query
+ */
+typedef struct
+{
+    grep_options options;
+    pattern_list patterns;
+    walk_filters filters;
+    const char *index_path;        // --index, NULL without one
+    const char *build_index_path;  // --build-index, NULL without one
+    const char *serve_path;        // --serve, NULL without one
+    bool stats;                    // --stats
+    bool stdin_patterns;           // -f - read patterns from standard input
+    const char *const *files;      // what to search, the default input when none was given
+    size_t file_count;
+    bool print_filename;  // more than one file was given
+} command_line;
+
+/**
+ * Parse argc and argv into cmd, argv[0] being the program name
+ * Returns false when there is nothing to search, with the status to exit with in
+ * *exit_status: after -h, or once an error was reported on stderr. cmd is then already freed.
+ * getopt is started over, so a process may parse any number of command lines.
+ */
+bool command_line_parse(command_line *cmd, int argc, char **argv, int *exit_status);
+
+/**
+ * Compile the patterns of cmd into pattern, reporting on stderr why they cannot be
+ */
+bool command_line_compile(const command_line *cmd, compiled_pattern *pattern);
+
+/**
+ * Free the patterns and filters
+ */
+void command_line_free(command_line *cmd);
+
+#endif
@@ -0,0 +1,227 @@
+#include "output.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+bool output_init(output *out, int fd)
+{
+    out->fd = fd;
+    out->cap = fd >= 0 ? OUTPUT_BUFFER_SIZE : 4096;
+    out->buf = malloc(out->cap);
+    out->len = 0;
+    out->pending = 0;
+    out->iov_count = 0;
+    out->error = false;
+    out->grouped = false;
+
+    return out->buf != NULL;
+}
+
+/**
+ * Write all iovecs, retrying after short writes and interrupts
+ */
+static void write_all(output *out, struct iovec *iov, int count)
+{
+    uint64_t start = STATS_CLOCK();
+
+    while (count > 0 && !out->error)
+    {
+        ssize_t written = writev(out->fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            out->error = true;
+            return;
+        }
+
+        // Skip what went out, the first remaining entry may be partly written
+        size_t left = (size_t) written;
+        while (count > 0 && left >= iov->iov_len)
+        {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    STATS_ELAPSED(output_ns, start);
+}
+
+/**
+ * Make room for len more buffered bytes, returns false if they must bypass the buffer
+ */
+static bool reserve(output *out, size_t len)
+{
+    if (out->len + len <= out->cap)
+    {
+        return true;
+    }
+
+    if (out->fd >= 0)
+    {
+        output_flush(out);
+        return len <= out->cap;
+    }
+
+    // In-memory writers simply grow
+    size_t cap = out->cap > 0 ? out->cap : 4096;
+    while (cap < out->len + len)
+    {
+        cap *= 2;
+    }
+
+    char *grown = realloc(out->buf, cap);
+    if (grown == NULL)
+    {
+        out->error = true;
+        return false;
+    }
+    out->buf = grown;
+    out->cap = cap;
+    return true;
+}
+
+void output_bytes(output *out, const char *data, size_t len)
+{
+    if (out->error)
+    {
+        return;
+    }
+
+    if (reserve(out, len))
+    {
+        memcpy(out->buf + out->len, data, len);
+        out->len += len;
+    }
+    else if (out->fd >= 0)
+    {
+        // Larger than the whole buffer, which reserve() just flushed
+        struct iovec iov = {(void *) data, len};
+        write_all(out, &iov, 1);
+    }
+}
+
+void output_span(output *out, const char *data, size_t len)
+{
+    if (out->fd < 0 || len < OUTPUT_DIRECT_MIN)
+    {
+        output_bytes(out, data, len);
+        return;
+    }
+
+    if (out->error)
+    {
+        return;
+    }
+
+    // Room for the buffered bytes before the span and for the span itself
+    if (out->iov_count + 2 > OUTPUT_MAX_IOV)
+    {
+        output_flush(out);
+    }
+
+    if (out->len > out->pending)
+    {
+        out->iov[out->iov_count].iov_base = out->buf + out->pending;
+        out->iov[out->iov_count].iov_len = out->len - out->pending;
+        out->iov_count++;
+        out->pending = out->len;
+    }
+
+    out->iov[out->iov_count].iov_base = (void *) data;
+    out->iov[out->iov_count].iov_len = len;
+    out->iov_count++;
+}
+
+void output_char(output *out, char c)
+{
+    if (out->len < out->cap && !out->error)
+    {
+        out->buf[out->len++] = c;
+        return;
+    }
+    output_bytes(out, &c, 1);
+}
+
+void output_number(output *out, size_t value)
+{
+    char digits[24];
+    size_t pos = sizeof(digits);
+
+    do
+    {
+        digits[--pos] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    output_bytes(out, digits + pos, sizeof(digits) - pos);
+}
+
+void output_sync(output *out)
+{
+    // Only writers attached to a descriptor ever refer to input memory
+    if (out->fd >= 0 && out->iov_count > 0)
+    {
+        output_flush(out);
+    }
+}
+
+void output_flush(output *out)
+{
+    if (out->fd < 0)
+    {
+        return;
+    }
+
+    // The bytes buffered after the last queued span go out as one more entry
+    int count = out->iov_count;
+    if (out->len > out->pending)
+    {
+        out->iov[count].iov_base = out->buf + out->pending;
+        out->iov[count].iov_len = out->len - out->pending;
+        count++;
+    }
+    write_all(out, out->iov, count);
+
+    out->iov_count = 0;
+    out->len = 0;
+    out->pending = 0;
+}
+
+bool output_failed(const output *out)
+{
+    return out->error;
+}
+
+char *output_release(output *out, size_t *len)
+{
+    char *data = out->buf;
+
+    *len = out->len;
+
+    // Leave the writer usable, a later append simply starts a new buffer
+    out->buf = NULL;
+    out->cap = 0;
+    out->len = 0;
+    out->pending = 0;
+    return data;
+}
+
+void output_free(output *out)
+{
+    output_flush(out);
+    free(out->buf);
+    out->buf = NULL;
+}
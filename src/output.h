@@ -0,0 +1,91 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Size of the formatting buffer of a writer attached to a descriptor
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Spans at least this long are written straight from the input instead of being copied
+#define OUTPUT_DIRECT_MIN 256
+
+// Pending writev() entries before a flush is forced
+#define OUTPUT_MAX_IOV 256
+
+/**
+ * Batched output writer
+ * Prefixes and short lines are formatted into one buffer; long lines are queued as iovecs that
+ * point into the input, and everything goes out in a single writev() per batch. A writer
+ * without a descriptor collects its output in memory instead, for the parallel modes where each
+ * job's output is printed later in order.
+ */
+typedef struct
+{
+    int fd;  // destination, -1 for an in-memory writer
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t pending;  // start of the bytes in buf not yet covered by an iovec
+    struct iovec iov[OUTPUT_MAX_IOV + 1];  // one spare for the buffer tail at flush time
+    int iov_count;
+    bool error;  // a write failed, further output is dropped
+    bool grouped;  // a group of context lines went out, the next one starts with "--"
+} output;
+
+/**
+ * Prepare a writer for fd, or an in-memory writer when fd is -1
+ * Returns false if the buffer cannot be allocated.
+ */
+bool output_init(output *out, int fd);
+
+/**
+ * Append len bytes, they are copied so data may go away right after the call
+ */
+void output_bytes(output *out, const char *data, size_t len);
+
+/**
+ * Append len bytes of input, which must stay valid until the next output_sync()
+ */
+void output_span(output *out, const char *data, size_t len);
+
+/**
+ * Append a single character
+ */
+void output_char(output *out, char c);
+
+/**
+ * Append a number in decimal
+ */
+void output_number(output *out, size_t value);
+
+/**
+ * Make sure nothing refers to input memory any more, called before the input buffer is
+ * refilled or unmapped
+ */
+void output_sync(output *out);
+
+/**
+ * Write everything buffered so far, a no-op for in-memory writers
+ */
+void output_flush(output *out);
+
+/**
+ * Check whether output was lost, to a failed write or to an in-memory writer that could not
+ * grow; nothing appended since went anywhere
+ */
+bool output_failed(const output *out);
+
+/**
+ * Hand over the bytes an in-memory writer collected, the caller frees them
+ * The writer is left empty and can be reused.
+ */
+char *output_release(output *out, size_t *len);
+
+/**
+ * Flush and free the writer, the descriptor is left open
+ */
+void output_free(output *out);
+
+#endif
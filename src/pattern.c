@@ -0,0 +1,820 @@
+#include "pattern.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Check whether the len bytes at line equal the pattern bytes at text
+ * The pattern side is already folded, so only the line needs folding under -i
+ */
+static bool span_equal(const char *line, const char *text, size_t len, bool ignore_case)
+{
+    if (!ignore_case)
+    {
+        return memcmp(line, text, len) == 0;
+    }
+
+    return scan_equal_fold(line, text, len);
+}
+
+/**
+ * Find the leftmost match of a segment containing '?' in [pos, end) with Shift-And
+ * Bit i of the state is set while text[0..i] matches the bytes just read, so every byte
+ * is looked at exactly once whatever the pattern looks like.
+ */
+static const char *find_wildcard_segment(const pattern_segment *segment,
+                                         const char *pos,
+                                         const char *end)
+{
+    size_t words = segment->words;
+    uint64_t accept = UINT64_C(1) << ((segment->len - 1) % 64);
+
+    if (words == 1)
+    {
+        uint64_t state = 0;
+
+        for (const char *p = pos; p < end; p++)
+        {
+            state = ((state << 1) | 1) & segment->masks[(unsigned char) *p];
+            if (state & accept)
+            {
+                return p - segment->len + 1;
+            }
+        }
+        return NULL;
+    }
+
+    // Longer segments carry the shift across several words
+    uint64_t state[words];
+    memset(state, 0, sizeof(state));
+
+    for (const char *p = pos; p < end; p++)
+    {
+        const uint64_t *mask = segment->masks + (unsigned char) *p * words;
+        uint64_t carry = 1;
+
+        for (size_t w = 0; w < words; w++)
+        {
+            uint64_t next_carry = state[w] >> 63;
+            state[w] = ((state[w] << 1) | carry) & mask[w];
+            carry = next_carry;
+        }
+
+        if (state[words - 1] & accept)
+        {
+            return p - segment->len + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the leftmost match of a segment in [pos, end), or NULL
+ */
+static const char *find_segment(const pattern_segment *segment, const char *pos, const char *end)
+{
+    if (segment->masks == NULL)
+    {
+        return scan_find(&segment->needle, pos, (size_t) (end - pos));
+    }
+
+    return find_wildcard_segment(segment, pos, end);
+}
+
+/**
+ * Check whether a segment matches the bytes at pos, which must hold at least segment->len
+ */
+static bool segment_at(const pattern_segment *segment, const char *pos, bool ignore_case)
+{
+    if (segment->masks == NULL)
+    {
+        return span_equal(pos, segment->text, segment->len, ignore_case);
+    }
+
+    for (size_t i = 0; i < segment->len; i++)
+    {
+        const uint64_t *mask = segment->masks + (unsigned char) pos[i] * segment->words;
+        if (!(mask[i / 64] >> (i % 64) & 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Simple pattern matching function that supports * and ? wildcards
+ * * matches zero or more characters
+ * ? matches exactly one character
+ *
+ * The pattern can match anywhere in the line, so placing every segment at its leftmost
+ * possible position after the previous one finds a match whenever one exists. Each segment
+ * search resumes where the previous one ended, so a line is scanned once in total and there
+ * is no backtracking.
+ *
+ * Under -a a segment tied to an edge of the line is compared in place first, and the free
+ * segments are placed between the two.
+ */
+static bool match_pattern(const compiled_pattern *pattern, const char *line, size_t line_len)
+{
+    const char *pos = line;
+    const char *line_end = line + line_len;
+    size_t first = 0;
+    size_t last = pattern->segment_count;
+
+    if (pattern->anchor_start && last > 0)
+    {
+        const pattern_segment *segment = &pattern->segments[0];
+        if (segment->len > line_len || !segment_at(segment, pos, pattern->ignore_case))
+        {
+            return false;
+        }
+        pos += segment->len;
+        first = 1;
+    }
+
+    if (pattern->anchor_end && last > first)
+    {
+        const pattern_segment *segment = &pattern->segments[last - 1];
+        if (segment->len > (size_t) (line_end - pos)
+            || !segment_at(segment, line_end - segment->len, pattern->ignore_case))
+        {
+            return false;
+        }
+        line_end -= segment->len;
+        last--;
+    }
+    else if (pattern->anchor_end && pattern->anchor_start)
+    {
+        // One segment, or none, tied to both edges: "^text$" or "^$"
+        return pos == line_end;
+    }
+
+    for (size_t s = first; s < last; s++)
+    {
+        const pattern_segment *segment = &pattern->segments[s];
+        const char *hit = find_segment(segment, pos, line_end);
+
+        if (hit == NULL)
+        {
+            return false;
+        }
+
+        pos = hit + segment->len;
+    }
+
+    return true;
+}
+
+/**
+ * Prepare the search state of one wildcard segment, returns false if memory runs out
+ */
+static bool compile_segment(pattern_segment *segment, bool ignore_case)
+{
+    segment->masks = NULL;
+    segment->words = 0;
+
+    if (memchr(segment->text, '?', segment->len) == NULL)
+    {
+        scan_needle_init(&segment->needle, segment->text, segment->len, ignore_case);
+        return true;
+    }
+
+    segment->words = (segment->len + 63) / 64;
+    segment->masks = calloc(256 * segment->words, sizeof(*segment->masks));
+    if (segment->masks == NULL)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < segment->len; i++)
+    {
+        unsigned char c = (unsigned char) segment->text[i];
+        uint64_t bit = UINT64_C(1) << (i % 64);
+
+        for (unsigned b = 0; b < 256; b++)
+        {
+            unsigned char folded = ignore_case ? scan_fold_table[b] : (unsigned char) b;
+            if (c == '?' || folded == c)
+            {
+                segment->masks[b * segment->words + i / 64] |= bit;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * -a "^body": the line starts with the body
+ */
+static bool match_prefix(const compiled_pattern *pattern, const char *line, size_t line_len)
+{
+    return line_len >= pattern->len
+           && span_equal(line, pattern->text, pattern->len, pattern->ignore_case);
+}
+
+/**
+ * -a "body$": the line ends with the body, the line end is known so nothing else is read
+ */
+static bool match_suffix(const compiled_pattern *pattern, const char *line, size_t line_len)
+{
+    return line_len >= pattern->len
+           && span_equal(
+               line + line_len - pattern->len, pattern->text, pattern->len, pattern->ignore_case);
+}
+
+/**
+ * -a "^body$": the line is the body
+ */
+static bool match_exact(const compiled_pattern *pattern, const char *line, size_t line_len)
+{
+    return line_len == pattern->len
+           && span_equal(line, pattern->text, pattern->len, pattern->ignore_case);
+}
+
+/**
+ * Compile count regular expressions into one PATTERN_REGEX
+ */
+static bool compile_regex(compiled_pattern *pattern,
+                          const char *const *sources,
+                          size_t count,
+                          const grep_options *opts)
+{
+    regex_program *re = &pattern->regex;
+
+    memset(pattern, 0, sizeof(*pattern));
+    pattern->kind = PATTERN_REGEX;
+    pattern->ignore_case = opts->ignore_case;
+
+    if (!regex_compile(re, sources, count, opts->ignore_case, &pattern->error))
+    {
+        return false;
+    }
+
+    // Only lines holding one of the required literals are handed to the expression
+    if (re->literal_count == 1)
+    {
+        scan_needle_init(&pattern->needle, re->literals[0], re->literal_lens[0], opts->ignore_case);
+        pattern->prefilter = &pattern->needle;
+    }
+    else if (re->literal_count > 1)
+    {
+        if (!ac_build(&pattern->automaton,
+                      (const char *const *) re->literals,
+                      re->literal_lens,
+                      re->literal_count,
+                      opts->ignore_case))
+        {
+            regex_free(re);
+            return false;
+        }
+        pattern->prefilter_set = &pattern->automaton;
+    }
+    pattern->prefilter_exact = re->literals_exact;
+    return true;
+}
+
+/**
+ * Pick the longest run of bytes without wildcards as the prefilter of a -w pattern
+ * When the pattern is a single such run between stars, a hit is a match.
+ */
+static void compile_wildcard_prefilter(compiled_pattern *pattern)
+{
+    const char *best = NULL;
+    size_t best_len = 0;
+
+    for (size_t s = 0; s < pattern->segment_count; s++)
+    {
+        const pattern_segment *segment = &pattern->segments[s];
+        const char *start = segment->text;
+        const char *end = segment->text + segment->len;
+
+        while (start < end)
+        {
+            const char *stop = memchr(start, '?', (size_t) (end - start));
+            stop = stop != NULL ? stop : end;
+
+            if ((size_t) (stop - start) > best_len)
+            {
+                best = start;
+                best_len = (size_t) (stop - start);
+            }
+            start = stop + 1;
+        }
+    }
+
+    if (best_len == 0 || memchr(best, '\n', best_len) != NULL)
+    {
+        return;
+    }
+
+    scan_needle_init(&pattern->needle, best, best_len, pattern->ignore_case);
+    pattern->prefilter = &pattern->needle;
+    pattern->prefilter_exact = pattern->segment_count == 1 && best_len == pattern->segments[0].len
+                               && !pattern->anchor_start && !pattern->anchor_end;
+}
+
+bool pattern_compile(compiled_pattern *pattern, const char *source, const grep_options *opts)
+{
+    const char *body = source;
+    size_t len = strlen(source);
+
+    // -E covers anchors and wildcards with its own syntax
+    if (opts->use_regex)
+    {
+        return compile_regex(pattern, &source, 1, opts);
+    }
+
+    memset(pattern, 0, sizeof(*pattern));
+    pattern->ignore_case = opts->ignore_case;
+
+    if (opts->use_anchors)
+    {
+        if (len > 0 && body[0] == '^')
+        {
+            pattern->anchor_start = true;
+            body++;
+            len--;
+        }
+        if (len > 0 && body[len - 1] == '$')
+        {
+            pattern->anchor_end = true;
+            len--;
+        }
+    }
+
+    // Each anchor combination gets its own kernel, wildcards handle the anchors themselves
+    if (opts->use_wildcards)
+    {
+        pattern->kind = PATTERN_WILDCARD;
+
+        // A star at an anchored edge lets the pattern float again
+        pattern->anchor_start = pattern->anchor_start && !(len > 0 && body[0] == '*');
+        pattern->anchor_end = pattern->anchor_end && !(len > 0 && body[len - 1] == '*');
+    }
+    else if (pattern->anchor_start && pattern->anchor_end)
+    {
+        pattern->kind = PATTERN_EXACT;
+    }
+    else if (pattern->anchor_start)
+    {
+        pattern->kind = PATTERN_PREFIX;
+    }
+    else if (pattern->anchor_end)
+    {
+        pattern->kind = PATTERN_SUFFIX;
+    }
+    else
+    {
+        pattern->kind = PATTERN_LITERAL;
+    }
+
+    pattern->text = malloc(len + 1);
+    if (pattern->text == NULL)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char) body[i];
+        pattern->text[i] = (char) (opts->ignore_case ? scan_fold_table[c] : c);
+    }
+    pattern->text[len] = '\0';
+    pattern->len = len;
+    pattern->has_newline = memchr(pattern->text, '\n', len) != NULL;
+    scan_needle_init(&pattern->needle, pattern->text, len, opts->ignore_case);
+
+    // The literal body must appear in every matching line and never spans a newline
+    if (pattern->kind != PATTERN_WILDCARD && len > 0 && !pattern->has_newline)
+    {
+        pattern->prefilter = &pattern->needle;
+        pattern->prefilter_exact = !pattern->anchor_start && !pattern->anchor_end;
+    }
+
+    if (pattern->kind == PATTERN_WILDCARD)
+    {
+        // At most one segment more than there are stars
+        size_t max_segments = 1;
+        for (size_t i = 0; i < len; i++)
+        {
+            max_segments += pattern->text[i] == '*';
+        }
+
+        pattern->segments = malloc(max_segments * sizeof(*pattern->segments));
+        if (pattern->segments == NULL)
+        {
+            pattern_free(pattern);
+            return false;
+        }
+
+        // Split at every '*', runs of stars and stars at the edges leave no segment behind
+        const char *start = pattern->text;
+        const char *end = pattern->text + len;
+        while (start < end)
+        {
+            const char *star = memchr(start, '*', (size_t) (end - start));
+            const char *stop = star != NULL ? star : end;
+
+            if (stop > start)
+            {
+                pattern_segment *segment = &pattern->segments[pattern->segment_count++];
+                segment->text = start;
+                segment->len = (size_t) (stop - start);
+
+                if (!compile_segment(segment, opts->ignore_case))
+                {
+                    pattern_free(pattern);
+                    return false;
+                }
+            }
+            start = stop + (star != NULL);
+        }
+
+        compile_wildcard_prefilter(pattern);
+    }
+
+    return true;
+}
+
+bool pattern_compile_set(compiled_pattern *pattern,
+                         const char *const *sources,
+                         size_t count,
+                         const grep_options *opts)
+{
+    if (opts->use_regex)
+    {
+        return compile_regex(pattern, sources, count, opts);
+    }
+
+    if (count == 1)
+    {
+        return pattern_compile(pattern, sources[0], opts);
+    }
+
+    memset(pattern, 0, sizeof(*pattern));
+    pattern->kind = PATTERN_SET;
+    pattern->ignore_case = opts->ignore_case;
+
+    pattern->alternatives = calloc(count > 0 ? count : 1, sizeof(*pattern->alternatives));
+    if (pattern->alternatives == NULL)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!pattern_compile(&pattern->alternatives[i], sources[i], opts))
+        {
+            pattern_free(pattern);
+            return false;
+        }
+        pattern->alternative_count++;
+    }
+
+    // One member without a literal to look for means every line must be tried anyway
+    bool usable = count > 0;
+    bool exact = true;
+    for (size_t i = 0; i < count && usable; i++)
+    {
+        usable = pattern->alternatives[i].prefilter != NULL;
+        exact = exact && pattern->alternatives[i].prefilter_exact;
+    }
+
+    if (!usable)
+    {
+        return true;
+    }
+
+    const char **texts = malloc(count * sizeof(*texts));
+    size_t *lens = malloc(count * sizeof(*lens));
+    bool built = false;
+
+    if (texts != NULL && lens != NULL)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            texts[i] = pattern->alternatives[i].prefilter->text;
+            lens[i] = pattern->alternatives[i].prefilter->len;
+        }
+        built = ac_build(&pattern->automaton, texts, lens, count, opts->ignore_case);
+    }
+
+    free(texts);
+    free(lens);
+
+    if (!built)
+    {
+        pattern_free(pattern);
+        return false;
+    }
+
+    pattern->prefilter_set = &pattern->automaton;
+    pattern->prefilter_exact = exact;
+    return true;
+}
+
+void pattern_free(compiled_pattern *pattern)
+{
+    if (pattern->kind == PATTERN_REGEX)
+    {
+        regex_free(&pattern->regex);
+    }
+
+    for (size_t i = 0; i < pattern->alternative_count; i++)
+    {
+        pattern_free(&pattern->alternatives[i]);
+    }
+    free(pattern->alternatives);
+    pattern->alternatives = NULL;
+    pattern->alternative_count = 0;
+
+    if (pattern->prefilter_set != NULL)
+    {
+        ac_free(&pattern->automaton);
+        pattern->prefilter_set = NULL;
+    }
+
+    for (size_t s = 0; s < pattern->segment_count; s++)
+    {
+        free(pattern->segments[s].masks);
+    }
+    free(pattern->text);
+    free(pattern->segments);
+    pattern->text = NULL;
+    pattern->segments = NULL;
+    pattern->segment_count = 0;
+}
+
+bool pattern_has_prefilter(const compiled_pattern *pattern)
+{
+    return pattern->prefilter != NULL || pattern->prefilter_set != NULL;
+}
+
+const char *pattern_find_candidate(const compiled_pattern *pattern, const char *buf, size_t len)
+{
+    if (pattern->prefilter_set != NULL)
+    {
+        return ac_find(pattern->prefilter_set, buf, len);
+    }
+
+    return scan_find(pattern->prefilter, buf, len);
+}
+
+size_t pattern_literal_count(const compiled_pattern *pattern)
+{
+    if (pattern->prefilter != NULL)
+    {
+        return 1;
+    }
+    if (pattern->prefilter_set == NULL)
+    {
+        return 0;
+    }
+
+    // A set prefilter holds either the regex literals or one literal per member
+    return pattern->kind == PATTERN_REGEX ? pattern->regex.literal_count
+                                          : pattern->alternative_count;
+}
+
+const char *pattern_literal(const compiled_pattern *pattern, size_t i, size_t *len)
+{
+    if (pattern->prefilter != NULL)
+    {
+        *len = pattern->prefilter->len;
+        return pattern->prefilter->text;
+    }
+    if (pattern->kind == PATTERN_REGEX)
+    {
+        *len = pattern->regex.literal_lens[i];
+        return pattern->regex.literals[i];
+    }
+
+    *len = pattern->alternatives[i].prefilter->len;
+    return pattern->alternatives[i].prefilter->text;
+}
+
+/**
+ * Check whether any member of a pattern set matches the line
+ */
+static bool match_any(const compiled_pattern *pattern, const char *line, size_t line_len)
+{
+    // When the automaton is exact it decides for all members in one pass
+    if (pattern->prefilter_set != NULL && pattern->prefilter_exact)
+    {
+        return ac_find(pattern->prefilter_set, line, line_len) != NULL;
+    }
+
+    for (size_t i = 0; i < pattern->alternative_count; i++)
+    {
+        if (pattern_matches(&pattern->alternatives[i], line, line_len))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool pattern_matches(const compiled_pattern *pattern, const char *line, size_t line_len)
+{
+    switch (pattern->kind)
+    {
+    case PATTERN_PREFIX:
+        return match_prefix(pattern, line, line_len);
+    case PATTERN_SUFFIX:
+        return match_suffix(pattern, line, line_len);
+    case PATTERN_EXACT:
+        return match_exact(pattern, line, line_len);
+    case PATTERN_WILDCARD:
+        return match_pattern(pattern, line, line_len);
+    case PATTERN_SET:
+        return match_any(pattern, line, line_len);
+    case PATTERN_REGEX:
+        return regex_matches(&pattern->regex, line, line_len);
+    case PATTERN_LITERAL:
+    default:
+        return scan_find(&pattern->needle, line, line_len) != NULL;
+    }
+}
+
+/**
+ * Span of a wildcard pattern for pattern_match_span()
+ * Placing every segment leftmost, as match_pattern() does, gives the leftmost start. The end
+ * then moves as far right as it can: to the line end after a trailing star, else to the
+ * rightmost place of the last segment, unless that segment is the one the start hangs on.
+ */
+static bool span_pattern(const compiled_pattern *pattern,
+                         const char *line,
+                         size_t line_len,
+                         size_t from,
+                         size_t *start,
+                         size_t *end)
+{
+    const char *pos = line + from;
+    const char *line_end = line + line_len;
+    const char *match_start = NULL;
+    size_t first = 0;
+    size_t last = pattern->segment_count;
+    bool leading_star = pattern->len > 0 && pattern->text[0] == '*';
+    bool trailing_star = pattern->len > 0 && pattern->text[pattern->len - 1] == '*';
+
+    if (pattern->anchor_start)
+    {
+        if (from > 0)
+        {
+            return false;
+        }
+        match_start = line;
+
+        if (last > 0)
+        {
+            const pattern_segment *segment = &pattern->segments[0];
+            if (segment->len > line_len || !segment_at(segment, pos, pattern->ignore_case))
+            {
+                return false;
+            }
+            pos += segment->len;
+            first = 1;
+        }
+    }
+    else if (leading_star)
+    {
+        match_start = pos;
+    }
+
+    if (pattern->anchor_end && last > first)
+    {
+        const pattern_segment *segment = &pattern->segments[last - 1];
+        if (segment->len > (size_t) (line_end - pos)
+            || !segment_at(segment, line_end - segment->len, pattern->ignore_case))
+        {
+            return false;
+        }
+        line_end -= segment->len;
+        last--;
+    }
+    else if (pattern->anchor_end && pattern->anchor_start && pos != line_end)
+    {
+        return false;
+    }
+
+    for (size_t s = first; s < last; s++)
+    {
+        const pattern_segment *segment = &pattern->segments[s];
+        const char *hit = find_segment(segment, pos, line_end);
+
+        if (hit == NULL)
+        {
+            return false;
+        }
+
+        match_start = match_start != NULL ? match_start : hit;
+        pos = hit + segment->len;
+    }
+
+    // Without a free segment the match is the tail tied to the line end, or empty
+    if (match_start == NULL)
+    {
+        match_start = pattern->anchor_end ? line_end : pos;
+    }
+
+    const char *match_end = pos;
+    if (pattern->anchor_end || trailing_star)
+    {
+        match_end = line + line_len;
+    }
+    else if (last > first && (last - 1 > first || pattern->anchor_start || leading_star))
+    {
+        const pattern_segment *segment = &pattern->segments[last - 1];
+
+        // The leftmost place found above is the last one to try
+        for (const char *p = line_end - segment->len; p > pos - segment->len; p--)
+        {
+            if (segment_at(segment, p, pattern->ignore_case))
+            {
+                match_end = p + segment->len;
+                break;
+            }
+        }
+    }
+
+    *start = (size_t) (match_start - line);
+    *end = (size_t) (match_end - line);
+    return true;
+}
+
+/**
+ * Span of a pattern set, the leftmost and then longest of its members' spans
+ */
+static bool span_any(const compiled_pattern *pattern,
+                     const char *line,
+                     size_t line_len,
+                     size_t from,
+                     size_t *start,
+                     size_t *end)
+{
+    bool found = false;
+
+    for (size_t i = 0; i < pattern->alternative_count; i++)
+    {
+        size_t s;
+        size_t e;
+
+        if (pattern_match_span(&pattern->alternatives[i], line, line_len, from, &s, &e)
+            && (!found || s < *start || (s == *start && e > *end)))
+        {
+            found = true;
+            *start = s;
+            *end = e;
+        }
+    }
+    return found;
+}
+
+bool pattern_match_span(const compiled_pattern *pattern,
+                        const char *line,
+                        size_t line_len,
+                        size_t from,
+                        size_t *start,
+                        size_t *end)
+{
+    const char *hit;
+    bool found;
+
+    switch (pattern->kind)
+    {
+    case PATTERN_PREFIX:
+        found = from == 0 && match_prefix(pattern, line, line_len);
+        *start = 0;
+        *end = pattern->len;
+        return found;
+    case PATTERN_SUFFIX:
+        found = line_len >= pattern->len && line_len - pattern->len >= from
+                && match_suffix(pattern, line, line_len);
+        *start = line_len - pattern->len;
+        *end = line_len;
+        return found;
+    case PATTERN_EXACT:
+        found = from == 0 && match_exact(pattern, line, line_len);
+        *start = 0;
+        *end = line_len;
+        return found;
+    case PATTERN_WILDCARD:
+        return span_pattern(pattern, line, line_len, from, start, end);
+    case PATTERN_SET:
+        return span_any(pattern, line, line_len, from, start, end);
+    case PATTERN_REGEX:
+        return regex_find(&pattern->regex, line, line_len, from, start, end);
+    case PATTERN_LITERAL:
+    default:
+        hit = scan_find(&pattern->needle, line + from, line_len - from);
+        if (hit == NULL)
+        {
+            return false;
+        }
+        *start = (size_t) (hit - line);
+        *end = *start + pattern->len;
+        return true;
+    }
+}
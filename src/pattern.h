@@ -0,0 +1,129 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ahocorasick.h"
+#include "grep.h"
+#include "regex.h"
+#include "scan.h"
+
+typedef enum
+{
+    PATTERN_LITERAL,   // plain substring search
+    PATTERN_PREFIX,    // -a "^body", a compare at the line start
+    PATTERN_SUFFIX,    // -a "body$", a compare against the known line end
+    PATTERN_EXACT,     // -a "^body$", a length check and one compare
+    PATTERN_WILDCARD,  // -w, * and ? wildcards, tied to the line edges under -a
+    PATTERN_SET,       // -e/-f, a line matches if any of several patterns does
+    PATTERN_REGEX,     // -E, extended regular expressions
+} pattern_kind;
+
+/**
+ * The text between two '*' of a wildcard pattern, '?' inside it matches any single byte
+ * Plain segments use the literal kernel, segments with '?' a bit-parallel Shift-And scan.
+ */
+typedef struct
+{
+    const char *text;  // points into compiled_pattern.text
+    size_t len;
+    scan_needle needle;  // segments without '?'
+    uint64_t *masks;     // segments with '?': 256 rows of words, bit i set if the byte fits text[i]
+    size_t words;
+} pattern_segment;
+
+/**
+ * A pattern preprocessed once after option parsing
+ * Matchers only ever read it, so the per-line loop does no pattern work at all.
+ */
+typedef struct compiled_pattern compiled_pattern;
+
+struct compiled_pattern
+{
+    pattern_kind kind;
+    bool ignore_case;
+    char *text;       // pattern body without anchors, lower-cased under -i
+    size_t len;
+    bool has_newline;  // the body contains '\n' and so can never match inside one line
+    scan_needle needle;  // search kernel state for the literal body
+    bool anchor_start;  // -a pattern started with ^ and the wildcard body does not with *
+    bool anchor_end;    // -a pattern ended with $ and the wildcard body does not with *
+    pattern_segment *segments;  // -w pattern split at each '*'
+    size_t segment_count;
+    compiled_pattern *alternatives;  // PATTERN_SET members
+    size_t alternative_count;
+    ac_automaton automaton;  // PATTERN_SET: the prefilter literals of every member
+    const scan_needle *prefilter;      // literal every matching line contains, NULL if none
+    const ac_automaton *prefilter_set;  // or one of several literals, NULL if none
+    bool prefilter_exact;  // a prefilter hit alone proves the line matches
+    regex_program regex;   // PATTERN_REGEX: every -e/-f expression in one program
+    const char *error;     // why compilation failed, NULL when memory ran out
+};
+
+/**
+ * Compile source according to opts
+ * Returns false if memory runs out or, under -E, with pattern->error set for a syntax error.
+ */
+bool pattern_compile(compiled_pattern *pattern, const char *source, const grep_options *opts);
+
+/**
+ * Compile count patterns into one that matches wherever any of them does
+ * The literals the members require are combined into a single Aho-Corasick automaton, so a
+ * buffer is scanned once for the whole set. Regular expressions are joined into a single
+ * program instead. Fails as pattern_compile() does.
+ */
+bool pattern_compile_set(compiled_pattern *pattern,
+                         const char *const *sources,
+                         size_t count,
+                         const grep_options *opts);
+
+/**
+ * Release the memory held by a compiled pattern
+ */
+void pattern_free(compiled_pattern *pattern);
+
+/**
+ * Check whether the pattern has a prefilter, without one every line has to be matched
+ */
+bool pattern_has_prefilter(const compiled_pattern *pattern);
+
+/**
+ * Find the first prefilter hit in the len bytes at buf, or NULL if there is none
+ * Only lines containing a hit can match, and the hit lies inside that line. Unless
+ * prefilter_exact is set, the enclosing line still has to be confirmed with pattern_matches().
+ */
+const char *pattern_find_candidate(const compiled_pattern *pattern, const char *buf, size_t len);
+
+/**
+ * Number of literals one of which every matching line contains, zero when there are none
+ * These are the prefilter literals, lower-cased under -i.
+ */
+size_t pattern_literal_count(const compiled_pattern *pattern);
+
+/**
+ * The i-th of the literals counted by pattern_literal_count(), its length in *len
+ */
+const char *pattern_literal(const compiled_pattern *pattern, size_t i, size_t *len);
+
+/**
+ * Check whether the line_len bytes at line (without the newline) match the pattern
+ */
+bool pattern_matches(const compiled_pattern *pattern, const char *line, size_t line_len);
+
+/**
+ * Find the leftmost match in the line_len bytes at line that starts at from or later, and of
+ * the matches starting there the longest, for -o and -b
+ * Returns false if there is none, else the match is [*start, *end), which may be empty.
+ * Anchors still refer to the whole line. Slower than pattern_matches(), meant for the lines
+ * already known to match.
+ */
+bool pattern_match_span(const compiled_pattern *pattern,
+                        const char *line,
+                        size_t line_len,
+                        size_t from,
+                        size_t *start,
+                        size_t *end);
+
+#endif
@@ -0,0 +1,297 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+typedef struct
+{
+    pool_task_fn fn;
+    void *arg;
+} pool_task;
+
+/**
+ * Per-worker task queue, a growable ring
+ * The owner takes from the front so tasks run roughly in submission order, thieves take from
+ * the back.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pool_task *tasks;
+    size_t cap;
+    size_t head;
+    size_t count;
+} task_queue;
+
+typedef struct
+{
+    pool *owner;
+    size_t index;
+    pthread_t thread;
+} pool_worker;
+
+struct pool
+{
+    pool_worker *workers;
+    task_queue *queues;
+    size_t threads;
+    size_t next_queue;  // round-robin target for pool_submit()
+
+    pthread_mutex_t lock;  // guards queued, running and stopping
+    pthread_cond_t work_ready;
+    pthread_cond_t idle;
+    size_t queued;
+    size_t running;
+    bool stopping;
+};
+
+static bool queue_push(task_queue *queue, pool_task task)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->count == queue->cap)
+    {
+        size_t cap = queue->cap > 0 ? queue->cap * 2 : 64;
+        pool_task *tasks = malloc(cap * sizeof(*tasks));
+        if (tasks == NULL)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            return false;
+        }
+
+        for (size_t i = 0; i < queue->count; i++)
+        {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->cap];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->cap = cap;
+        queue->head = 0;
+    }
+
+    queue->tasks[(queue->head + queue->count) % queue->cap] = task;
+    queue->count++;
+
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+static bool queue_take(task_queue *queue, pool_task *task, bool from_back)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->count > 0)
+    {
+        if (from_back)
+        {
+            *task = queue->tasks[(queue->head + queue->count - 1) % queue->cap];
+        }
+        else
+        {
+            *task = queue->tasks[queue->head];
+            queue->head = (queue->head + 1) % queue->cap;
+        }
+        queue->count--;
+        found = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+/**
+ * Take a task from the worker's own queue, or steal one from another worker
+ */
+static bool find_task(pool *p, size_t self, pool_task *task)
+{
+    if (queue_take(&p->queues[self], task, false))
+    {
+        return true;
+    }
+
+    for (size_t i = 1; i < p->threads; i++)
+    {
+        if (queue_take(&p->queues[(self + i) % p->threads], task, true))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Run a task claimed by the caller under p->lock, the lock is held again on return
+ */
+static void run_claimed(pool *p, size_t self)
+{
+    pool_task task;
+
+    p->queued--;
+    p->running++;
+    pthread_mutex_unlock(&p->lock);
+
+    // Tasks are queued before they are counted, so one is always there to take,
+    // but a racing worker may grab the one we looked at first
+    while (!find_task(p, self, &task))
+    {
+        sched_yield();
+    }
+    task.fn(task.arg);
+
+    pthread_mutex_lock(&p->lock);
+    p->running--;
+    if (p->queued == 0 && p->running == 0)
+    {
+        pthread_cond_broadcast(&p->idle);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    pool_worker *worker = arg;
+    pool *p = worker->owner;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;)
+    {
+        while (p->queued == 0 && !p->stopping)
+        {
+            pthread_cond_wait(&p->work_ready, &p->lock);
+        }
+
+        if (p->queued == 0 && p->stopping)
+        {
+            break;
+        }
+
+        run_claimed(p, worker->index);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    STATS_FLUSH();
+    return NULL;
+}
+
+pool *pool_create(size_t threads)
+{
+    pool *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    p->threads = threads > 0 ? threads : 1;
+    p->workers = calloc(p->threads, sizeof(*p->workers));
+    p->queues = calloc(p->threads, sizeof(*p->queues));
+    if (p->workers == NULL || p->queues == NULL)
+    {
+        free(p->workers);
+        free(p->queues);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_ready, NULL);
+    pthread_cond_init(&p->idle, NULL);
+
+    for (size_t i = 0; i < p->threads; i++)
+    {
+        pthread_mutex_init(&p->queues[i].lock, NULL);
+    }
+
+    for (size_t i = 0; i < p->threads; i++)
+    {
+        p->workers[i].owner = p;
+        p->workers[i].index = i;
+        if (pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]) != 0)
+        {
+            // Run with the workers that did start
+            p->threads = i;
+            break;
+        }
+    }
+
+    if (p->threads == 0)
+    {
+        pool_destroy(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+bool pool_submit(pool *p, pool_task_fn fn, void *arg)
+{
+    pool_task task = {fn, arg};
+
+    pthread_mutex_lock(&p->lock);
+    size_t target = p->next_queue;
+    p->next_queue = (p->next_queue + 1) % p->threads;
+    pthread_mutex_unlock(&p->lock);
+
+    if (!queue_push(&p->queues[target], task))
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->queued++;
+    pthread_cond_signal(&p->work_ready);
+    pthread_mutex_unlock(&p->lock);
+
+    return true;
+}
+
+bool pool_run_one(pool *p)
+{
+    bool ran = false;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->queued > 0)
+    {
+        // The caller may not be a worker, it simply starts looking at the first queue
+        run_claimed(p, 0);
+        ran = true;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return ran;
+}
+
+void pool_destroy(pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->queued > 0 || p->running > 0)
+    {
+        pthread_cond_wait(&p->idle, &p->lock);
+    }
+    p->stopping = true;
+    pthread_cond_broadcast(&p->work_ready);
+    pthread_mutex_unlock(&p->lock);
+
+    for (size_t i = 0; i < p->threads; i++)
+    {
+        pthread_join(p->workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < p->threads; i++)
+    {
+        pthread_mutex_destroy(&p->queues[i].lock);
+        free(p->queues[i].tasks);
+    }
+
+    pthread_cond_destroy(&p->idle);
+    pthread_cond_destroy(&p->work_ready);
+    pthread_mutex_destroy(&p->lock);
+    free(p->queues);
+    free(p->workers);
+    free(p);
+}
@@ -0,0 +1,35 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*pool_task_fn)(void *arg);
+
+typedef struct pool pool;
+
+/**
+ * Start a pool of worker threads, each with its own task queue
+ * Idle workers steal from the back of the other queues. Returns NULL on failure.
+ */
+pool *pool_create(size_t threads);
+
+/**
+ * Queue fn(arg) to run on one of the workers
+ * Returns false if the task could not be queued.
+ */
+bool pool_submit(pool *p, pool_task_fn fn, void *arg);
+
+/**
+ * Run one queued task on the calling thread, returns false if nothing was queued
+ * A task that waits for tasks it submitted calls this in between, so waiting never takes a
+ * worker away from the pool.
+ */
+bool pool_run_one(pool *p);
+
+/**
+ * Wait for every queued task to finish, stop the workers, and free the pool
+ */
+void pool_destroy(pool *p);
+
+#endif
@@ -0,0 +1,197 @@
+#include "reader.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/**
+ * Map the file behind fd, map_file() without the timing
+ */
+static bool map_whole_file(int fd, mapped_file *map)
+{
+    struct stat st;
+
+    map->data = NULL;
+    map->size = 0;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return false;
+    }
+
+    // mmap() rejects zero-length mappings, an empty file is simply an empty buffer
+    if (st.st_size == 0)
+    {
+        return true;
+    }
+
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    // We only ever walk the file front to back, so ask for aggressive read-ahead
+    madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    map->data = data;
+    map->size = (size_t) st.st_size;
+    return true;
+}
+
+bool map_file(int fd, mapped_file *map)
+{
+    uint64_t start = STATS_CLOCK();
+    bool mapped = map_whole_file(fd, map);
+
+    STATS_ELAPSED(io_ns, start);
+    return mapped;
+}
+
+void unmap_file(mapped_file *map)
+{
+    if (map->data != NULL)
+    {
+        munmap((void *) map->data, map->size);
+    }
+    map->data = NULL;
+    map->size = 0;
+}
+
+bool stream_reader_init(stream_reader *reader, int fd, arena *scratch)
+{
+    reader->fd = fd;
+    reader->source = NULL;
+    reader->scratch = scratch;
+    reader->buf =
+        scratch != NULL ? arena_alloc(scratch, READ_BUFFER_SIZE) : malloc(READ_BUFFER_SIZE);
+    reader->cap = READ_BUFFER_SIZE;
+    reader->start = 0;
+    reader->end = 0;
+    reader->keep = 0;
+    reader->follow = false;
+    reader->eof = false;
+    reader->error = false;
+
+    return reader->buf != NULL;
+}
+
+/**
+ * Read the next block, stream_reader_next() without the timing
+ */
+static bool read_next_block(stream_reader *reader, const char **block, size_t *len)
+{
+    // Move the kept lines and the unfinished last line of the previous block to the front
+    size_t keep = reader->keep < reader->start ? reader->keep : reader->start;
+    size_t pending = reader->end - (reader->start - keep);
+    if (reader->start > keep)
+    {
+        memmove(reader->buf, reader->buf + reader->start - keep, pending);
+        reader->start = keep;
+        reader->end = pending;
+    }
+
+    // The carried over bytes hold no newline the next block could end at
+    size_t scanned = pending;
+
+    while (!reader->eof)
+    {
+        // Only grow when a single line does not fit in the buffer
+        if (reader->end == reader->cap)
+        {
+            size_t cap = reader->cap * 2;
+            char *grown = reader->scratch != NULL
+                              ? arena_grow(reader->scratch, reader->buf, reader->cap, cap)
+                              : realloc(reader->buf, cap);
+            if (grown == NULL)
+            {
+                reader->error = true;
+                return false;
+            }
+            reader->buf = grown;
+            reader->cap = cap;
+        }
+
+        char *dst = reader->buf + reader->end;
+        size_t room = reader->cap - reader->end;
+        ssize_t n = reader->source != NULL ? decoder_read(reader->source, dst, room)
+                                           : read(reader->fd, dst, room);
+        if (n < 0)
+        {
+            if (reader->source == NULL && errno == EINTR)
+            {
+                continue;
+            }
+            reader->error = true;
+            return false;
+        }
+
+        // Following, the unfinished line stays put until the rest of it is written
+        if (n == 0 && reader->follow)
+        {
+            return false;
+        }
+        if (n == 0)
+        {
+            reader->eof = true;
+            break;
+        }
+
+        reader->end += (size_t) n;
+
+        const char *newline =
+            memrchr(reader->buf + scanned, '\n', reader->end - scanned);
+        if (newline != NULL)
+        {
+            reader->start = (size_t) (newline - reader->buf) + 1;
+            *block = reader->buf + keep;
+            *len = reader->start - keep;
+            return true;
+        }
+        scanned = reader->end;
+    }
+
+    // At end of input whatever is left forms the final line
+    if (reader->end == keep)
+    {
+        return false;
+    }
+
+    reader->start = reader->end;
+    *block = reader->buf + keep;
+    *len = reader->end - keep;
+    return true;
+}
+
+bool stream_reader_next(stream_reader *reader, const char **block, size_t *len)
+{
+    uint64_t start = STATS_CLOCK();
+    bool more = read_next_block(reader, block, len);
+
+    STATS_ELAPSED(io_ns, start);
+    return more;
+}
+
+void stream_reader_reset(stream_reader *reader)
+{
+    reader->start = 0;
+    reader->end = 0;
+    reader->keep = 0;
+    reader->eof = false;
+    reader->error = false;
+}
+
+void stream_reader_free(stream_reader *reader)
+{
+    if (reader->scratch == NULL)
+    {
+        free(reader->buf);
+    }
+    reader->buf = NULL;
+    reader->cap = 0;
+}
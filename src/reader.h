@@ -0,0 +1,78 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "decompress.h"
+
+// Initial size of the buffer used to read streams, it only grows for longer lines
+#define READ_BUFFER_SIZE (256 * 1024)
+
+/**
+ * A regular file mapped read-only into memory so it can be scanned in place
+ */
+typedef struct
+{
+    const char *data;
+    size_t size;
+} mapped_file;
+
+/**
+ * Map the whole file behind fd and hint the kernel that it will be read sequentially.
+ * Returns false if the descriptor is not a mappable regular file (pipes, ttys, ...);
+ * the caller should then fall back to reading it as a stream.
+ */
+bool map_file(int fd, mapped_file *map);
+
+/**
+ * Release a mapping created by map_file()
+ */
+void unmap_file(mapped_file *map);
+
+/**
+ * Chunked reader for stdin, pipes, and anything else that cannot be mapped
+ * Data is read with read() into one reusable buffer and handed out in blocks of whole lines
+ */
+typedef struct
+{
+    int fd;
+    decoder *source;  // decompressed data to read instead of fd, NULL by default
+    arena *scratch;   // where buf lives, NULL for the heap
+    char *buf;
+    size_t cap;    // allocated size of buf
+    size_t start;  // first byte not yet handed out
+    size_t end;    // one past the last byte read
+    size_t keep;   // bytes at the end of the last block to keep right in front of the next one
+    bool follow;   // at the end of the input wait for more, an unfinished line is not a line yet
+    bool eof;
+    bool error;
+} stream_reader;
+
+/**
+ * Prepare a reader for fd, its buffer taken from scratch or, when that is NULL, the heap
+ * Returns false if the buffer cannot be allocated.
+ */
+bool stream_reader_init(stream_reader *reader, int fd, arena *scratch);
+
+/**
+ * Return the next block of complete lines in *block and *len
+ * Every line in the block ends with a newline, except possibly the last line of the input.
+ * The block stays valid until the next call, apart from its last keep bytes, which are moved
+ * to just before the next block. Returns false at end of input or on error.
+ */
+bool stream_reader_next(stream_reader *reader, const char **block, size_t *len);
+
+/**
+ * Forget everything read so far, once the descriptor was moved back to the start
+ */
+void stream_reader_reset(stream_reader *reader);
+
+/**
+ * Free the reader buffer, the descriptor is left open
+ * A buffer from an arena is only given back when the arena is released.
+ */
+void stream_reader_free(stream_reader *reader);
+
+#endif
@@ -0,0 +1,1872 @@
+#include "regex.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+
+// Programs longer than this are refused, large counted repetitions multiply quickly
+#define REGEX_MAX_INSTS 200000
+
+// Counted repetitions above this are refused, as RE_DUP_MAX
+#define REGEX_MAX_REPEAT 255
+
+// Longest required literal worked out for the prefilter
+#define REGEX_MAX_LITERAL 255
+
+// Deepest nesting of parentheses the parser recurses into
+#define REGEX_MAX_DEPTH 1000
+
+// Bytes each thread may spend on cached DFA states
+#define REGEX_CACHE_SIZE (2 * 1024 * 1024)
+
+// A cache that fills up before searching this many bytes per state is not paying off
+#define REGEX_MIN_BYTES_PER_STATE 10
+
+// After this many unprofitable flushes the thread matches with the NFA only
+#define REGEX_MAX_THRASHES 3
+
+#define NO_NODE UINT32_MAX
+#define NO_STATE UINT32_MAX
+
+// Transition entries hold the target's row offset, this bit marks targets that end the search
+#define TRANS_SPECIAL UINT32_C(0x80000000)
+#define REPEAT_INF UINT32_MAX
+
+// DFA state flags
+#define STATE_ACCEPT     0x01  // the line matches once this state is reached
+#define STATE_DEAD       0x02  // no match can follow
+#define STATE_AT_START   0x04  // nothing consumed yet, ^ still holds
+#define STATE_EOL_KNOWN  0x08  // STATE_EOL_ACCEPT has been worked out
+#define STATE_EOL_ACCEPT 0x10  // the line matches if it ends in this state
+
+typedef enum
+{
+    NODE_EMPTY,
+    NODE_SET,
+    NODE_BOL,
+    NODE_EOL,
+    NODE_CAT,
+    NODE_ALT,
+    NODE_REPEAT,
+} node_type;
+
+/**
+ * Syntax tree node, CAT and ALT keep their children as a sibling list
+ */
+typedef struct
+{
+    node_type type;
+    uint32_t set;  // NODE_SET
+    uint32_t first;  // first child
+    uint32_t last;   // last child, for appending
+    uint32_t next;   // next sibling
+    uint32_t min;    // NODE_REPEAT bounds, max REPEAT_INF for no bound
+    uint32_t max;
+} regex_node;
+
+typedef struct
+{
+    regex_program *re;
+    const char *pos;
+    const char *end;
+    bool fold;
+    const char *error;  // syntax error, NULL when memory ran out
+    regex_node *nodes;
+    size_t node_count;
+    size_t node_cap;
+    size_t set_cap;
+} regex_parser;
+
+/**
+ * What the analysis knows about the strings a node matches
+ */
+typedef struct
+{
+    bool is_exact;  // the node matches exactly the string in exact, nothing else
+    bool pure;      // and contains no ^ or $
+    char exact[REGEX_MAX_LITERAL];
+    size_t exact_len;
+    char must[REGEX_MAX_LITERAL];  // a string every match of the node contains
+    size_t must_len;
+} literal_info;
+
+/**
+ * Sparse set of program counters, cleared in constant time
+ */
+typedef struct
+{
+    uint32_t *dense;
+    uint32_t *sparse;
+    size_t count;
+} pc_set;
+
+/**
+ * Per-thread matching state: the cached DFA states and the NFA scratch space
+ */
+typedef struct regex_cache
+{
+    struct regex_cache *older;  // the cache of another thread matching with the same program
+    pc_set current;
+    pc_set next;
+    size_t *current_start;  // regex_find(): where the thread of each entry of current started
+    size_t *next_start;
+    uint32_t *stack;
+    uint32_t *key;  // scratch for the program counters of a state being looked up
+    size_t max_states;
+    size_t state_count;
+    uint32_t *trans;  // state * class_count + class: target row offset, NO_STATE until computed
+    uint8_t *flags;
+    uint32_t *set_start;  // per state, offset of its program counters in pcs
+    uint32_t *set_len;
+    uint32_t *pcs;
+    size_t pcs_len;
+    size_t pcs_cap;
+    uint32_t *table;  // open addressing hash of the states
+    size_t table_mask;
+    uint32_t start;  // state at the start of a line, NO_STATE until built
+    size_t bytes_since_flush;
+    unsigned thrashes;
+    bool use_nfa;  // the DFA kept thrashing, only the Pike VM is used
+} regex_cache;
+
+/**
+ * The caches of every thread of one program, kept so that they can be freed with it; a key's
+ * destructor only runs for threads exiting before the key is deleted
+ */
+struct regex_cache_list
+{
+    pthread_mutex_t lock;
+    regex_cache *head;
+    regex_cache *spare;  // Pike VM scratch for threads that cannot get a cache of their own
+    pthread_mutex_t spare_lock;
+};
+
+static uint32_t parse_alt(regex_parser *p, unsigned depth);
+
+static uint32_t new_node(regex_parser *p, node_type type)
+{
+    if (p->node_count == p->node_cap)
+    {
+        size_t cap = p->node_cap > 0 ? p->node_cap * 2 : 64;
+        regex_node *nodes = realloc(p->nodes, cap * sizeof(*nodes));
+        if (nodes == NULL)
+        {
+            return NO_NODE;
+        }
+        p->nodes = nodes;
+        p->node_cap = cap;
+    }
+
+    regex_node *node = &p->nodes[p->node_count];
+    node->type = type;
+    node->set = 0;
+    node->first = NO_NODE;
+    node->last = NO_NODE;
+    node->next = NO_NODE;
+    node->min = 0;
+    node->max = 0;
+    return (uint32_t) p->node_count++;
+}
+
+static void append_child(regex_parser *p, uint32_t parent, uint32_t child)
+{
+    regex_node *node = &p->nodes[parent];
+
+    if (node->first == NO_NODE)
+    {
+        node->first = child;
+    }
+    else
+    {
+        p->nodes[node->last].next = child;
+    }
+    node->last = child;
+}
+
+static void set_add(uint64_t *bits, unsigned b)
+{
+    bits[b >> 6] |= UINT64_C(1) << (b & 63);
+}
+
+static bool set_has(const uint64_t *bits, unsigned b)
+{
+    return (bits[b >> 6] >> (b & 63)) & 1;
+}
+
+/**
+ * Store a byte set in the program and wrap it in a node, applying -i folding and negation
+ */
+static uint32_t set_node(regex_parser *p, const uint64_t *bits, bool negate)
+{
+    regex_program *re = p->re;
+    uint64_t folded[4];
+
+    memcpy(folded, bits, sizeof(folded));
+
+    // A letter in the set lets in both of its cases
+    if (p->fold)
+    {
+        for (unsigned b = 0; b < 256; b++)
+        {
+            if (set_has(bits, b))
+            {
+                set_add(folded, scan_fold_table[b]);
+            }
+        }
+        for (unsigned b = 0; b < 256; b++)
+        {
+            if (set_has(folded, scan_fold_table[b]))
+            {
+                set_add(folded, b);
+            }
+        }
+    }
+
+    if (negate)
+    {
+        for (size_t w = 0; w < 4; w++)
+        {
+            folded[w] = ~folded[w];
+        }
+    }
+
+    if (re->set_count == p->set_cap)
+    {
+        size_t cap = p->set_cap > 0 ? p->set_cap * 2 : 16;
+        uint64_t(*sets)[4] = realloc(re->sets, cap * sizeof(*sets));
+        if (sets == NULL)
+        {
+            return NO_NODE;
+        }
+        re->sets = sets;
+        p->set_cap = cap;
+    }
+
+    uint32_t node = new_node(p, NODE_SET);
+    if (node != NO_NODE)
+    {
+        memcpy(re->sets[re->set_count], folded, sizeof(folded));
+        p->nodes[node].set = (uint32_t) re->set_count++;
+    }
+    return node;
+}
+
+static uint32_t byte_node(regex_parser *p, unsigned char c)
+{
+    uint64_t bits[4] = {0, 0, 0, 0};
+    set_add(bits, c);
+    return set_node(p, bits, false);
+}
+
+/**
+ * Add the bytes of a named class such as "alpha" to bits, returns false for unknown names
+ */
+static bool add_named_class(uint64_t *bits, const char *name, size_t len)
+{
+    static const struct
+    {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+        {"alnum", isalnum},
+        {"alpha", isalpha},
+        {"blank", isblank},
+        {"cntrl", iscntrl},
+        {"digit", isdigit},
+        {"graph", isgraph},
+        {"lower", islower},
+        {"print", isprint},
+        {"punct", ispunct},
+        {"space", isspace},
+        {"upper", isupper},
+        {"xdigit", isxdigit},
+    };
+
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+    {
+        if (strlen(classes[i].name) == len && memcmp(classes[i].name, name, len) == 0)
+        {
+            for (unsigned b = 0; b < 256; b++)
+            {
+                if (classes[i].test((int) b))
+                {
+                    set_add(bits, b);
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Parse a bracket expression, pos is just past the '['
+ */
+static uint32_t parse_bracket(regex_parser *p)
+{
+    uint64_t bits[4] = {0, 0, 0, 0};
+    bool negate = false;
+    bool first = true;
+
+    if (p->pos < p->end && *p->pos == '^')
+    {
+        negate = true;
+        p->pos++;
+    }
+
+    for (;;)
+    {
+        if (p->pos >= p->end)
+        {
+            p->error = "Unmatched [, [^, [:, [., or [=";
+            return NO_NODE;
+        }
+
+        unsigned char c = (unsigned char) *p->pos;
+
+        // A ']' right after the opening bracket is an ordinary member
+        if (c == ']' && !first)
+        {
+            p->pos++;
+            break;
+        }
+        first = false;
+
+        if (c == '[' && p->pos + 1 < p->end && (p->pos[1] == '.' || p->pos[1] == '='))
+        {
+            p->error = "Collating elements and equivalence classes are not supported";
+            return NO_NODE;
+        }
+
+        if (c == '[' && p->pos + 1 < p->end && p->pos[1] == ':')
+        {
+            const char *name = p->pos + 2;
+            const char *close = name;
+            while (close + 1 < p->end && !(close[0] == ':' && close[1] == ']'))
+            {
+                close++;
+            }
+            if (close + 1 >= p->end)
+            {
+                p->error = "Unmatched [, [^, [:, [., or [=";
+                return NO_NODE;
+            }
+            if (!add_named_class(bits, name, (size_t) (close - name)))
+            {
+                p->error = "Invalid character class name";
+                return NO_NODE;
+            }
+            p->pos = close + 2;
+            continue;
+        }
+
+        unsigned char hi = c;
+        p->pos++;
+
+        if (p->pos + 1 < p->end && *p->pos == '-' && p->pos[1] != ']')
+        {
+            hi = (unsigned char) p->pos[1];
+            p->pos += 2;
+            if (hi < c)
+            {
+                p->error = "Invalid range end";
+                return NO_NODE;
+            }
+        }
+
+        for (unsigned b = c; b <= hi; b++)
+        {
+            set_add(bits, b);
+        }
+    }
+
+    return set_node(p, bits, negate);
+}
+
+/**
+ * Parse a backslash escape, pos is just past the '\'
+ */
+static uint32_t parse_escape(regex_parser *p)
+{
+    uint64_t bits[4] = {0, 0, 0, 0};
+
+    if (p->pos >= p->end)
+    {
+        p->error = "Trailing backslash";
+        return NO_NODE;
+    }
+
+    unsigned char c = (unsigned char) *p->pos++;
+
+    switch (c)
+    {
+    case 'w':
+    case 'W':
+        add_named_class(bits, "alnum", 5);
+        set_add(bits, '_');
+        return set_node(p, bits, c == 'W');
+    case 's':
+    case 'S':
+        add_named_class(bits, "space", 5);
+        return set_node(p, bits, c == 'S');
+    case '<':
+    case '>':
+    case 'b':
+    case 'B':
+        p->error = "Word boundary assertions are not supported";
+        return NO_NODE;
+    default:
+        if (c >= '1' && c <= '9')
+        {
+            p->error = "Back-references are not supported";
+            return NO_NODE;
+        }
+        return byte_node(p, c);
+    }
+}
+
+static uint32_t parse_atom(regex_parser *p, unsigned depth)
+{
+    unsigned char c = (unsigned char) *p->pos++;
+
+    switch (c)
+    {
+    case '(':
+    {
+        if (depth >= REGEX_MAX_DEPTH)
+        {
+            p->error = "Parentheses nested too deeply";
+            return NO_NODE;
+        }
+
+        uint32_t inner = parse_alt(p, depth + 1);
+        if (inner == NO_NODE)
+        {
+            return NO_NODE;
+        }
+        if (p->pos >= p->end || *p->pos != ')')
+        {
+            p->error = "Unmatched ( or \\(";
+            return NO_NODE;
+        }
+        p->pos++;
+        return inner;
+    }
+    case '[':
+        return parse_bracket(p);
+    case '.':
+    {
+        uint64_t bits[4] = {0, 0, 0, 0};
+        set_add(bits, '\n');
+        return set_node(p, bits, true);
+    }
+    case '^':
+        return new_node(p, NODE_BOL);
+    case '$':
+        return new_node(p, NODE_EOL);
+    case '\\':
+        return parse_escape(p);
+    default:
+        return byte_node(p, c);
+    }
+}
+
+/**
+ * Read a decimal number of at most REGEX_MAX_REPEAT, returns false if there are no digits
+ */
+static bool parse_count(regex_parser *p, uint32_t *count)
+{
+    uint32_t value = 0;
+    const char *start = p->pos;
+
+    while (p->pos < p->end && isdigit((unsigned char) *p->pos))
+    {
+        value = value * 10 + (uint32_t) (*p->pos - '0');
+        if (value > REGEX_MAX_REPEAT)
+        {
+            value = REGEX_MAX_REPEAT + 1;
+        }
+        p->pos++;
+    }
+
+    *count = value;
+    return p->pos > start;
+}
+
+/**
+ * Parse the bounds of "{m}", "{m,}" or "{m,n}", pos is on the '{'
+ * A '{' that does not start a count is an ordinary character, returns false for that case
+ * and also, with error set, for a malformed count.
+ */
+static bool parse_interval(regex_parser *p, uint32_t *min, uint32_t *max)
+{
+    const char *start = p->pos;
+
+    p->pos++;
+    if (!parse_count(p, min))
+    {
+        // "{,n}" leaves out the lower bound
+        if (p->pos >= p->end || *p->pos != ',')
+        {
+            p->pos = start;
+            return false;
+        }
+        *min = 0;
+    }
+
+    *max = *min;
+    if (p->pos < p->end && *p->pos == ',')
+    {
+        p->pos++;
+        if (!parse_count(p, max))
+        {
+            *max = REPEAT_INF;
+        }
+    }
+
+    if (p->pos >= p->end || *p->pos != '}')
+    {
+        p->error = "Unmatched \\{";
+        return false;
+    }
+    p->pos++;
+
+    if (*max != REPEAT_INF && *min > *max)
+    {
+        p->error = "Invalid content of \\{\\}";
+        return false;
+    }
+    if (*min > REGEX_MAX_REPEAT || (*max != REPEAT_INF && *max > REGEX_MAX_REPEAT))
+    {
+        p->error = "Regular expression too big";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parse an atom followed by any number of *, +, ? and {m,n}
+ */
+static uint32_t parse_repeat(regex_parser *p, unsigned depth)
+{
+    uint32_t atom = parse_atom(p, depth);
+
+    while (atom != NO_NODE && p->pos < p->end)
+    {
+        uint32_t min;
+        uint32_t max;
+        char c = *p->pos;
+
+        if (c == '*' || c == '+' || c == '?')
+        {
+            min = c == '+' ? 1 : 0;
+            max = c == '?' ? 1 : REPEAT_INF;
+            p->pos++;
+        }
+        else if (c == '{')
+        {
+            if (!parse_interval(p, &min, &max))
+            {
+                if (p->error != NULL)
+                {
+                    return NO_NODE;
+                }
+                break;
+            }
+        }
+        else
+        {
+            break;
+        }
+
+        uint32_t repeat = new_node(p, NODE_REPEAT);
+        if (repeat == NO_NODE)
+        {
+            return NO_NODE;
+        }
+        p->nodes[repeat].first = atom;
+        p->nodes[repeat].min = min;
+        p->nodes[repeat].max = max;
+        atom = repeat;
+    }
+
+    return atom;
+}
+
+/**
+ * Parse a run of atoms up to '|', a closing ')' or the end
+ */
+static uint32_t parse_concat(regex_parser *p, unsigned depth)
+{
+    uint32_t cat = new_node(p, NODE_CAT);
+    node_type previous = NODE_EMPTY;
+
+    while (cat != NO_NODE && p->pos < p->end && *p->pos != '|')
+    {
+        if (*p->pos == ')')
+        {
+            if (depth > 0)
+            {
+                break;
+            }
+            p->error = "Unmatched ) or \\)";
+            return NO_NODE;
+        }
+
+        uint32_t atom;
+
+        // A repetition operator with nothing to repeat stands for itself, as in GNU grep
+        bool nothing_to_repeat = previous == NODE_EMPTY || previous == NODE_BOL;
+        if (nothing_to_repeat && (*p->pos == '*' || *p->pos == '+' || *p->pos == '?'))
+        {
+            atom = byte_node(p, (unsigned char) *p->pos++);
+        }
+        else
+        {
+            atom = parse_repeat(p, depth);
+        }
+
+        if (atom == NO_NODE)
+        {
+            return NO_NODE;
+        }
+        append_child(p, cat, atom);
+        previous = p->nodes[atom].type;
+    }
+
+    return cat;
+}
+
+static uint32_t parse_alt(regex_parser *p, unsigned depth)
+{
+    uint32_t branch = parse_concat(p, depth);
+
+    if (branch == NO_NODE || p->pos >= p->end || *p->pos != '|')
+    {
+        return branch;
+    }
+
+    uint32_t alt = new_node(p, NODE_ALT);
+    if (alt == NO_NODE)
+    {
+        return NO_NODE;
+    }
+    append_child(p, alt, branch);
+
+    while (p->pos < p->end && *p->pos == '|')
+    {
+        p->pos++;
+        branch = parse_concat(p, depth);
+        if (branch == NO_NODE)
+        {
+            return NO_NODE;
+        }
+        append_child(p, alt, branch);
+    }
+
+    return alt;
+}
+
+static uint32_t emit(regex_parser *p, regex_op op, uint32_t x, uint32_t y, size_t *cap)
+{
+    regex_program *re = p->re;
+
+    if (re->inst_count >= REGEX_MAX_INSTS)
+    {
+        p->error = "Regular expression too big";
+        return NO_STATE;
+    }
+
+    if (re->inst_count == *cap)
+    {
+        size_t grown = *cap > 0 ? *cap * 2 : 64;
+        regex_inst *insts = realloc(re->insts, grown * sizeof(*insts));
+        if (insts == NULL)
+        {
+            return NO_STATE;
+        }
+        re->insts = insts;
+        *cap = grown;
+    }
+
+    regex_inst *inst = &re->insts[re->inst_count];
+    inst->op = op;
+    inst->x = x;
+    inst->y = y;
+    return (uint32_t) re->inst_count++;
+}
+
+/**
+ * Emit the program for a node, returns false once an error has been recorded
+ */
+static bool compile_node(regex_parser *p, uint32_t index, size_t *cap)
+{
+    regex_program *re = p->re;
+    const regex_node *node = &p->nodes[index];
+
+    switch (node->type)
+    {
+    case NODE_EMPTY:
+        return true;
+    case NODE_SET:
+        return emit(p, REGEX_BYTE, node->set, 0, cap) != NO_STATE;
+    case NODE_BOL:
+        return emit(p, REGEX_BOL, 0, 0, cap) != NO_STATE;
+    case NODE_EOL:
+        return emit(p, REGEX_EOL, 0, 0, cap) != NO_STATE;
+    case NODE_CAT:
+        for (uint32_t child = node->first; child != NO_NODE; child = p->nodes[child].next)
+        {
+            if (!compile_node(p, child, cap))
+            {
+                return false;
+            }
+        }
+        return true;
+    case NODE_ALT:
+    {
+        // Each branch but the last: split to it or onwards, then jump to the end.
+        // The pending jumps are chained through their x until the end is known.
+        uint32_t jumps = NO_STATE;
+
+        for (uint32_t child = node->first; child != NO_NODE; child = p->nodes[child].next)
+        {
+            if (p->nodes[child].next == NO_NODE)
+            {
+                if (!compile_node(p, child, cap))
+                {
+                    return false;
+                }
+                break;
+            }
+
+            uint32_t split = emit(p, REGEX_SPLIT, 0, 0, cap);
+            if (split == NO_STATE)
+            {
+                return false;
+            }
+            re->insts[split].x = split + 1;
+
+            if (!compile_node(p, child, cap))
+            {
+                return false;
+            }
+
+            uint32_t jump = emit(p, REGEX_JMP, jumps, 0, cap);
+            if (jump == NO_STATE)
+            {
+                return false;
+            }
+            jumps = jump;
+            re->insts[split].y = (uint32_t) re->inst_count;
+        }
+
+        while (jumps != NO_STATE)
+        {
+            uint32_t previous = re->insts[jumps].x;
+            re->insts[jumps].x = (uint32_t) re->inst_count;
+            jumps = previous;
+        }
+        return true;
+    }
+    case NODE_REPEAT:
+    {
+        uint32_t child = node->first;
+        uint32_t min = node->min;
+        uint32_t max = node->max;
+
+        for (uint32_t i = 0; i < min; i++)
+        {
+            if (!compile_node(p, child, cap))
+            {
+                return false;
+            }
+        }
+
+        if (max == REPEAT_INF)
+        {
+            uint32_t loop = emit(p, REGEX_SPLIT, 0, 0, cap);
+            if (loop == NO_STATE)
+            {
+                return false;
+            }
+            re->insts[loop].x = loop + 1;
+
+            if (!compile_node(p, child, cap) || emit(p, REGEX_JMP, loop, 0, cap) == NO_STATE)
+            {
+                return false;
+            }
+            re->insts[loop].y = (uint32_t) re->inst_count;
+            return true;
+        }
+
+        // Optional copies, every split skips to the end; chained through y like the jumps
+        uint32_t splits = NO_STATE;
+        for (uint32_t i = min; i < max; i++)
+        {
+            uint32_t split = emit(p, REGEX_SPLIT, 0, splits, cap);
+            if (split == NO_STATE)
+            {
+                return false;
+            }
+            re->insts[split].x = split + 1;
+            splits = split;
+
+            if (!compile_node(p, child, cap))
+            {
+                return false;
+            }
+        }
+
+        while (splits != NO_STATE)
+        {
+            uint32_t previous = re->insts[splits].y;
+            re->insts[splits].y = (uint32_t) re->inst_count;
+            splits = previous;
+        }
+        return true;
+    }
+    }
+    return true;
+}
+
+/**
+ * Partition the bytes into classes no byte set tells apart
+ */
+static void build_classes(regex_program *re)
+{
+    memset(re->classes, 0, sizeof(re->classes));
+    re->class_count = 1;
+
+    for (size_t s = 0; s < re->set_count; s++)
+    {
+        uint16_t remap[512];
+        uint8_t refined[256];
+        size_t count = 0;
+
+        for (size_t i = 0; i < 512; i++)
+        {
+            remap[i] = UINT16_MAX;
+        }
+
+        for (unsigned b = 0; b < 256; b++)
+        {
+            size_t key = (size_t) re->classes[b] * 2 + set_has(re->sets[s], b);
+            if (remap[key] == UINT16_MAX)
+            {
+                remap[key] = (uint16_t) count++;
+            }
+            refined[b] = (uint8_t) remap[key];
+        }
+
+        memcpy(re->classes, refined, sizeof(refined));
+        re->class_count = count;
+    }
+
+    for (unsigned b = 256; b-- > 0;)
+    {
+        re->class_bytes[re->classes[b]] = (uint8_t) b;
+    }
+}
+
+/**
+ * Check whether a byte set stands for one literal byte, lower-cased under fold
+ */
+static bool set_literal(const regex_parser *p, const uint64_t *bits, char *byte)
+{
+    size_t members = 0;
+    unsigned last = 0;
+
+    for (unsigned b = 0; b < 256; b++)
+    {
+        if (set_has(bits, b))
+        {
+            members++;
+            last = b;
+        }
+    }
+
+    // Under fold a letter comes with its other case
+    if (members == 2 && p->fold && last >= 'a' && last <= 'z' && set_has(bits, last - 32))
+    {
+        members = 1;
+    }
+
+    *byte = (char) last;
+    return members == 1;
+}
+
+/**
+ * Keep candidate as the required literal if it is longer than the one found so far
+ */
+static void keep_longer(literal_info *info, const char *candidate, size_t len)
+{
+    if (len > info->must_len)
+    {
+        memcpy(info->must, candidate, len);
+        info->must_len = len;
+    }
+}
+
+static void set_exact(literal_info *info, const char *text, size_t len, bool pure)
+{
+    info->is_exact = true;
+    info->pure = pure;
+    memcpy(info->exact, text, len);
+    info->exact_len = len;
+    memcpy(info->must, text, len);
+    info->must_len = len;
+}
+
+/**
+ * Work out the literal text every match of a node contains
+ */
+static void analyze_node(const regex_parser *p, uint32_t index, literal_info *info)
+{
+    const regex_node *node = &p->nodes[index];
+    char byte;
+
+    info->is_exact = false;
+    info->pure = false;
+    info->exact_len = 0;
+    info->must_len = 0;
+
+    switch (node->type)
+    {
+    case NODE_EMPTY:
+        set_exact(info, "", 0, true);
+        return;
+    case NODE_BOL:
+    case NODE_EOL:
+        set_exact(info, "", 0, false);
+        return;
+    case NODE_SET:
+        if (set_literal(p, p->re->sets[node->set], &byte))
+        {
+            set_exact(info, &byte, 1, true);
+        }
+        return;
+    case NODE_ALT:
+        // Only the top level makes use of alternatives, see regex_compile()
+        if (node->first != NO_NODE && p->nodes[node->first].next == NO_NODE)
+        {
+            analyze_node(p, node->first, info);
+        }
+        return;
+    case NODE_CAT:
+    {
+        // Runs of exact children concatenate, anything else breaks the run
+        literal_info *child = malloc(sizeof(*child));
+        bool exact = true;
+        bool pure = true;
+
+        if (child == NULL)
+        {
+            return;
+        }
+
+        for (uint32_t c = node->first; c != NO_NODE; c = p->nodes[c].next)
+        {
+            analyze_node(p, c, child);
+
+            if (child->is_exact && info->exact_len + child->exact_len <= REGEX_MAX_LITERAL)
+            {
+                memcpy(info->exact + info->exact_len, child->exact, child->exact_len);
+                info->exact_len += child->exact_len;
+                pure = pure && child->pure;
+                continue;
+            }
+
+            keep_longer(info, info->exact, info->exact_len);
+            exact = false;
+            if (child->is_exact)
+            {
+                memcpy(info->exact, child->exact, child->exact_len);
+                info->exact_len = child->exact_len;
+            }
+            else
+            {
+                info->exact_len = 0;
+                keep_longer(info, child->must, child->must_len);
+            }
+        }
+        keep_longer(info, info->exact, info->exact_len);
+        free(child);
+
+        info->is_exact = exact;
+        info->pure = exact && pure;
+        return;
+    }
+    case NODE_REPEAT:
+    {
+        if (node->max == 0)
+        {
+            set_exact(info, "", 0, true);
+            return;
+        }
+        if (node->min == 0)
+        {
+            return;
+        }
+
+        analyze_node(p, node->first, info);
+        if (!info->is_exact || node->min != node->max)
+        {
+            info->is_exact = false;
+            return;
+        }
+
+        // x{n} spells out n copies while they fit
+        size_t len = info->exact_len;
+        if (len * node->min > REGEX_MAX_LITERAL)
+        {
+            info->is_exact = false;
+            return;
+        }
+        for (uint32_t i = 1; i < node->min; i++)
+        {
+            memcpy(info->exact + i * len, info->exact, len);
+        }
+        set_exact(info, info->exact, len * node->min, info->pure);
+        return;
+    }
+    }
+}
+
+/**
+ * Record the literals one of which every match contains, one per top-level branch
+ * Leaves literal_count at zero when some branch has no literal to offer.
+ */
+static bool extract_literals(regex_parser *p, uint32_t root)
+{
+    regex_program *re = p->re;
+    literal_info *info = malloc(sizeof(*info));
+    size_t branches = 0;
+    bool exact = true;
+    bool ok = true;
+
+    if (info == NULL)
+    {
+        return false;
+    }
+
+    // Branches of a top-level alternation in each expression count as branches too
+    for (uint32_t c = p->nodes[root].first; c != NO_NODE; c = p->nodes[c].next)
+    {
+        branches += p->nodes[c].type == NODE_ALT ? 0 : 1;
+        for (uint32_t b = p->nodes[c].type == NODE_ALT ? p->nodes[c].first : NO_NODE;
+             b != NO_NODE;
+             b = p->nodes[b].next)
+        {
+            branches++;
+        }
+    }
+
+    re->literals = calloc(branches > 0 ? branches : 1, sizeof(*re->literals));
+    re->literal_lens = calloc(branches > 0 ? branches : 1, sizeof(*re->literal_lens));
+    if (re->literals == NULL || re->literal_lens == NULL)
+    {
+        free(info);
+        return false;
+    }
+
+    for (uint32_t c = p->nodes[root].first; c != NO_NODE && ok; c = p->nodes[c].next)
+    {
+        bool nested = p->nodes[c].type == NODE_ALT;
+
+        for (uint32_t b = nested ? p->nodes[c].first : c; b != NO_NODE && ok;
+             b = nested ? p->nodes[b].next : NO_NODE)
+        {
+            analyze_node(p, b, info);
+            if (info->must_len == 0)
+            {
+                re->literal_count = 0;
+                free(info);
+                return true;
+            }
+
+            char *text = malloc(info->must_len);
+            if (text == NULL)
+            {
+                ok = false;
+                break;
+            }
+            memcpy(text, info->must, info->must_len);
+            re->literals[re->literal_count] = text;
+            re->literal_lens[re->literal_count++] = info->must_len;
+            // A line never holds a newline, so such a literal cannot prove anything
+            bool newline = memchr(text, '\n', info->must_len) != NULL;
+            exact = exact && info->is_exact && info->pure && !newline;
+        }
+    }
+
+    re->literals_exact = ok && re->literal_count > 0 && exact;
+    free(info);
+    return ok;
+}
+
+static void free_cache(void *arg);
+static regex_cache *new_cache(const regex_program *re, bool with_dfa);
+
+bool regex_compile(regex_program *re,
+                   const char *const *sources,
+                   size_t count,
+                   bool fold,
+                   const char **error)
+{
+    regex_parser p;
+    size_t cap = 0;
+    bool ok = false;
+
+    memset(re, 0, sizeof(*re));
+    memset(&p, 0, sizeof(p));
+    p.re = re;
+    p.fold = fold;
+    *error = NULL;
+
+    // The expressions become the branches of one alternation
+    uint32_t root = new_node(&p, NODE_ALT);
+    for (size_t i = 0; i < count && root != NO_NODE; i++)
+    {
+        p.pos = sources[i];
+        p.end = sources[i] + strlen(sources[i]);
+
+        uint32_t branch = parse_alt(&p, 0);
+        if (branch == NO_NODE)
+        {
+            goto done;
+        }
+        append_child(&p, root, branch);
+    }
+    if (root == NO_NODE)
+    {
+        goto done;
+    }
+
+    // Without any expression the program needs a byte no line can supply
+    if (count == 0)
+    {
+        uint64_t none[4] = {0, 0, 0, 0};
+        uint32_t never = set_node(&p, none, false);
+        if (never == NO_NODE)
+        {
+            goto done;
+        }
+        append_child(&p, root, never);
+    }
+
+    if (!compile_node(&p, root, &cap) || emit(&p, REGEX_MATCH, 0, 0, &cap) == NO_STATE)
+    {
+        goto done;
+    }
+
+    build_classes(re);
+
+    if (!extract_literals(&p, root))
+    {
+        goto done;
+    }
+
+    re->caches = calloc(1, sizeof(*re->caches));
+    if (re->caches == NULL)
+    {
+        goto done;
+    }
+    pthread_mutex_init(&re->caches->lock, NULL);
+    pthread_mutex_init(&re->caches->spare_lock, NULL);
+
+    // Taken now, so that running out of memory in the middle of a search only slows it down
+    re->caches->spare = new_cache(re, false);
+    if (re->caches->spare == NULL)
+    {
+        goto done;
+    }
+
+    // Without a destructor, every cache is freed by regex_free() whether its thread lives on
+    if (pthread_key_create(&re->cache_key, NULL) != 0)
+    {
+        goto done;
+    }
+    re->has_cache_key = true;
+    ok = true;
+
+done:
+    free(p.nodes);
+    if (!ok)
+    {
+        *error = p.error;
+        regex_free(re);
+    }
+    return ok;
+}
+
+void regex_free(regex_program *re)
+{
+    if (re->has_cache_key)
+    {
+        pthread_key_delete(re->cache_key);
+        re->has_cache_key = false;
+    }
+    if (re->caches != NULL)
+    {
+        while (re->caches->head != NULL)
+        {
+            regex_cache *older = re->caches->head->older;
+            free_cache(re->caches->head);
+            re->caches->head = older;
+        }
+        free_cache(re->caches->spare);
+        pthread_mutex_destroy(&re->caches->lock);
+        pthread_mutex_destroy(&re->caches->spare_lock);
+        free(re->caches);
+        re->caches = NULL;
+    }
+
+    for (size_t i = 0; i < re->literal_count; i++)
+    {
+        free(re->literals[i]);
+    }
+    free(re->literals);
+    free(re->literal_lens);
+    re->literals = NULL;
+    re->literal_lens = NULL;
+    re->literal_count = 0;
+
+    free(re->insts);
+    free(re->sets);
+    re->insts = NULL;
+    re->sets = NULL;
+    re->inst_count = 0;
+    re->set_count = 0;
+}
+
+static void free_cache(void *arg)
+{
+    regex_cache *cache = arg;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    free(cache->current.dense);
+    free(cache->current.sparse);
+    free(cache->next.dense);
+    free(cache->next.sparse);
+    free(cache->current_start);
+    free(cache->next_start);
+    free(cache->stack);
+    free(cache->key);
+    free(cache->trans);
+    free(cache->flags);
+    free(cache->set_start);
+    free(cache->set_len);
+    free(cache->pcs);
+    free(cache->table);
+    free(cache);
+}
+
+/**
+ * Drop every cached state
+ */
+static void flush_cache(regex_cache *cache)
+{
+    // A cache that fills up before it has been reused much only costs time
+    if (cache->bytes_since_flush < REGEX_MIN_BYTES_PER_STATE * cache->state_count)
+    {
+        cache->thrashes++;
+        cache->use_nfa = cache->thrashes >= REGEX_MAX_THRASHES;
+    }
+    cache->bytes_since_flush = 0;
+
+    cache->state_count = 0;
+    cache->pcs_len = 0;
+    cache->start = NO_STATE;
+    memset(cache->table, 0xff, (cache->table_mask + 1) * sizeof(*cache->table));
+}
+
+/**
+ * Allocate the scratch space of the Pike VM and, with_dfa, the tables of the DFA
+ * A cache whose tables cannot be had only runs the Pike VM. Returns NULL if memory runs out
+ * before the Pike VM has its scratch space.
+ */
+static regex_cache *new_cache(const regex_program *re, bool with_dfa)
+{
+    regex_cache *cache = calloc(1, sizeof(*cache));
+    size_t insts = re->inst_count;
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->current.dense = calloc(insts, sizeof(uint32_t));
+    cache->current.sparse = calloc(insts, sizeof(uint32_t));
+    cache->next.dense = calloc(insts, sizeof(uint32_t));
+    cache->next.sparse = calloc(insts, sizeof(uint32_t));
+    cache->current_start = malloc(insts * sizeof(size_t));
+    cache->next_start = malloc(insts * sizeof(size_t));
+    cache->stack = malloc((insts * 2 + 1) * sizeof(uint32_t));
+
+    if (cache->current.dense == NULL || cache->current.sparse == NULL
+        || cache->next.dense == NULL || cache->next.sparse == NULL
+        || cache->current_start == NULL || cache->next_start == NULL || cache->stack == NULL)
+    {
+        free_cache(cache);
+        return NULL;
+    }
+
+    cache->use_nfa = true;
+    if (!with_dfa)
+    {
+        return cache;
+    }
+
+    cache->max_states = REGEX_CACHE_SIZE / 2 / (re->class_count * sizeof(uint32_t));
+    cache->max_states = cache->max_states > 16 ? cache->max_states : 16;
+    cache->pcs_cap = REGEX_CACHE_SIZE / 4 / sizeof(uint32_t);
+    cache->pcs_cap = cache->pcs_cap > insts * 2 ? cache->pcs_cap : insts * 2;
+
+    size_t table_size = 1;
+    while (table_size < cache->max_states * 2)
+    {
+        table_size *= 2;
+    }
+    cache->table_mask = table_size - 1;
+
+    cache->key = malloc(insts * sizeof(uint32_t));
+    cache->trans = malloc(cache->max_states * re->class_count * sizeof(uint32_t));
+    cache->flags = malloc(cache->max_states);
+    cache->set_start = malloc(cache->max_states * sizeof(uint32_t));
+    cache->set_len = malloc(cache->max_states * sizeof(uint32_t));
+    cache->pcs = malloc(cache->pcs_cap * sizeof(uint32_t));
+    cache->table = malloc(table_size * sizeof(uint32_t));
+
+    if (cache->key == NULL || cache->trans == NULL || cache->flags == NULL
+        || cache->set_start == NULL || cache->set_len == NULL || cache->pcs == NULL
+        || cache->table == NULL)
+    {
+        return cache;
+    }
+
+    flush_cache(cache);
+    cache->thrashes = 0;
+    cache->use_nfa = false;
+    return cache;
+}
+
+/**
+ * The calling thread's cache, NULL when it has none and cannot get one
+ */
+static regex_cache *get_cache(const regex_program *re)
+{
+    regex_cache *cache = pthread_getspecific(re->cache_key);
+
+    if (cache == NULL)
+    {
+        cache = new_cache(re, true);
+        if (cache == NULL)
+        {
+            return NULL;
+        }
+        if (pthread_setspecific(re->cache_key, cache) != 0)
+        {
+            free_cache(cache);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&re->caches->lock);
+        cache->older = re->caches->head;
+        re->caches->head = cache;
+        pthread_mutex_unlock(&re->caches->lock);
+    }
+    return cache;
+}
+
+static bool pc_set_has(const pc_set *set, uint32_t pc)
+{
+    uint32_t i = set->sparse[pc];
+    return i < set->count && set->dense[i] == pc;
+}
+
+/**
+ * Add pc and everything reachable from it without consuming a byte
+ * bol and eol say whether the position is at the start or end of the line.
+ */
+static void add_closure(const regex_program *re,
+                        pc_set *set,
+                        uint32_t *stack,
+                        uint32_t pc,
+                        bool bol,
+                        bool eol)
+{
+    size_t top = 0;
+
+    stack[top++] = pc;
+    while (top > 0)
+    {
+        pc = stack[--top];
+        if (pc_set_has(set, pc))
+        {
+            continue;
+        }
+        set->sparse[pc] = (uint32_t) set->count;
+        set->dense[set->count++] = pc;
+
+        const regex_inst *inst = &re->insts[pc];
+        switch (inst->op)
+        {
+        case REGEX_JMP:
+            stack[top++] = inst->x;
+            break;
+        case REGEX_SPLIT:
+            stack[top++] = inst->y;
+            stack[top++] = inst->x;
+            break;
+        case REGEX_BOL:
+            if (bol)
+            {
+                stack[top++] = pc + 1;
+            }
+            break;
+        case REGEX_EOL:
+            if (eol)
+            {
+                stack[top++] = pc + 1;
+            }
+            break;
+        case REGEX_BYTE:
+        case REGEX_MATCH:
+            break;
+        }
+    }
+}
+
+static bool set_has_match(const regex_program *re, const pc_set *set)
+{
+    for (size_t i = 0; i < set->count; i++)
+    {
+        if (re->insts[set->dense[i]].op == REGEX_MATCH)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Simulate the NFA over the line, every program counter is visited at most once per byte
+ */
+static bool pike_match(const regex_program *re,
+                       regex_cache *cache,
+                       const unsigned char *line,
+                       size_t len)
+{
+    pc_set *current = &cache->current;
+    pc_set *next = &cache->next;
+
+    current->count = 0;
+    add_closure(re, current, cache->stack, 0, true, len == 0);
+
+    for (size_t i = 0;; i++)
+    {
+        if (set_has_match(re, current))
+        {
+            return true;
+        }
+        if (i == len)
+        {
+            return false;
+        }
+
+        bool eol = i + 1 == len;
+        next->count = 0;
+        for (size_t k = 0; k < current->count; k++)
+        {
+            uint32_t pc = current->dense[k];
+            const regex_inst *inst = &re->insts[pc];
+
+            if (inst->op == REGEX_BYTE && set_has(re->sets[inst->x], line[i]))
+            {
+                add_closure(re, next, cache->stack, pc + 1, false, eol);
+            }
+        }
+
+        // The match may also start at the next byte
+        add_closure(re, next, cache->stack, 0, false, eol);
+
+        pc_set *swap = current;
+        current = next;
+        next = swap;
+    }
+}
+
+static uint32_t hash_state(const uint32_t *key, size_t len, uint8_t flags)
+{
+    uint32_t hash = 2166136261u ^ flags;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int compare_pc(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Find or add the DFA state for the program counters in cache->current
+ * Returns NO_STATE when the cache is full and has to be flushed first.
+ */
+static uint32_t find_state(const regex_program *re, regex_cache *cache, uint8_t flags)
+{
+    uint32_t *key = cache->key;
+    size_t len = 0;
+
+    // Only the instructions that can still do something tell states apart
+    for (size_t i = 0; i < cache->current.count; i++)
+    {
+        uint32_t pc = cache->current.dense[i];
+        regex_op op = re->insts[pc].op;
+
+        if (op == REGEX_MATCH)
+        {
+            // Once the line matches nothing else about the state matters
+            key[0] = pc;
+            len = 1;
+            flags |= STATE_ACCEPT | STATE_EOL_KNOWN | STATE_EOL_ACCEPT;
+            break;
+        }
+        if (op == REGEX_BYTE || op == REGEX_EOL)
+        {
+            key[len++] = pc;
+        }
+    }
+
+    if (len == 0)
+    {
+        flags |= STATE_DEAD | STATE_EOL_KNOWN;
+    }
+    qsort(key, len, sizeof(*key), compare_pc);
+
+    uint32_t hash = hash_state(key, len, flags & STATE_AT_START);
+    size_t slot = hash & cache->table_mask;
+
+    for (;; slot = (slot + 1) & cache->table_mask)
+    {
+        uint32_t state = cache->table[slot];
+        if (state == NO_STATE)
+        {
+            break;
+        }
+        if (cache->set_len[state] == len
+            && (cache->flags[state] & STATE_AT_START) == (flags & STATE_AT_START)
+            && memcmp(cache->pcs + cache->set_start[state], key, len * sizeof(*key)) == 0)
+        {
+            return state;
+        }
+    }
+
+    if (cache->state_count == cache->max_states || cache->pcs_len + len > cache->pcs_cap)
+    {
+        return NO_STATE;
+    }
+
+    uint32_t state = (uint32_t) cache->state_count++;
+    cache->table[slot] = state;
+    cache->flags[state] = flags;
+    cache->set_start[state] = (uint32_t) cache->pcs_len;
+    cache->set_len[state] = (uint32_t) len;
+    memcpy(cache->pcs + cache->pcs_len, key, len * sizeof(*key));
+    cache->pcs_len += len;
+    memset(cache->trans + (size_t) state * re->class_count,
+           0xff,
+           re->class_count * sizeof(*cache->trans));
+    return state;
+}
+
+/**
+ * Find or add a state, flushing the cache when it is full
+ */
+static uint32_t add_state(const regex_program *re, regex_cache *cache, uint8_t flags)
+{
+    uint32_t state = find_state(re, cache, flags);
+
+    if (state == NO_STATE)
+    {
+        flush_cache(cache);
+        state = find_state(re, cache, flags);
+    }
+    return state;
+}
+
+static uint32_t start_state(const regex_program *re, regex_cache *cache)
+{
+    if (cache->start == NO_STATE)
+    {
+        cache->current.count = 0;
+        add_closure(re, &cache->current, cache->stack, 0, true, false);
+        cache->start = add_state(re, cache, STATE_AT_START);
+    }
+    return cache->start;
+}
+
+/**
+ * Work out and cache the transition of state on bytes of class c
+ */
+static uint32_t dfa_step(const regex_program *re, regex_cache *cache, uint32_t state, size_t c)
+{
+    const uint32_t *pcs = cache->pcs + cache->set_start[state];
+    size_t len = cache->set_len[state];
+    unsigned char byte = re->class_bytes[c];
+
+    cache->current.count = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        const regex_inst *inst = &re->insts[pcs[i]];
+
+        if (inst->op == REGEX_BYTE && set_has(re->sets[inst->x], byte))
+        {
+            add_closure(re, &cache->current, cache->stack, pcs[i] + 1, false, false);
+        }
+    }
+    add_closure(re, &cache->current, cache->stack, 0, false, false);
+
+    uint32_t next = find_state(re, cache, 0);
+    if (next == NO_STATE)
+    {
+        // The flush drops the state this transition started from, it is simply not recorded
+        flush_cache(cache);
+        return find_state(re, cache, 0);
+    }
+
+    // Accepting and dead targets are tagged so the scan loop needs a single test per byte
+    uint32_t entry = next * (uint32_t) re->class_count;
+    if (cache->flags[next] & (STATE_ACCEPT | STATE_DEAD))
+    {
+        entry |= TRANS_SPECIAL;
+    }
+    cache->trans[(size_t) state * re->class_count + c] = entry;
+    return next;
+}
+
+/**
+ * Check whether the line matches when it ends in state, following the pending $ assertions
+ */
+static bool eol_accepts(const regex_program *re, regex_cache *cache, uint32_t state)
+{
+    uint8_t flags = cache->flags[state];
+
+    if (flags & STATE_EOL_KNOWN)
+    {
+        return flags & STATE_EOL_ACCEPT;
+    }
+
+    const uint32_t *pcs = cache->pcs + cache->set_start[state];
+    size_t len = cache->set_len[state];
+
+    cache->current.count = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (re->insts[pcs[i]].op == REGEX_EOL)
+        {
+            add_closure(
+                re, &cache->current, cache->stack, pcs[i], flags & STATE_AT_START, true);
+        }
+    }
+
+    bool accept = set_has_match(re, &cache->current);
+    cache->flags[state] = flags | STATE_EOL_KNOWN | (accept ? STATE_EOL_ACCEPT : 0);
+    return accept;
+}
+
+static bool dfa_match(const regex_program *re,
+                      regex_cache *cache,
+                      const unsigned char *line,
+                      size_t len)
+{
+    const uint8_t *classes = re->classes;
+    const uint32_t *trans = cache->trans;
+    uint32_t class_count = (uint32_t) re->class_count;
+    uint32_t state = start_state(re, cache);
+    uint32_t offset = state * class_count;
+
+    cache->bytes_since_flush += len;
+
+    if (cache->flags[state] & (STATE_ACCEPT | STATE_DEAD))
+    {
+        return cache->flags[state] & STATE_ACCEPT;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        size_t c = classes[line[i]];
+        uint32_t entry = trans[offset + c];
+
+        if (!(entry & TRANS_SPECIAL))
+        {
+            offset = entry;
+            continue;
+        }
+
+        state = entry == NO_STATE ? dfa_step(re, cache, offset / class_count, c)
+                                  : (entry & ~TRANS_SPECIAL) / class_count;
+
+        uint8_t flags = cache->flags[state];
+        if (flags & (STATE_ACCEPT | STATE_DEAD))
+        {
+            return flags & STATE_ACCEPT;
+        }
+        offset = state * class_count;
+    }
+
+    return eol_accepts(re, cache, offset / class_count);
+}
+
+bool regex_matches(const regex_program *re, const char *line, size_t line_len)
+{
+    regex_cache *cache = get_cache(re);
+    const unsigned char *bytes = (const unsigned char *) line;
+
+    // Without a cache of its own the thread waits its turn at the spare one
+    if (cache == NULL)
+    {
+        pthread_mutex_lock(&re->caches->spare_lock);
+        bool matched = pike_match(re, re->caches->spare, bytes, line_len);
+        pthread_mutex_unlock(&re->caches->spare_lock);
+        return matched;
+    }
+
+    if (cache->use_nfa)
+    {
+        return pike_match(re, cache, bytes, line_len);
+    }
+    return dfa_match(re, cache, bytes, line_len);
+}
+
+/**
+ * Add the closure of pc to set for a thread that started at start
+ */
+static void add_thread(const regex_program *re,
+                       regex_cache *cache,
+                       pc_set *set,
+                       size_t *starts,
+                       uint32_t pc,
+                       size_t start,
+                       bool bol,
+                       bool eol)
+{
+    size_t first = set->count;
+
+    add_closure(re, set, cache->stack, pc, bol, eol);
+    for (size_t k = first; k < set->count; k++)
+    {
+        starts[k] = start;
+    }
+}
+
+/**
+ * regex_find() on the scratch space of cache
+ */
+static bool pike_find(const regex_program *re,
+                      regex_cache *cache,
+                      const char *line,
+                      size_t line_len,
+                      size_t from,
+                      size_t *start,
+                      size_t *end)
+{
+    const unsigned char *bytes = (const unsigned char *) line;
+    pc_set *current = &cache->current;
+    pc_set *next = &cache->next;
+    size_t *current_start = cache->current_start;
+    size_t *next_start = cache->next_start;
+    bool found = false;
+
+    /*
+     * Threads stay ordered by where they started, as each step keeps their order and the
+     * thread starting at the next byte comes last. A program counter already taken by an
+     * earlier thread is never taken over, so every state is held by its leftmost start.
+     */
+    current->count = 0;
+    add_thread(re, cache, current, current_start, 0, from, from == 0, from == line_len);
+
+    for (size_t i = from;; i++)
+    {
+        // The earliest thread to reach a match wins, those that started later can go
+        for (size_t k = 0; k < current->count; k++)
+        {
+            if (re->insts[current->dense[k]].op != REGEX_MATCH)
+            {
+                continue;
+            }
+
+            found = true;
+            *start = current_start[k];
+            *end = i;
+            while (k < current->count && current_start[k] == *start)
+            {
+                k++;
+            }
+            current->count = k;
+        }
+
+        if (i == line_len || (current->count == 0 && found))
+        {
+            return found;
+        }
+
+        bool eol = i + 1 == line_len;
+        next->count = 0;
+        for (size_t k = 0; k < current->count; k++)
+        {
+            uint32_t pc = current->dense[k];
+            const regex_inst *inst = &re->insts[pc];
+
+            if (inst->op == REGEX_BYTE && set_has(re->sets[inst->x], bytes[i]))
+            {
+                add_thread(re, cache, next, next_start, pc + 1, current_start[k], false, eol);
+            }
+        }
+
+        // Until a match is found it may also start at the next byte
+        if (!found)
+        {
+            add_thread(re, cache, next, next_start, 0, i + 1, false, eol);
+        }
+
+        pc_set *swap = current;
+        current = next;
+        next = swap;
+
+        size_t *swap_start = current_start;
+        current_start = next_start;
+        next_start = swap_start;
+    }
+}
+
+bool regex_find(const regex_program *re,
+                const char *line,
+                size_t line_len,
+                size_t from,
+                size_t *start,
+                size_t *end)
+{
+    regex_cache *cache = get_cache(re);
+
+    if (cache == NULL)
+    {
+        pthread_mutex_lock(&re->caches->spare_lock);
+        bool found = pike_find(re, re->caches->spare, line, line_len, from, start, end);
+        pthread_mutex_unlock(&re->caches->spare_lock);
+        return found;
+    }
+    return pike_find(re, cache, line, line_len, from, start, end);
+}
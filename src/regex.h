@@ -0,0 +1,90 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    REGEX_BYTE,   // consume one byte out of sets[x]
+    REGEX_SPLIT,  // continue at both x and y
+    REGEX_JMP,    // continue at x
+    REGEX_BOL,    // only at the start of the line
+    REGEX_EOL,    // only at the end of the line
+    REGEX_MATCH,
+} regex_op;
+
+typedef struct
+{
+    regex_op op;
+    uint32_t x;
+    uint32_t y;
+} regex_inst;
+
+/**
+ * A POSIX extended regular expression compiled to a Thompson NFA program
+ * Lines are matched with a DFA built lazily from the program, one state at a time as the
+ * input needs it. Each thread keeps its own bounded cache of states; when the cache keeps
+ * filling up without being reused, that thread falls back to simulating the NFA directly
+ * (a Pike VM), so matching stays linear in the line length either way. A thread that cannot
+ * allocate a cache shares a Pike VM taken when the program was compiled.
+ *
+ * The compiler also works out literals every match has to contain, which callers can search
+ * for first and only run the expression on lines that hold one.
+ */
+typedef struct
+{
+    regex_inst *insts;
+    size_t inst_count;
+    uint64_t (*sets)[4];  // byte sets of the REGEX_BYTE instructions, one bit per byte
+    size_t set_count;
+    uint8_t classes[256];  // byte to equivalence class, bytes in the same class match alike
+    uint8_t class_bytes[256];  // one byte of each class
+    size_t class_count;
+    char **literals;  // every match contains one of these, lower-cased under fold
+    size_t *literal_lens;
+    size_t literal_count;  // zero when no literal is required
+    bool literals_exact;   // a literal occurrence alone proves a match
+    pthread_key_t cache_key;  // the per-thread state cache
+    bool has_cache_key;
+    struct regex_cache_list *caches;  // every thread's cache, for regex_free()
+} regex_program;
+
+/**
+ * Compile count expressions into one program matching wherever any of them does
+ * Under fold letters match either case. Returns false on failure, with *error describing a
+ * syntax error or left NULL when memory ran out.
+ */
+bool regex_compile(regex_program *re,
+                   const char *const *sources,
+                   size_t count,
+                   bool fold,
+                   const char **error);
+
+/**
+ * Check whether the expression matches anywhere in the line_len bytes at line
+ */
+bool regex_matches(const regex_program *re, const char *line, size_t line_len);
+
+/**
+ * Find the leftmost match in the line_len bytes at line that starts at from or later, the
+ * longest of those starting there, as POSIX wants it
+ * Returns false if there is none, else the match is [*start, *end), which may be empty. The
+ * NFA is simulated directly, this is meant for the lines already known to match.
+ */
+bool regex_find(const regex_program *re,
+                const char *line,
+                size_t line_len,
+                size_t from,
+                size_t *start,
+                size_t *end);
+
+/**
+ * Release the program and the cache of every thread that matched with it, threads still
+ * running included; none of them may be matching with it any more
+ */
+void regex_free(regex_program *re);
+
+#endif
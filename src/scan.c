@@ -0,0 +1,684 @@
+#include "scan.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+// Built with SCAN_NO_SIMD only the word-at-a-time kernels are left, as on a CPU without vectors
+#ifndef SCAN_NO_SIMD
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#endif
+#endif
+
+// SWAR constants, one copy of a value in every byte of a 64-bit word
+#define SWAR_ONES UINT64_C(0x0101010101010101)
+#define SWAR_LOW7 UINT64_C(0x7f7f7f7f7f7f7f7f)
+#define SWAR_HIGHS UINT64_C(0x8080808080808080)
+
+const unsigned char scan_fold_table[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+    0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+    0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+    0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+    0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+};
+
+// Bytes that show up most often in text and logs, most frequent first
+static const char common_bytes[] = " etaoinsrlhdcumpfgywb.,:-_/=0123456789vk\"'()[]x<>jqz";
+
+/**
+ * Rank how common a byte is, higher means rarer and so a better filter
+ */
+static size_t byte_rarity(unsigned char c)
+{
+    const char *found = c != '\0' ? strchr(common_bytes, c) : NULL;
+
+    return found != NULL ? (size_t) (found - common_bytes) : sizeof(common_bytes);
+}
+
+/**
+ * Read eight bytes from anywhere, alignment does not matter
+ */
+static inline uint64_t load_word(const char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/**
+ * Set the high bit of every byte of word that is zero, and no other bit
+ * Adding 0x7f to the low seven bits of a byte cannot carry into the next one, so unlike the
+ * usual (w - 0x01..) & ~w & 0x80.. trick there are no false hits after a zero byte.
+ */
+static inline uint64_t zero_bytes(uint64_t word)
+{
+    return ~(((word & SWAR_LOW7) + SWAR_LOW7) | word | SWAR_LOW7);
+}
+
+/**
+ * Index of the first byte, in memory order, whose high bit is set in a non-zero mask
+ */
+static inline size_t first_byte(uint64_t mask)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (size_t) __builtin_clzll(mask) / 8;
+#else
+    return (size_t) __builtin_ctzll(mask) / 8;
+#endif
+}
+
+/**
+ * The high bit of byte i of a word, in memory order
+ */
+static inline uint64_t byte_bit(size_t i)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return UINT64_C(0x80) << (8 * (7 - i));
+#else
+    return UINT64_C(0x80) << (8 * i);
+#endif
+}
+
+/**
+ * Lower-case the ASCII letters among eight bytes, the others are left alone
+ * A byte is upper case when its low seven bits reach 'A' but not past 'Z' and its high bit is
+ * clear; its high bit shifted down to 0x20 turns it into lower case.
+ */
+static inline uint64_t fold_word(uint64_t word)
+{
+    uint64_t low = word & SWAR_LOW7;
+    uint64_t from_a = low + SWAR_ONES * (0x80 - 'A');
+    uint64_t past_z = low + SWAR_ONES * (0x80 - 'Z' - 1);
+    uint64_t upper = from_a & ~past_z & ~word & SWAR_HIGHS;
+
+    return word | (upper >> 2);
+}
+
+bool scan_equal_fold(const char *data, const char *text, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        if (fold_word(load_word(data + i)) != load_word(text + i))
+        {
+            return false;
+        }
+    }
+
+    for (; i < len; i++)
+    {
+        if (scan_fold_table[(unsigned char) data[i]] != (unsigned char) text[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Check the remaining start offsets [i, last] of a case-insensitive search one by one
+ * Candidates are positions whose rare byte is either case of the needle byte, only those
+ * get the full folded comparison, in the vector loops as here.
+ */
+static const char *find_fold_tail(const scan_needle *needle,
+                                  const char *haystack,
+                                  size_t len,
+                                  size_t i)
+{
+    // Start offsets 0..last can still fit the whole needle
+    size_t last = len - needle->len;
+
+    for (; i <= last; i++)
+    {
+        if (scan_fold_table[(unsigned char) haystack[i + needle->rare]] == needle->rare_lower
+            && scan_equal_fold(haystack + i, needle->text, needle->len))
+        {
+            return haystack + i;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Portable case-insensitive search, 8 start offsets are screened per 64-bit word
+ */
+static const char *find_fold_swar(const scan_needle *needle, const char *haystack, size_t len)
+{
+    size_t last = len - needle->len;
+    uint64_t lower = SWAR_ONES * needle->rare_lower;
+    uint64_t upper = SWAR_ONES * needle->rare_upper;
+    size_t i = 0;
+
+    for (; i + 7 <= last; i += 8)
+    {
+        uint64_t word = load_word(haystack + i + needle->rare);
+        uint64_t mask = zero_bytes(word ^ lower) | zero_bytes(word ^ upper);
+
+        while (mask != 0)
+        {
+            size_t offset = first_byte(mask);
+            if (scan_equal_fold(haystack + i + offset, needle->text, needle->len))
+            {
+                return haystack + i + offset;
+            }
+            mask &= ~byte_bit(offset);
+        }
+    }
+
+    return find_fold_tail(needle, haystack, len, i);
+}
+
+#ifdef SCAN_X86
+/**
+ * SSE2 case-insensitive search, 16 start offsets are screened at once on the rare byte
+ */
+__attribute__((target("sse2"))) static const char *find_fold_sse2(const scan_needle *needle,
+                                                                 const char *haystack,
+                                                                 size_t len)
+{
+    size_t last = len - needle->len;
+    const __m128i lower = _mm_set1_epi8((char) needle->rare_lower);
+    const __m128i upper = _mm_set1_epi8((char) needle->rare_upper);
+    size_t i = 0;
+
+    for (; i + 15 <= last; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *) (haystack + i + needle->rare));
+        unsigned mask = (unsigned) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(block, lower), _mm_cmpeq_epi8(block, upper)));
+
+        while (mask != 0)
+        {
+            size_t candidate = i + (size_t) __builtin_ctz(mask);
+            if (scan_equal_fold(haystack + candidate, needle->text, needle->len))
+            {
+                return haystack + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_fold_tail(needle, haystack, len, i);
+}
+#endif
+
+/**
+ * Portable exact search, memchr() finds the rare byte and the pair byte screens candidates
+ */
+static const char *find_exact(const scan_needle *needle, const char *haystack, size_t len)
+{
+    size_t last = len - needle->len;
+    const char *pos = haystack + needle->rare;
+    const char *stop = haystack + last + needle->rare + 1;
+    char pair = needle->text[needle->pair];
+
+    while (pos < stop && (pos = memchr(pos, needle->rare_lower, (size_t) (stop - pos))) != NULL)
+    {
+        const char *candidate = pos - needle->rare;
+        if (candidate[needle->pair] == pair
+            && memcmp(candidate, needle->text, needle->len) == 0)
+        {
+            return candidate;
+        }
+        pos++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Check the remaining start offsets [i, last] one by one after a vector loop
+ */
+static const char *find_exact_tail(const scan_needle *needle,
+                                   const char *haystack,
+                                   size_t len,
+                                   size_t i)
+{
+    size_t last = len - needle->len;
+
+    for (; i <= last; i++)
+    {
+        if ((unsigned char) haystack[i + needle->rare] == needle->rare_lower
+            && haystack[i + needle->pair] == needle->text[needle->pair]
+            && memcmp(haystack + i, needle->text, needle->len) == 0)
+        {
+            return haystack + i;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Portable exact search, 8 start offsets are screened per 64-bit word on the rare and the
+ * pair byte, without the call per candidate find_exact() pays for memchr()
+ */
+static const char *find_exact_swar(const scan_needle *needle, const char *haystack, size_t len)
+{
+    size_t last = len - needle->len;
+    uint64_t rare = SWAR_ONES * needle->rare_lower;
+    uint64_t pair = SWAR_ONES * (unsigned char) needle->text[needle->pair];
+    size_t i = 0;
+
+    for (; i + 7 <= last; i += 8)
+    {
+        uint64_t mask = zero_bytes(load_word(haystack + i + needle->rare) ^ rare)
+                        & zero_bytes(load_word(haystack + i + needle->pair) ^ pair);
+
+        while (mask != 0)
+        {
+            size_t offset = first_byte(mask);
+            if (memcmp(haystack + i + offset, needle->text, needle->len) == 0)
+            {
+                return haystack + i + offset;
+            }
+            mask &= ~byte_bit(offset);
+        }
+    }
+
+    return find_exact_tail(needle, haystack, len, i);
+}
+
+#ifdef SCAN_X86
+/**
+ * SSE2 exact search, 16 start offsets are screened at once on the rare and the pair byte
+ */
+__attribute__((target("sse2"))) static const char *find_exact_sse2(const scan_needle *needle,
+                                                                  const char *haystack,
+                                                                  size_t len)
+{
+    size_t last = len - needle->len;
+    const __m128i rare = _mm_set1_epi8((char) needle->rare_lower);
+    const __m128i pair = _mm_set1_epi8(needle->text[needle->pair]);
+    size_t i = 0;
+
+    for (; i + 15 <= last; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *) (haystack + i + needle->rare));
+        __m128i b = _mm_loadu_si128((const __m128i *) (haystack + i + needle->pair));
+        unsigned mask = (unsigned) _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, rare), _mm_cmpeq_epi8(b, pair)));
+
+        while (mask != 0)
+        {
+            size_t candidate = i + (size_t) __builtin_ctz(mask);
+            if (memcmp(haystack + candidate, needle->text, needle->len) == 0)
+            {
+                return haystack + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_exact_tail(needle, haystack, len, i);
+}
+
+/**
+ * AVX2 variant of find_exact_sse2(), 32 start offsets per step
+ */
+__attribute__((target("avx2"))) static const char *find_exact_avx2(const scan_needle *needle,
+                                                                  const char *haystack,
+                                                                  size_t len)
+{
+    size_t last = len - needle->len;
+    const __m256i rare = _mm256_set1_epi8((char) needle->rare_lower);
+    const __m256i pair = _mm256_set1_epi8(needle->text[needle->pair]);
+    size_t i = 0;
+
+    for (; i + 31 <= last; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (haystack + i + needle->rare));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (haystack + i + needle->pair));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, rare), _mm256_cmpeq_epi8(b, pair)));
+
+        while (mask != 0)
+        {
+            size_t candidate = i + (size_t) __builtin_ctz(mask);
+            if (memcmp(haystack + candidate, needle->text, needle->len) == 0)
+            {
+                return haystack + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_exact_tail(needle, haystack, len, i);
+}
+#endif
+
+#ifdef SCAN_NEON
+// One bit per byte of a mask made by neon_mask(), the top bit of its nibble
+#define NEON_MASK_BITS UINT64_C(0x8888888888888888)
+
+/**
+ * Narrow 16 compare results to a 64-bit mask with four bits per byte, NEON has no movemask
+ */
+static inline uint64_t neon_mask(uint8x16_t matches)
+{
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) & NEON_MASK_BITS;
+}
+
+/**
+ * NEON exact search, 16 start offsets are screened at once on the rare and the pair byte
+ * NEON is part of the aarch64 baseline, so no runtime check is needed.
+ */
+static const char *find_exact_neon(const scan_needle *needle, const char *haystack, size_t len)
+{
+    size_t last = len - needle->len;
+    const uint8x16_t rare = vdupq_n_u8(needle->rare_lower);
+    const uint8x16_t pair = vdupq_n_u8((uint8_t) needle->text[needle->pair]);
+    size_t i = 0;
+
+    for (; i + 15 <= last; i += 16)
+    {
+        uint8x16_t a = vld1q_u8((const uint8_t *) (haystack + i + needle->rare));
+        uint8x16_t b = vld1q_u8((const uint8_t *) (haystack + i + needle->pair));
+        uint64_t mask = neon_mask(vandq_u8(vceqq_u8(a, rare), vceqq_u8(b, pair)));
+
+        while (mask != 0)
+        {
+            size_t candidate = i + (size_t) __builtin_ctzll(mask) / 4;
+            if (memcmp(haystack + candidate, needle->text, needle->len) == 0)
+            {
+                return haystack + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_exact_tail(needle, haystack, len, i);
+}
+
+/**
+ * NEON case-insensitive search, 16 start offsets are screened at once on the rare byte
+ */
+static const char *find_fold_neon(const scan_needle *needle, const char *haystack, size_t len)
+{
+    size_t last = len - needle->len;
+    const uint8x16_t lower = vdupq_n_u8(needle->rare_lower);
+    const uint8x16_t upper = vdupq_n_u8(needle->rare_upper);
+    size_t i = 0;
+
+    for (; i + 15 <= last; i += 16)
+    {
+        uint8x16_t block = vld1q_u8((const uint8_t *) (haystack + i + needle->rare));
+        uint64_t mask = neon_mask(vorrq_u8(vceqq_u8(block, lower), vceqq_u8(block, upper)));
+
+        while (mask != 0)
+        {
+            size_t candidate = i + (size_t) __builtin_ctzll(mask) / 4;
+            if (scan_equal_fold(haystack + candidate, needle->text, needle->len))
+            {
+                return haystack + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_fold_tail(needle, haystack, len, i);
+}
+#endif
+
+/**
+ * Pick the fastest kernel this CPU supports for the needle
+ */
+static scan_find_fn select_kernel(const scan_needle *needle)
+{
+    if (needle->fold)
+    {
+#ifdef SCAN_X86
+        if (__builtin_cpu_supports("sse2"))
+        {
+            return find_fold_sse2;
+        }
+#endif
+#ifdef SCAN_NEON
+        return find_fold_neon;
+#endif
+        return find_fold_swar;
+    }
+
+#ifdef SCAN_X86
+    // A single byte is best left to memchr(), which is already vectorized
+    if (needle->len >= 2)
+    {
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return find_exact_avx2;
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+            return find_exact_sse2;
+        }
+    }
+#endif
+
+#ifdef SCAN_NEON
+    if (needle->len >= 2)
+    {
+        return find_exact_neon;
+    }
+#endif
+
+    // Without vectors memchr() is word-at-a-time too, the pair byte only pays off in the loop
+    return needle->len >= 2 ? find_exact_swar : find_exact;
+}
+
+void scan_needle_init(scan_needle *needle, const char *text, size_t len, bool fold)
+{
+    needle->text = text;
+    needle->len = len;
+    needle->fold = fold;
+    needle->rare = 0;
+
+    for (size_t i = 1; i < len; i++)
+    {
+        if (byte_rarity((unsigned char) text[i]) > byte_rarity((unsigned char) text[needle->rare]))
+        {
+            needle->rare = i;
+        }
+    }
+
+    needle->pair = len < 2 || needle->rare == len - 1 ? 0 : len - 1;
+
+    unsigned char rare = len > 0 ? (unsigned char) text[needle->rare] : 0;
+    needle->rare_lower = rare;
+    needle->rare_upper = rare;
+    if (fold && rare >= 'a' && rare <= 'z')
+    {
+        needle->rare_upper = (unsigned char) (rare - 'a' + 'A');
+    }
+
+    needle->find = select_kernel(needle);
+}
+
+const char *scan_find(const scan_needle *needle, const char *haystack, size_t len)
+{
+    if (needle->len == 0)
+    {
+        return haystack;
+    }
+
+    if (needle->len > len)
+    {
+        return NULL;
+    }
+
+    return needle->find(needle, haystack, len);
+}
+
+#ifdef SCAN_X86
+/**
+ * Count newlines 32 bytes at a time by popcounting the compare mask
+ */
+__attribute__((target("avx2,popcnt"))) static size_t count_newlines_avx2(const char *data,
+                                                                       size_t len)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+        count += (size_t) __builtin_popcount(
+            (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+    }
+
+    for (; i < len; i++)
+    {
+        count += data[i] == '\n';
+    }
+
+    return count;
+}
+
+/**
+ * SSE2 variant of count_newlines_avx2(), 16 bytes at a time
+ */
+__attribute__((target("sse2"))) static size_t count_newlines_sse2(const char *data, size_t len)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        count += (size_t) __builtin_popcount(
+            (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+    }
+
+    for (; i < len; i++)
+    {
+        count += data[i] == '\n';
+    }
+
+    return count;
+}
+#endif
+
+#ifdef SCAN_NEON
+/**
+ * Count newlines 16 bytes at a time, each compare result of -1 is subtracted from a per-byte
+ * counter that is summed before it can wrap
+ */
+static size_t count_newlines_neon(const char *data, size_t len)
+{
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 16 <= len)
+    {
+        uint8x16_t counts = vdupq_n_u8(0);
+        size_t stop = i + 16 * 255;
+
+        for (; i + 16 <= len && i < stop; i += 16)
+        {
+            uint8x16_t block = vld1q_u8((const uint8_t *) (data + i));
+            counts = vsubq_u8(counts, vceqq_u8(block, newline));
+        }
+        count += vaddlvq_u8(counts);
+    }
+
+    for (; i < len; i++)
+    {
+        count += data[i] == '\n';
+    }
+
+    return count;
+}
+#endif
+
+/**
+ * Portable newline count, 8 bytes per 64-bit word
+ * Each byte of the counter word adds up the newlines in its lane for up to 255 words, and the
+ * lanes are summed before any of them can wrap.
+ */
+static size_t count_newlines_swar(const char *data, size_t len)
+{
+    const uint64_t newlines = SWAR_ONES * '\n';
+    const uint64_t low16 = UINT64_C(0x00ff00ff00ff00ff);
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 8 <= len)
+    {
+        uint64_t counts = 0;
+        size_t stop = i + 8 * 255;
+
+        for (; i + 8 <= len && i < stop; i += 8)
+        {
+            counts += zero_bytes(load_word(data + i) ^ newlines) >> 7;
+        }
+
+        // Pairs of lanes fit 16 bits, and the multiply gathers the four sums in the top ones
+        counts = (counts & low16) + ((counts >> 8) & low16);
+        count += (size_t) ((counts * UINT64_C(0x0001000100010001)) >> 48);
+    }
+
+    for (; i < len; i++)
+    {
+        count += data[i] == '\n';
+    }
+
+    return count;
+}
+
+typedef size_t (*count_newlines_fn)(const char *data, size_t len);
+
+static count_newlines_fn count_newlines;
+static pthread_once_t count_newlines_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Pick the newline counting kernel for this CPU, as select_kernel() does for the find ones
+ */
+static void select_count_kernel(void)
+{
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        count_newlines = count_newlines_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        count_newlines = count_newlines_sse2;
+        return;
+    }
+#endif
+
+#ifdef SCAN_NEON
+    count_newlines = count_newlines_neon;
+#else
+    count_newlines = count_newlines_swar;
+#endif
+}
+
+size_t scan_count_newlines(const char *data, size_t len)
+{
+    pthread_once(&count_newlines_once, select_count_kernel);
+    return count_newlines(data, len);
+}
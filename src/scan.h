@@ -0,0 +1,55 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * ASCII case folding table, maps 'A'-'Z' to 'a'-'z' and every other byte to itself
+ */
+extern const unsigned char scan_fold_table[256];
+
+typedef struct scan_needle scan_needle;
+
+/**
+ * Search kernel signature, picked per needle by scan_needle_init()
+ */
+typedef const char *(*scan_find_fn)(const scan_needle *needle, const char *haystack, size_t len);
+
+/**
+ * A literal prepared for repeated searching
+ * The filter bytes and the kernel for this CPU are chosen once, so each search only scans.
+ */
+struct scan_needle
+{
+    const char *text;  // lower-cased when fold is set, not owned
+    size_t len;
+    bool fold;         // match case-insensitively
+    size_t rare;       // offset in text of the byte the scan filters on
+    size_t pair;       // offset of a second filter byte, as far from rare as possible
+    unsigned char rare_lower;
+    unsigned char rare_upper;
+    scan_find_fn find;
+};
+
+/**
+ * Prepare text for searching, under fold it must already be lower-cased
+ */
+void scan_needle_init(scan_needle *needle, const char *text, size_t len, bool fold);
+
+/**
+ * Find the first occurrence of needle in the len bytes at haystack, or NULL
+ */
+const char *scan_find(const scan_needle *needle, const char *haystack, size_t len);
+
+/**
+ * Count the newlines in the len bytes at data
+ */
+size_t scan_count_newlines(const char *data, size_t len);
+
+/**
+ * Compare len bytes of data against already folded text, ignoring case
+ */
+bool scan_equal_fold(const char *data, const char *text, size_t len);
+
+#endif
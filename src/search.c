@@ -0,0 +1,1858 @@
+#include "search.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "context.h"
+#include "decompress.h"
+#include "follow.h"
+#include "output.h"
+#include "pool.h"
+#include "reader.h"
+#include "scan.h"
+#include "stats.h"
+#include "walk.h"
+
+// Files are only split when every chunk gets at least this many bytes
+#define MIN_CHUNK_SIZE (8 * 1024 * 1024)
+
+// Chunks per worker, a few more than one evens out chunks that take longer
+#define CHUNKS_PER_WORKER 4
+
+// Bytes at the start of a file searched for a NUL to tell binary files from text
+#define BINARY_PROBE_SIZE (32 * 1024)
+
+/**
+ * State shared by the file jobs of one parallel run
+ */
+typedef struct
+{
+    const search_context *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+} job_batch;
+
+/**
+ * One file of a parallel run, its output is collected in memory until its turn to print
+ */
+typedef struct
+{
+    job_batch *batch;
+    const char *filename;
+    char *output;
+    size_t output_len;
+    bool grouped;  // the output holds context groups
+    bool lost;     // the output could not all be kept
+    size_t match_count;
+    bool done;
+} file_job;
+
+/**
+ * State shared by the files found while walking directories for -r
+ * Files finish in no particular order on the pool, each one's output is written as a whole
+ * as soon as it is done.
+ */
+typedef struct
+{
+    search_context ctx;  // file names are always printed
+    output *out;
+    pthread_mutex_t lock;
+    pthread_cond_t file_done;
+    size_t pending;
+    bool matched;
+} tree_search;
+
+/**
+ * One file found by the walk
+ */
+typedef struct
+{
+    tree_search *tree;
+    char *path;
+} tree_job;
+
+/**
+ * State shared by the chunks of one large file
+ */
+typedef struct
+{
+    const search_context *ctx;
+    const char *filename;
+    pthread_mutex_t lock;
+    pthread_cond_t chunk_done;
+    size_t pending;
+} chunk_batch;
+
+/**
+ * One newline-aligned piece of a mapped file
+ */
+typedef struct
+{
+    chunk_batch *batch;
+    const char *data;
+    size_t len;
+    size_t offset;       // bytes before the chunk
+    size_t line_number;  // lines before the chunk
+    size_t newlines;     // counting pass: newlines inside the chunk
+    size_t match_count;
+    char *output;
+    size_t output_len;
+    bool lost;      // the output could not all be kept
+    bool counting;  // only count newlines, the first pass under -n
+} chunk_job;
+
+/**
+ * One search loop, specialized for invert_match, whether lines are printed, line numbers and
+ * the kind of prefilter; chosen once per buffer so that its inner loop tests none of them
+ */
+typedef size_t (*search_loop)(const compiled_pattern *pattern,
+                              output *out,
+                              const char *filename,
+                              const char *pos,
+                              const char *end,
+                              size_t *line_number,
+                              size_t limit,
+                              bool print_filename);
+
+// Kinds of search loop, by what the pattern offers to skip lines with
+enum
+{
+    LOOP_LINES,       // no prefilter, every line goes through the matcher
+    LOOP_CANDIDATES,  // only lines holding a prefilter hit go through the matcher
+    LOOP_EXACT,       // a prefilter hit proves the match, the matcher is never run
+    LOOP_KINDS
+};
+
+/**
+ * Check whether selected lines are printed, rather than only counted or merely noticed
+ */
+static bool prints_lines(grep_options opts)
+{
+    return !opts.count_only && !opts.quiet && !opts.list_files;
+}
+
+/**
+ * Check whether selected lines are printed with context lines around them
+ */
+static bool prints_context(grep_options opts)
+{
+    return opts.context && prints_lines(opts);
+}
+
+/**
+ * Run the matcher on one line, counted for --stats
+ */
+static bool test_line(const compiled_pattern *pattern, const char *line, size_t line_len)
+{
+    bool match = pattern_matches(pattern, line, line_len);
+
+    STATS_ADD(lines_tested, 1);
+    STATS_ADD(matches, match);
+    return match;
+}
+
+/**
+ * Print a selected line, prefixed with the filename and line number when requested
+ */
+static inline __attribute__((always_inline)) void print_line(output *out,
+                                                             const char *filename,
+                                                             size_t line_number,
+                                                             const char *line,
+                                                             size_t line_len,
+                                                             bool numbered,
+                                                             bool print_filename)
+{
+    if (print_filename)
+    {
+        output_bytes(out, filename, strlen(filename));
+        output_char(out, ':');
+    }
+
+    if (numbered)
+    {
+        output_number(out, line_number);
+        output_char(out, ':');
+    }
+
+    output_span(out, line, line_len);
+    output_char(out, '\n');
+}
+
+/**
+ * Test every line in [pos, end) against the pattern, returns the number of selected lines
+ * The flags are constants in every specialized loop, their branches are folded away.
+ */
+static inline __attribute__((always_inline)) size_t search_lines(const compiled_pattern *pattern,
+                                                                 output *out,
+                                                                 const char *filename,
+                                                                 const char *pos,
+                                                                 const char *end,
+                                                                 size_t *line_number,
+                                                                 size_t limit,
+                                                                 bool print_filename,
+                                                                 bool invert,
+                                                                 bool printing,
+                                                                 bool numbered)
+{
+    size_t match_count = 0;
+
+    while (pos < end && match_count < limit)
+    {
+        const char *line_end = memchr(pos, '\n', (size_t) (end - pos));
+        line_end = line_end != NULL ? line_end : end;
+        (*line_number)++;
+
+        if (test_line(pattern, pos, (size_t) (line_end - pos)) != invert)
+        {
+            match_count++;
+
+            if (printing)
+            {
+                print_line(out,
+                           filename,
+                           *line_number,
+                           pos,
+                           (size_t) (line_end - pos),
+                           numbered,
+                           print_filename);
+
+                // Once output is lost the rest of the input is not worth scanning
+                if (output_failed(out))
+                {
+                    break;
+                }
+            }
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return match_count;
+}
+
+/**
+ * Number of lines in [pos, end), counting a last line without its newline
+ */
+static size_t count_buffer_lines(const char *pos, const char *end)
+{
+    size_t lines = scan_count_newlines(pos, (size_t) (end - pos));
+    return pos < end && end[-1] != '\n' ? lines + 1 : lines;
+}
+
+/**
+ * Select every line in [pos, end), used under -v for the lines no candidate touched
+ */
+static inline __attribute__((always_inline)) size_t select_lines(output *out,
+                                                                 const char *filename,
+                                                                 const char *pos,
+                                                                 const char *end,
+                                                                 size_t *line_number,
+                                                                 size_t limit,
+                                                                 bool print_filename,
+                                                                 bool printing,
+                                                                 bool numbered)
+{
+    size_t match_count = 0;
+
+    // Without output only the number of lines matters
+    if (!printing)
+    {
+        size_t lines = count_buffer_lines(pos, end);
+        *line_number += lines;
+        return lines < limit ? lines : limit;
+    }
+
+    while (pos < end && match_count < limit)
+    {
+        const char *line_end = memchr(pos, '\n', (size_t) (end - pos));
+        line_end = line_end != NULL ? line_end : end;
+        (*line_number)++;
+        match_count++;
+
+        print_line(
+            out, filename, *line_number, pos, (size_t) (line_end - pos), numbered, print_filename);
+        if (output_failed(out))
+        {
+            break;
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return match_count;
+}
+
+/**
+ * Jump from candidate to candidate and only look for line boundaries around each one
+ * Like search_lines, every flag is a constant of the loop it is inlined into.
+ */
+static inline __attribute__((always_inline)) size_t
+search_candidates(const compiled_pattern *pattern,
+                  output *out,
+                  const char *filename,
+                  const char *pos,
+                  const char *end,
+                  size_t *line_number,
+                  size_t limit,
+                  bool print_filename,
+                  bool invert,
+                  bool printing,
+                  bool numbered,
+                  bool exact)
+{
+    size_t match_count = 0;
+
+    while (pos < end && match_count < limit)
+    {
+        const char *hit = pattern_find_candidate(pattern, pos, (size_t) (end - pos));
+        const char *line_start = end;
+        const char *line_end = end;
+
+        if (hit != NULL)
+        {
+            line_start = memrchr(pos, '\n', (size_t) (hit - pos));
+            line_start = line_start != NULL ? line_start + 1 : pos;
+
+            line_end = memchr(hit, '\n', (size_t) (end - hit));
+            line_end = line_end != NULL ? line_end : end;
+        }
+
+        // No line between the previous candidate and this one can match
+        if (invert)
+        {
+            match_count += select_lines(out,
+                                        filename,
+                                        pos,
+                                        line_start,
+                                        line_number,
+                                        limit - match_count,
+                                        print_filename,
+                                        printing,
+                                        numbered);
+            if (match_count == limit || (printing && output_failed(out)))
+            {
+                break;
+            }
+        }
+        else if (numbered)
+        {
+            *line_number += scan_count_newlines(pos, (size_t) (line_start - pos));
+        }
+
+        if (hit == NULL)
+        {
+            break;
+        }
+        STATS_ADD(candidates, 1);
+
+        (*line_number)++;
+
+        size_t line_len = (size_t) (line_end - line_start);
+        bool match = exact || test_line(pattern, line_start, line_len);
+        STATS_ADD(matches, exact);
+
+        if (match != invert)
+        {
+            match_count++;
+
+            if (printing)
+            {
+                print_line(
+                    out, filename, *line_number, line_start, line_len, numbered, print_filename);
+                if (output_failed(out))
+                {
+                    break;
+                }
+            }
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return match_count;
+}
+
+// The three kinds of loop for one combination of -v, printing and -n, suffixed with it in binary
+#define DEFINE_SEARCH_LOOPS(suffix, invert, printing, numbered)                                \
+    static size_t lines_##suffix(const compiled_pattern *pattern,                              \
+                                 output *out,                                                  \
+                                 const char *filename,                                         \
+                                 const char *pos,                                              \
+                                 const char *end,                                              \
+                                 size_t *line_number,                                          \
+                                 size_t limit,                                                 \
+                                 bool print_filename)                                          \
+    {                                                                                          \
+        return search_lines(pattern,                                                           \
+                            out,                                                               \
+                            filename,                                                          \
+                            pos,                                                               \
+                            end,                                                               \
+                            line_number,                                                       \
+                            limit,                                                             \
+                            print_filename,                                                    \
+                            invert,                                                            \
+                            printing,                                                          \
+                            numbered);                                                         \
+    }                                                                                          \
+    static size_t candidates_##suffix(const compiled_pattern *pattern,                         \
+                                      output *out,                                             \
+                                      const char *filename,                                    \
+                                      const char *pos,                                         \
+                                      const char *end,                                         \
+                                      size_t *line_number,                                     \
+                                      size_t limit,                                            \
+                                      bool print_filename)                                     \
+    {                                                                                          \
+        return search_candidates(pattern,                                                      \
+                                 out,                                                          \
+                                 filename,                                                     \
+                                 pos,                                                          \
+                                 end,                                                          \
+                                 line_number,                                                  \
+                                 limit,                                                        \
+                                 print_filename,                                               \
+                                 invert,                                                       \
+                                 printing,                                                     \
+                                 numbered,                                                     \
+                                 false);                                                       \
+    }                                                                                          \
+    static size_t exact_##suffix(const compiled_pattern *pattern,                              \
+                                 output *out,                                                  \
+                                 const char *filename,                                         \
+                                 const char *pos,                                              \
+                                 const char *end,                                              \
+                                 size_t *line_number,                                          \
+                                 size_t limit,                                                 \
+                                 bool print_filename)                                          \
+    {                                                                                          \
+        return search_candidates(pattern,                                                      \
+                                 out,                                                          \
+                                 filename,                                                     \
+                                 pos,                                                          \
+                                 end,                                                          \
+                                 line_number,                                                  \
+                                 limit,                                                        \
+                                 print_filename,                                               \
+                                 invert,                                                       \
+                                 printing,                                                     \
+                                 numbered,                                                     \
+                                 true);                                                        \
+    }
+
+DEFINE_SEARCH_LOOPS(000, false, false, false)
+DEFINE_SEARCH_LOOPS(001, false, false, true)
+DEFINE_SEARCH_LOOPS(010, false, true, false)
+DEFINE_SEARCH_LOOPS(011, false, true, true)
+DEFINE_SEARCH_LOOPS(100, true, false, false)
+DEFINE_SEARCH_LOOPS(101, true, false, true)
+DEFINE_SEARCH_LOOPS(110, true, true, false)
+DEFINE_SEARCH_LOOPS(111, true, true, true)
+
+// Every loop of one kind, indexed by -v, printing and -n
+#define SEARCH_LOOP_VARIANTS(kind)                                                             \
+    {                                                                                          \
+        {{kind##_000, kind##_001}, {kind##_010, kind##_011}},                                  \
+        {{kind##_100, kind##_101}, {kind##_110, kind##_111}},                                  \
+    }
+
+static const search_loop search_loops[LOOP_KINDS][2][2][2] = {
+    [LOOP_LINES] = SEARCH_LOOP_VARIANTS(lines),
+    [LOOP_CANDIDATES] = SEARCH_LOOP_VARIANTS(candidates),
+    [LOOP_EXACT] = SEARCH_LOOP_VARIANTS(exact),
+};
+
+/**
+ * Pick the loop specialized for the pattern and options
+ */
+static search_loop select_search_loop(const compiled_pattern *pattern, grep_options opts)
+{
+    int kind = !pattern_has_prefilter(pattern) ? LOOP_LINES
+               : pattern->prefilter_exact      ? LOOP_EXACT
+                                               : LOOP_CANDIDATES;
+
+    return search_loops[kind][opts.invert_match][prints_lines(opts)][opts.line_number];
+}
+
+/**
+ * Count the lines of [pos, end) selected by a pattern without a prefilter
+ */
+static inline __attribute__((always_inline)) size_t
+count_lines(const compiled_pattern *pattern, const char *pos, const char *end, bool invert)
+{
+    size_t match_count = 0;
+
+    while (pos < end)
+    {
+        const char *line_end = memchr(pos, '\n', (size_t) (end - pos));
+        line_end = line_end != NULL ? line_end : end;
+
+        if (test_line(pattern, pos, (size_t) (line_end - pos)) != invert)
+        {
+            match_count++;
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return match_count;
+}
+
+/**
+ * Count the lines of [pos, end) holding a confirmed candidate
+ */
+static inline __attribute__((always_inline)) size_t
+count_candidates(const compiled_pattern *pattern, const char *pos, const char *end, bool exact)
+{
+    size_t match_count = 0;
+
+    while (pos < end)
+    {
+        const char *hit = pattern_find_candidate(pattern, pos, (size_t) (end - pos));
+        if (hit == NULL)
+        {
+            break;
+        }
+        STATS_ADD(candidates, 1);
+
+        const char *line_end = memchr(hit, '\n', (size_t) (end - hit));
+        line_end = line_end != NULL ? line_end : end;
+
+        // An exact prefilter hit proves the match, the line start is never needed
+        if (exact)
+        {
+            STATS_ADD(matches, 1);
+            match_count++;
+        }
+        else
+        {
+            const char *line_start = memrchr(pos, '\n', (size_t) (hit - pos));
+            line_start = line_start != NULL ? line_start + 1 : pos;
+
+            if (test_line(pattern, line_start, (size_t) (line_end - line_start)))
+            {
+                match_count++;
+            }
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return match_count;
+}
+
+/**
+ * Count the selected lines of [pos, end) without printing anything or tracking line numbers
+ * Only the lines holding a candidate are looked at; under -v their count is subtracted from
+ * the number of lines in the buffer.
+ */
+static size_t count_matches(const compiled_pattern *pattern,
+                            const char *pos,
+                            const char *end,
+                            grep_options opts)
+{
+    // Without a literal to look for, every line has to go through the matcher
+    if (!pattern_has_prefilter(pattern))
+    {
+        return opts.invert_match ? count_lines(pattern, pos, end, true)
+                                 : count_lines(pattern, pos, end, false);
+    }
+
+    size_t match_count = pattern->prefilter_exact ? count_candidates(pattern, pos, end, true)
+                                                  : count_candidates(pattern, pos, end, false);
+
+    return opts.invert_match ? count_buffer_lines(pos, end) - match_count : match_count;
+}
+
+/**
+ * Print what goes in front of a line or match: the filename, the line number and, for -b, the
+ * byte offset, each followed by sep
+ */
+static void print_prefix(output *out,
+                         const char *filename,
+                         size_t line_number,
+                         size_t offset,
+                         grep_options opts,
+                         bool print_filename,
+                         char sep)
+{
+    if (print_filename)
+    {
+        output_bytes(out, filename, strlen(filename));
+        output_char(out, sep);
+    }
+
+    if (opts.line_number)
+    {
+        output_number(out, line_number);
+        output_char(out, sep);
+    }
+
+    if (opts.byte_offset)
+    {
+        output_number(out, offset);
+        output_char(out, sep);
+    }
+}
+
+/**
+ * Print every match in a selected line on its own, for -o
+ * Matches do not overlap; an empty one prints nothing and the next is looked for a byte on.
+ */
+static void print_matches(const compiled_pattern *pattern,
+                          output *out,
+                          const char *filename,
+                          size_t line_number,
+                          size_t offset,
+                          const char *line,
+                          size_t line_len,
+                          grep_options opts,
+                          bool print_filename)
+{
+    size_t from = 0;
+    size_t start;
+    size_t end;
+
+    while (from <= line_len && pattern_match_span(pattern, line, line_len, from, &start, &end))
+    {
+        if (start == end)
+        {
+            from = start + 1;
+            continue;
+        }
+
+        print_prefix(out, filename, line_number, offset + start, opts, print_filename, ':');
+        output_span(out, line + start, end - start);
+        output_char(out, '\n');
+        from = end;
+    }
+}
+
+/**
+ * Search [buf, buf + len) for -b and -o, which need where lines and matches are
+ * Rare enough not to get specialized loops: one loop tests the flags, jumping between
+ * candidates unless -v needs every line.
+ */
+static size_t search_spans(const compiled_pattern *pattern,
+                           output *out,
+                           const char *filename,
+                           const char *buf,
+                           size_t len,
+                           size_t offset,
+                           size_t *line_number,
+                           size_t limit,
+                           grep_options opts,
+                           bool print_filename)
+{
+    const char *pos = buf;
+    const char *end = buf + len;
+    size_t match_count = 0;
+    bool jump = !opts.invert_match && pattern_has_prefilter(pattern);
+
+    while (pos < end && match_count < limit)
+    {
+        const char *line_start = pos;
+        bool exact = false;
+
+        if (jump)
+        {
+            const char *hit = pattern_find_candidate(pattern, pos, (size_t) (end - pos));
+            if (hit == NULL)
+            {
+                *line_number += opts.line_number ? count_buffer_lines(pos, end) : 0;
+                break;
+            }
+            STATS_ADD(candidates, 1);
+
+            line_start = memrchr(pos, '\n', (size_t) (hit - pos));
+            line_start = line_start != NULL ? line_start + 1 : pos;
+            *line_number += opts.line_number ? scan_count_newlines(pos, (size_t) (line_start - pos))
+                                             : 0;
+            exact = pattern->prefilter_exact;
+        }
+
+        const char *line_end = memchr(line_start, '\n', (size_t) (end - line_start));
+        line_end = line_end != NULL ? line_end : end;
+        size_t line_len = (size_t) (line_end - line_start);
+        size_t line_offset = offset + (size_t) (line_start - buf);
+        (*line_number)++;
+
+        bool match = exact || test_line(pattern, line_start, line_len);
+        STATS_ADD(matches, exact);
+
+        if (match != opts.invert_match)
+        {
+            match_count++;
+
+            // A line -v selects holds no match to print
+            if (opts.only_matching && match)
+            {
+                print_matches(pattern,
+                              out,
+                              filename,
+                              *line_number,
+                              line_offset,
+                              line_start,
+                              line_len,
+                              opts,
+                              print_filename);
+            }
+            else if (!opts.only_matching)
+            {
+                print_prefix(out, filename, *line_number, line_offset, opts, print_filename, ':');
+                output_span(out, line_start, line_len);
+                output_char(out, '\n');
+            }
+
+            if (output_failed(out))
+            {
+                break;
+            }
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return match_count;
+}
+
+size_t search_buffer(const compiled_pattern *pattern,
+                     output *out,
+                     const char *filename,
+                     const char *buf,
+                     size_t len,
+                     size_t offset,
+                     size_t *line_number,
+                     size_t limit,
+                     grep_options opts,
+                     bool print_filename)
+{
+    // Lines are only counted for --stats, the search loops skip most of them
+    if (STATS_ON())
+    {
+        STATS_ADD(lines_scanned, count_buffer_lines(buf, buf + len));
+    }
+
+    // -c without -m only needs the total
+    if (opts.count_only && limit == SIZE_MAX)
+    {
+        return count_matches(pattern, buf, buf + len, opts);
+    }
+
+    if (prints_lines(opts) && (opts.byte_offset || opts.only_matching))
+    {
+        return search_spans(
+            pattern, out, filename, buf, len, offset, line_number, limit, opts, print_filename);
+    }
+
+    search_loop loop = select_search_loop(pattern, opts);
+    return loop(pattern, out, filename, buf, buf + len, line_number, limit, print_filename);
+}
+
+/**
+ * Number of lines after which a file has been searched far enough
+ */
+static size_t selection_limit(grep_options opts)
+{
+    // One line is enough to know the file matches, unless -m 0 allows none
+    if (opts.quiet || opts.list_files)
+    {
+        return opts.max_count < 1 ? opts.max_count : 1;
+    }
+
+    return opts.max_count;
+}
+
+/**
+ * Look for a NUL byte in the first block of a file and adjust the search when one turns up
+ * Unless they are to be treated as text, binary files are either skipped, with *skip set, or
+ * searched for one selected line only, with *report set and the lines themselves not printed.
+ */
+static void check_binary(const char *block,
+                         size_t len,
+                         grep_options *opts,
+                         size_t *limit,
+                         bool *skip,
+                         bool *report)
+{
+    len = len < BINARY_PROBE_SIZE ? len : BINARY_PROBE_SIZE;
+
+    // An empty file is mapped without any buffer
+    if (opts->binary_files == BINARY_TEXT || len == 0 || memchr(block, '\0', len) == NULL)
+    {
+        return;
+    }
+
+    if (opts->binary_files == BINARY_SKIP)
+    {
+        *skip = true;
+    }
+    else if (prints_lines(*opts))
+    {
+        // -c, -l and -q print no lines, so they see binary files like any other
+        *report = true;
+        opts->quiet = true;
+        *limit = 1;
+    }
+}
+
+/**
+ * Pool task: search or count the newlines of one chunk
+ */
+static void run_chunk_job(void *arg)
+{
+    chunk_job *job = arg;
+    chunk_batch *batch = job->batch;
+    const search_context *ctx = batch->ctx;
+
+    if (job->counting)
+    {
+        job->newlines = scan_count_newlines(job->data, job->len);
+    }
+    else if (atomic_load(ctx->stop))
+    {
+        // Output was lost, nothing more gets printed
+    }
+    else
+    {
+        output out;
+
+        if (output_init(&out, -1))
+        {
+            job->match_count = search_buffer(ctx->pattern,
+                                             &out,
+                                             batch->filename,
+                                             job->data,
+                                             job->len,
+                                             job->offset,
+                                             &job->line_number,
+                                             SIZE_MAX,
+                                             ctx->opts,
+                                             ctx->print_filename);
+            job->output = output_release(&out, &job->output_len);
+            job->lost = output_failed(&out);
+            output_free(&out);
+
+            if (job->lost)
+            {
+                atomic_store(ctx->stop, true);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Error: Out of memory searching '%s'\n", batch->filename);
+            atomic_store(ctx->failed, true);
+        }
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->pending--;
+    pthread_cond_broadcast(&batch->chunk_done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Queue every chunk and wait for all of them, running queued work while waiting
+ */
+static void run_chunks(pool *workers, chunk_batch *batch, chunk_job *chunks, size_t count)
+{
+    batch->pending = count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!pool_submit(workers, run_chunk_job, &chunks[i]))
+        {
+            run_chunk_job(&chunks[i]);
+        }
+    }
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->lock);
+        bool finished = batch->pending == 0;
+        pthread_mutex_unlock(&batch->lock);
+
+        if (finished)
+        {
+            return;
+        }
+
+        // Help with queued work rather than blocking this thread
+        if (pool_run_one(workers))
+        {
+            continue;
+        }
+
+        // Nothing left to help with, the remaining chunks are running on other workers
+        pthread_mutex_lock(&batch->lock);
+        while (batch->pending > 0)
+        {
+            pthread_cond_wait(&batch->chunk_done, &batch->lock);
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+/**
+ * Append the output of a job collected in memory
+ * The job's first context group could not know about the groups printed before it, so "--"
+ * is added in front of it here. Output a job lost leaves the whole of it incomplete.
+ */
+static void append_output(output *out, const char *data, size_t len, bool grouped, bool lost)
+{
+    if (grouped && out->grouped)
+    {
+        output_bytes(out, "--\n", strlen("--\n"));
+    }
+    out->grouped = out->grouped || grouped;
+    output_bytes(out, data, len);
+    out->error = out->error || lost;
+}
+
+/**
+ * Search a mapped file as newline-aligned chunks on the pool and print them in order
+ * Returns the number of selected lines, or SIZE_MAX when the file is not worth splitting.
+ */
+static size_t search_mapped_parallel(const search_context *ctx,
+                                     const char *filename,
+                                     const mapped_file *map,
+                                     output *out)
+{
+    size_t count = map->size / MIN_CHUNK_SIZE;
+    size_t max_chunks = ctx->opts.jobs * CHUNKS_PER_WORKER;
+
+    // Chunks run independently, so a search that stops early or prints context across chunk
+    // boundaries stays on this thread
+    if (ctx->workers == NULL || count < 2 || selection_limit(ctx->opts) != SIZE_MAX
+        || prints_context(ctx->opts))
+    {
+        return SIZE_MAX;
+    }
+    count = count < max_chunks ? count : max_chunks;
+
+    chunk_job *chunks = calloc(count, sizeof(*chunks));
+    if (chunks == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    chunk_batch batch;
+    batch.ctx = ctx;
+    batch.filename = filename;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.chunk_done, NULL);
+
+    // Cut at roughly even offsets, each cut moved forward to just past a newline
+    const char *start = map->data;
+    const char *end = map->data + map->size;
+    size_t used = 0;
+
+    while (used < count && start < end)
+    {
+        const char *stop = used == count - 1 ? end : map->data + map->size / count * (used + 1);
+
+        if (stop < start)
+        {
+            stop = start;
+        }
+        if (stop < end)
+        {
+            const char *newline = memchr(stop, '\n', (size_t) (end - stop));
+            stop = newline != NULL ? newline + 1 : end;
+        }
+
+        chunks[used].batch = &batch;
+        chunks[used].data = start;
+        chunks[used].len = (size_t) (stop - start);
+        chunks[used].offset = (size_t) (start - map->data);
+        used++;
+        start = stop;
+    }
+
+    // Line numbers need the newline count of every earlier chunk first
+    if (ctx->opts.line_number && prints_lines(ctx->opts))
+    {
+        for (size_t i = 0; i < used; i++)
+        {
+            chunks[i].counting = true;
+        }
+        run_chunks(ctx->workers, &batch, chunks, used);
+
+        size_t lines = 0;
+        for (size_t i = 0; i < used; i++)
+        {
+            chunks[i].counting = false;
+            chunks[i].line_number = lines;
+            lines += chunks[i].newlines;
+        }
+    }
+
+    run_chunks(ctx->workers, &batch, chunks, used);
+
+    size_t match_count = 0;
+    for (size_t i = 0; i < used; i++)
+    {
+        append_output(out, chunks[i].output, chunks[i].output_len, false, chunks[i].lost);
+        free(chunks[i].output);
+        match_count += chunks[i].match_count;
+    }
+
+    pthread_cond_destroy(&batch.chunk_done);
+    pthread_mutex_destroy(&batch.lock);
+    free(chunks);
+    return match_count;
+}
+
+/**
+ * Search only the blocks of a mapped file the index says could hold a match
+ * Runs of consecutive candidate blocks are searched as one buffer, starting from the line
+ * number the index recorded for them. Returns the number of selected lines, or SIZE_MAX when
+ * the index does not cover the file as it is now.
+ */
+static size_t search_mapped_indexed(const search_context *ctx,
+                                    const char *filename,
+                                    int fd,
+                                    const mapped_file *map,
+                                    output *out,
+                                    size_t limit,
+                                    grep_options opts,
+                                    arena *scratch)
+{
+    struct stat st;
+    const index_file *file = NULL;
+
+    // Context lines can lie in the blocks the index rules out
+    if (ctx->index == NULL || prints_context(opts) || fstat(fd, &st) != 0)
+    {
+        return SIZE_MAX;
+    }
+
+    char *real_path = realpath(filename, NULL);
+    if (real_path != NULL)
+    {
+        file = index_find_file(ctx->index, real_path, &st);
+        free(real_path);
+    }
+    if (file == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    size_t count = file->block_count;
+    size_t size = count > 0 ? count : 1;
+    uint8_t *candidates = scratch != NULL ? arena_alloc(scratch, size) : malloc(size);
+    if (candidates == NULL || !index_candidates(ctx->index, file, ctx->index_query, candidates))
+    {
+        if (scratch == NULL)
+        {
+            free(candidates);
+        }
+        return SIZE_MAX;
+    }
+
+    const index_block *blocks = ctx->index->blocks + file->first_block;
+    size_t match_count = 0;
+    size_t i = 0;
+
+    while (i < count && match_count < limit && !output_failed(out))
+    {
+        if (!candidates[i])
+        {
+            i++;
+            continue;
+        }
+
+        size_t run_end = i;
+        while (run_end < count && candidates[run_end])
+        {
+            run_end++;
+        }
+
+        const index_block *last = &blocks[run_end - 1];
+        size_t line_number = blocks[i].first_line;
+        match_count += search_buffer(ctx->pattern,
+                                     out,
+                                     filename,
+                                     map->data + blocks[i].offset,
+                                     last->offset + last->len - blocks[i].offset,
+                                     blocks[i].offset,
+                                     &line_number,
+                                     limit - match_count,
+                                     opts,
+                                     ctx->print_filename);
+        i = run_end;
+    }
+
+    if (scratch == NULL)
+    {
+        free(candidates);
+    }
+    return match_count;
+}
+
+/**
+ * Search one buffer of a file, through the context window when context lines are printed
+ */
+static size_t search_block(const search_context *ctx,
+                           output *out,
+                           const char *filename,
+                           const char *buf,
+                           size_t len,
+                           size_t offset,
+                           size_t *line_number,
+                           size_t limit,
+                           grep_options opts,
+                           context_window *window)
+{
+    if (prints_context(opts))
+    {
+        return context_search(
+            window, ctx->pattern, buf, len, offset, line_number, limit, opts.invert_match);
+    }
+
+    return search_buffer(ctx->pattern,
+                         out,
+                         filename,
+                         buf,
+                         len,
+                         offset,
+                         line_number,
+                         limit,
+                         opts,
+                         ctx->print_filename);
+}
+
+/**
+ * Map a file to search it in place, through the cache when there is one
+ */
+static bool map_input(const search_context *ctx, int fd, mapped_file *map)
+{
+    return ctx->maps != NULL ? map_cache_get(ctx->maps, fd, map) : map_file(fd, map);
+}
+
+/**
+ * Done with a mapping from map_input(), the cache may keep it for the next search
+ */
+static void unmap_input(const search_context *ctx, mapped_file *map)
+{
+    if (ctx->maps != NULL)
+    {
+        map_cache_put(ctx->maps, map);
+    }
+    else
+    {
+        unmap_file(map);
+    }
+}
+
+/**
+ * Search an open file and close it, ahead holds what the fetcher already read of it or is NULL
+ * A file the fetcher got whole is searched in its buffer, anything else is mapped or read.
+ * Its scratch memory comes from the thread's arena and is all given back before returning.
+ */
+static size_t search_open_file(const search_context *ctx,
+                               const char *filename,
+                               int fd,
+                               const fetched_file *ahead,
+                               output *out)
+{
+    grep_options opts = ctx->opts;
+    bool print_filename = ctx->print_filename;
+    size_t limit = selection_limit(opts);
+    mapped_file map;
+    stream_reader reader;
+    context_window window;
+    const char *block;
+    size_t block_len;
+    size_t line_number = 0;
+    size_t match_count = 0;
+    bool skip = false;
+    bool report = false;
+    decoder dec;
+    bool decoding = false;
+    uint64_t bytes_read = 0;
+    bool preloaded = false;
+    bool failed = false;  // the file cannot be searched, the reason is reported
+    arena *scratch = arena_thread();
+    arena_mark scratch_mark;
+
+    // Another file may be halfway through the same arena, only this file's part is released
+    if (scratch != NULL)
+    {
+        scratch_mark = arena_save(scratch);
+    }
+
+    STATS_FILE_BEGIN(mark);
+    context_init(&window, out, filename, opts, print_filename, scratch);
+
+    // Compressed input is decompressed on another thread and read like a stream
+    if (opts.decompress && limit != 0)
+    {
+        const char *error;
+
+        if (!decoder_open(&dec, fd, &decoding, &error))
+        {
+            fprintf(stderr, "Error: Cannot decompress '%s': %s\n", filename, error);
+            failed = true;
+            atomic_store(ctx->failed, true);
+        }
+    }
+
+    if (!decoding && ahead != NULL && ahead->complete)
+    {
+        map.data = ahead->data;
+        map.size = ahead->len;
+        preloaded = true;
+    }
+
+    // Regular files are scanned in place, stdin and pipes go through the chunked reader
+    if (limit == 0 || failed)
+    {
+        // -m 0 never needs to look at the input
+    }
+    else if (!decoding && fd != STDIN_FILENO && (preloaded || map_input(ctx, fd, &map)))
+    {
+        check_binary(map.data, map.size, &opts, &limit, &skip, &report);
+        bytes_read = map.size;
+
+        match_count =
+            skip ? 0 : search_mapped_indexed(ctx, filename, fd, &map, out, limit, opts, scratch);
+        if (match_count == SIZE_MAX && !report)
+        {
+            match_count = search_mapped_parallel(ctx, filename, &map, out);
+        }
+        if (match_count == SIZE_MAX)
+        {
+            match_count = search_block(
+                ctx, out, filename, map.data, map.size, 0, &line_number, limit, opts, &window);
+        }
+        output_sync(out);
+        if (!preloaded)
+        {
+            unmap_input(ctx, &map);
+        }
+    }
+    else if (stream_reader_init(&reader, fd, scratch))
+    {
+        bool first_block = true;
+
+        reader.source = decoding ? &dec : NULL;
+
+        // Once the limit is reached, and any lines after the last one printed, no further read
+        // is issued
+        while ((match_count < limit || context_pending(&window)) && !output_failed(out)
+               && stream_reader_next(&reader, &block, &block_len))
+        {
+            if (first_block)
+            {
+                first_block = false;
+                check_binary(block, block_len, &opts, &limit, &skip, &report);
+                if (skip)
+                {
+                    break;
+                }
+            }
+            match_count += search_block(ctx,
+                                        out,
+                                        filename,
+                                        block,
+                                        block_len,
+                                        bytes_read,
+                                        &line_number,
+                                        limit - match_count,
+                                        opts,
+                                        &window);
+            bytes_read += block_len;
+
+            // The next block overwrites this one, except for the lines -B may still need
+            output_sync(out);
+            reader.keep = context_kept(&window);
+        }
+
+        if (reader.error && decoding && dec.error != NULL)
+        {
+            fprintf(stderr, "Error: Cannot decompress '%s': %s\n", filename, dec.error);
+            atomic_store(ctx->failed, true);
+        }
+        else if (reader.error)
+        {
+            fprintf(stderr, "Error: Cannot read file '%s'\n", filename);
+            atomic_store(ctx->failed, true);
+        }
+        stream_reader_free(&reader);
+    }
+    else
+    {
+        fprintf(stderr, "Error: Out of memory reading '%s'\n", filename);
+        atomic_store(ctx->failed, true);
+    }
+
+    // The decoding thread stops here even if the search ended early
+    if (decoding)
+    {
+        decoder_close(&dec);
+    }
+    context_free(&window);
+    if (scratch != NULL)
+    {
+        arena_release(scratch, scratch_mark);
+    }
+
+    if (failed)
+    {
+        // The error is all there is to say about the file
+    }
+    else if (report)
+    {
+        if (match_count > 0)
+        {
+            output_bytes(out, "Binary file ", strlen("Binary file "));
+            output_bytes(out, filename, strlen(filename));
+            output_bytes(out, " matches\n", strlen(" matches\n"));
+        }
+    }
+    else if (opts.quiet)
+    {
+        // Only the exit status reports the result
+    }
+    else if (opts.list_files)
+    {
+        if (match_count > 0)
+        {
+            output_bytes(out, filename, strlen(filename));
+            output_char(out, '\n');
+        }
+    }
+    else if (opts.count_only)
+    {
+        if (print_filename)
+        {
+            output_bytes(out, filename, strlen(filename));
+            output_char(out, ':');
+        }
+        output_number(out, match_count);
+        output_char(out, '\n');
+    }
+
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+
+    // Whatever is left to search would be printed nowhere
+    if (output_failed(out))
+    {
+        atomic_store(ctx->stop, true);
+    }
+
+    STATS_FILE_END(mark, filename, bytes_read);
+    return match_count;
+}
+
+size_t search_file(const search_context *ctx, const char *filename, output *out)
+{
+    int fd;
+
+    // File or STDIN
+    if (strcmp(filename, "stdin") == 0)
+    {
+        fd = STDIN_FILENO;
+    }
+    else
+    {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+            atomic_store(ctx->failed, true);
+            return 0;
+        }
+    }
+
+    return search_open_file(ctx, filename, fd, NULL, out);
+}
+
+/**
+ * Map "-" to stdin the way the command line spells it
+ */
+static const char *input_name(const char *file)
+{
+    return strcmp(file, "-") == 0 ? "stdin" : file;
+}
+
+/**
+ * Search the oldest files the fetcher has in flight until only keep are left, returns true if
+ * any line was selected; once -q has its answer the remaining ones are only closed
+ */
+static bool search_fetched(const search_context *ctx, output *out, size_t keep)
+{
+    bool matched = false;
+
+    while (fetch_pending(ctx->fetch) > keep)
+    {
+        fetched_file file;
+        fetch_pop(ctx->fetch, &file);
+
+        if (atomic_load(ctx->stop))
+        {
+            if (file.fd >= 0)
+            {
+                close(file.fd);
+            }
+        }
+        else
+        {
+            // Files the fetcher did not open are searched by name, which reports any error
+            size_t match_count = file.fd >= 0
+                                     ? search_open_file(ctx, file.name, file.fd, &file, out)
+                                     : search_file(ctx, file.name, out);
+
+            matched = matched || match_count > 0;
+            if (match_count > 0 && ctx->opts.quiet)
+            {
+                atomic_store(ctx->stop, true);
+            }
+        }
+
+        fetch_release(ctx->fetch);
+        free(file.arg);
+    }
+
+    return matched;
+}
+
+/**
+ * Hand a file to the fetcher, searching the oldest pending one first to make room
+ * arg is freed once the file is searched. Returns true if any line was selected.
+ */
+static bool fetch_file(const search_context *ctx, const char *name, void *arg, output *out)
+{
+    bool matched = search_fetched(ctx, out, FETCH_DEPTH - 1);
+
+    fetch_push(ctx->fetch, name, arg);
+    return matched;
+}
+
+
+/**
+ * Pool task: search one file into a memory buffer and mark it done
+ */
+static void run_file_job(void *arg)
+{
+    file_job *job = arg;
+    job_batch *batch = job->batch;
+    output out;
+
+    // Under -q one match anywhere settles the result, the remaining files are skipped
+    if (atomic_load(batch->ctx->stop))
+    {
+        // Nothing to do
+    }
+    else if (output_init(&out, -1))
+    {
+        job->match_count = search_file(batch->ctx, job->filename, &out);
+        job->output = output_release(&out, &job->output_len);
+        job->grouped = out.grouped;
+        job->lost = output_failed(&out);
+        output_free(&out);
+
+        if (job->match_count > 0 && batch->ctx->opts.quiet)
+        {
+            atomic_store(batch->ctx->stop, true);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Error: Out of memory searching '%s'\n", job->filename);
+        atomic_store(batch->ctx->failed, true);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    job->done = true;
+    pthread_cond_broadcast(&batch->job_done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Pool task: search one file found by the walk and write its output in one piece
+ */
+static void run_tree_job(void *arg)
+{
+    tree_job *job = arg;
+    tree_search *tree = job->tree;
+    size_t match_count = 0;
+    char *buf = NULL;
+    size_t len = 0;
+    bool grouped = false;
+    bool lost = false;
+    output out;
+
+    if (atomic_load(tree->ctx.stop))
+    {
+        // Nothing to do
+    }
+    else if (output_init(&out, -1))
+    {
+        match_count = search_file(&tree->ctx, job->path, &out);
+        buf = output_release(&out, &len);
+        grouped = out.grouped;
+        lost = output_failed(&out);
+        output_free(&out);
+
+        if (match_count > 0 && tree->ctx.opts.quiet)
+        {
+            atomic_store(tree->ctx.stop, true);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Error: Out of memory searching '%s'\n", job->path);
+        atomic_store(tree->ctx.failed, true);
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    append_output(tree->out, buf, len, grouped, lost);
+    tree->matched = tree->matched || match_count > 0;
+    if (--tree->pending == 0)
+    {
+        pthread_cond_broadcast(&tree->file_done);
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    free(buf);
+    free(job->path);
+    free(job);
+}
+
+/**
+ * Walk callback: search a file right here without a pool, or queue it on the pool
+ */
+static void visit_file(void *arg, char *path)
+{
+    tree_search *tree = arg;
+    tree_job *job = NULL;
+
+    if (atomic_load(tree->ctx.stop))
+    {
+        free(path);
+        return;
+    }
+
+    // On one thread the walk keeps running while the fetcher opens and reads what it found
+    if (tree->ctx.fetch != NULL)
+    {
+        tree->matched = fetch_file(&tree->ctx, path, path, tree->out) || tree->matched;
+        return;
+    }
+
+    if (tree->ctx.workers != NULL)
+    {
+        job = malloc(sizeof(*job));
+    }
+
+    if (job == NULL)
+    {
+        bool matched = search_file(&tree->ctx, path, tree->out) > 0;
+        tree->matched = tree->matched || matched;
+        if (matched && tree->ctx.opts.quiet)
+        {
+            atomic_store(tree->ctx.stop, true);
+        }
+        free(path);
+        return;
+    }
+
+    job->tree = tree;
+    job->path = path;
+
+    pthread_mutex_lock(&tree->lock);
+    tree->pending++;
+    pthread_mutex_unlock(&tree->lock);
+
+    if (!pool_submit(tree->ctx.workers, run_tree_job, job))
+    {
+        run_tree_job(job);
+    }
+}
+
+/**
+ * Search every file below the directory root, returns true if any line was selected
+ */
+static bool search_tree(const search_context *ctx, const char *root, output *out)
+{
+    tree_search tree;
+
+    tree.ctx = *ctx;
+    tree.ctx.print_filename = true;
+    tree.out = out;
+    tree.pending = 0;
+    tree.matched = false;
+    pthread_mutex_init(&tree.lock, NULL);
+    pthread_cond_init(&tree.file_done, NULL);
+
+    walk_tree(root, ctx->filters, ctx->workers, ctx->stop, ctx->failed, visit_file, &tree);
+
+    if (ctx->fetch != NULL)
+    {
+        tree.matched = search_fetched(&tree.ctx, out, 0) || tree.matched;
+    }
+
+    // The walk is over, only file searches can still be queued
+    for (;;)
+    {
+        pthread_mutex_lock(&tree.lock);
+        bool finished = tree.pending == 0;
+        pthread_mutex_unlock(&tree.lock);
+
+        if (finished || !pool_run_one(ctx->workers))
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&tree.lock);
+    while (tree.pending > 0)
+    {
+        pthread_cond_wait(&tree.file_done, &tree.lock);
+    }
+    pthread_mutex_unlock(&tree.lock);
+
+    pthread_cond_destroy(&tree.file_done);
+    pthread_mutex_destroy(&tree.lock);
+    return tree.matched;
+}
+
+/**
+ * Check whether a command line argument names a directory to walk under -r
+ */
+static bool is_directory(const char *file)
+{
+    struct stat st;
+
+    // The empty name stands for the current directory when no file was given
+    return *file == '\0' || (stat(file, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+/**
+ * Search files one after the other on this thread, returns true if any line was selected
+ */
+static bool search_files_sequential(const search_context *ctx,
+                                    const char *const *files,
+                                    size_t count,
+                                    output *out)
+{
+    bool matched = false;
+
+    // Under -q the first match settles the result, and lost output ends the search
+    for (size_t i = 0; i < count && !(matched && ctx->opts.quiet) && !atomic_load(ctx->stop); i++)
+    {
+        const char *name = input_name(files[i]);
+        bool directory = ctx->opts.recursive && is_directory(files[i]);
+
+        if (ctx->fetch != NULL && !directory && strcmp(name, "stdin") != 0)
+        {
+            matched = fetch_file(ctx, name, NULL, out) || matched;
+            continue;
+        }
+
+        // Files already handed to the fetcher come first
+        if (ctx->fetch != NULL)
+        {
+            matched = search_fetched(ctx, out, 0) || matched;
+        }
+
+        if (matched && ctx->opts.quiet)
+        {
+            break;
+        }
+        else if (directory)
+        {
+            matched = search_tree(ctx, files[i], out) || matched;
+        }
+        else
+        {
+            matched = search_file(ctx, name, out) > 0 || matched;
+        }
+    }
+
+    if (ctx->fetch != NULL)
+    {
+        matched = search_fetched(ctx, out, 0) || matched;
+    }
+
+    return matched;
+}
+
+/**
+ * Search files on the pool and print each file's output once all earlier ones are out,
+ * so the result is byte for byte the same as a sequential run
+ */
+static bool search_files_parallel(const search_context *ctx,
+                                  const char *const *files,
+                                  size_t count,
+                                  output *out)
+{
+    file_job *jobs = calloc(count, sizeof(*jobs));
+    job_batch batch;
+    bool matched = false;
+
+    if (jobs == NULL)
+    {
+        return search_files_sequential(ctx, files, count, out);
+    }
+
+    batch.ctx = ctx;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.job_done, NULL);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        jobs[i].batch = &batch;
+        jobs[i].filename = input_name(files[i]);
+
+        // A job that cannot be queued runs right here instead
+        if (!pool_submit(ctx->workers, run_file_job, &jobs[i]))
+        {
+            run_file_job(&jobs[i]);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        pthread_mutex_lock(&batch.lock);
+        while (!jobs[i].done)
+        {
+            pthread_cond_wait(&batch.job_done, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        append_output(out, jobs[i].output, jobs[i].output_len, jobs[i].grouped, jobs[i].lost);
+        free(jobs[i].output);
+        matched = matched || jobs[i].match_count > 0;
+    }
+
+    pthread_cond_destroy(&batch.job_done);
+    pthread_mutex_destroy(&batch.lock);
+    free(jobs);
+    return matched;
+}
+
+/**
+ * Write out what is left and report, once, whether any output was lost
+ */
+static bool report_lost_output(output *out)
+{
+    output_flush(out);
+    if (output_failed(out))
+    {
+        fprintf(stderr, "Error: Write error\n");
+        return true;
+    }
+    return false;
+}
+
+bool search_files(const compiled_pattern *pattern,
+                  const char *const *files,
+                  size_t count,
+                  grep_options opts,
+                  const walk_filters *filters,
+                  const trigram_index *index,
+                  bool print_filename,
+                  bool *failed)
+{
+    output out;
+
+    if (!output_init(&out, STDOUT_FILENO))
+    {
+        fprintf(stderr, "Error: Out of memory\n");
+        *failed = true;
+        return false;
+    }
+
+    bool matched = search_files_shared(
+        pattern, files, count, opts, filters, index, print_filename, NULL, NULL, &out, failed);
+
+    output_free(&out);
+    return matched;
+}
+
+bool search_files_shared(const compiled_pattern *pattern,
+                         const char *const *files,
+                         size_t count,
+                         grep_options opts,
+                         const walk_filters *filters,
+                         const trigram_index *index,
+                         bool print_filename,
+                         pool *workers,
+                         map_cache *maps,
+                         output *out,
+                         bool *failed)
+{
+    atomic_bool stop = false;
+    atomic_bool any_error = false;
+    search_context ctx = {
+        pattern, opts, print_filename, NULL, &stop, &any_error, filters, NULL, NULL, NULL, maps};
+    index_query query;
+    bool matched;
+
+    // Following is waiting on the files, it runs on this thread alone
+    if (opts.follow)
+    {
+        matched = follow_files(&ctx, files, count, out);
+        *failed = report_lost_output(out) || atomic_load(&any_error);
+        return matched;
+    }
+
+    // Blocks without the pattern's trigrams only ever hold lines -v selects
+    if (index != NULL && !opts.invert_match && index_query_init(&query, pattern))
+    {
+        ctx.index = index;
+        ctx.index_query = &query;
+    }
+
+    // Without a pool everything runs on this thread
+    if (opts.jobs > 1)
+    {
+        ctx.workers = workers != NULL ? workers : pool_create(opts.jobs);
+    }
+
+    // One thread searching many files would otherwise wait on every open and first read; files
+    // the cache keeps mapped are better off not being read at all
+    if (ctx.workers == NULL && maps == NULL && (count > 1 || opts.recursive))
+    {
+        ctx.fetch = fetch_create();
+    }
+
+    // Directories are walked on the pool themselves, the arguments are taken in order
+    if (ctx.workers != NULL && count > 1 && !opts.recursive)
+    {
+        matched = search_files_parallel(&ctx, files, count, out);
+    }
+    else
+    {
+        matched = search_files_sequential(&ctx, files, count, out);
+    }
+
+    if (ctx.workers != NULL && ctx.workers != workers)
+    {
+        pool_destroy(ctx.workers);
+    }
+    if (ctx.fetch != NULL)
+    {
+        fetch_destroy(ctx.fetch);
+    }
+    if (ctx.index_query != NULL)
+    {
+        index_query_free(&query);
+    }
+
+    *failed = report_lost_output(out) || atomic_load(&any_error);
+    return matched;
+}
@@ -0,0 +1,96 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fetch.h"
+#include "grep.h"
+#include "output.h"
+#include "pattern.h"
+#include "index.h"
+#include "mapcache.h"
+#include "pool.h"
+#include "walk.h"
+
+/**
+ * Everything a search needs besides the input, shared read-only by all threads of a run
+ */
+typedef struct
+{
+    const compiled_pattern *pattern;
+    grep_options opts;
+    bool print_filename;
+    pool *workers;  // NULL when searching on one thread
+    atomic_bool *stop;  // set once -q has its answer, later files are skipped
+    atomic_bool *failed;  // set once an error was reported, for the exit status
+    const walk_filters *filters;  // which files -r looks at
+    const trigram_index *index;       // --index, NULL when it cannot narrow this search
+    const index_query *index_query;  // the pattern's trigrams to look up in it
+    fetcher *fetch;  // opens and reads files ahead when searching on one thread, else NULL
+    map_cache *maps;  // keeps files mapped from one search to the next, NULL to unmap each
+} search_context;
+
+/**
+ * Search a buffer made of whole lines and print the selected ones, returns how many there were
+ * offset is where the buffer starts in the file, for -b. line_number holds the number of lines
+ * before the buffer and is advanced past it; it is only kept up to date when line numbers are
+ * printed. The search stops as soon as limit lines have been selected.
+ */
+size_t search_buffer(const compiled_pattern *pattern,
+                     output *out,
+                     const char *filename,
+                     const char *buf,
+                     size_t len,
+                     size_t offset,
+                     size_t *line_number,
+                     size_t limit,
+                     grep_options opts,
+                     bool print_filename);
+
+/**
+ * Search for a pattern in a file and print matching lines to out, returns the number of
+ * selected lines. Large regular files are split into chunks searched on ctx->workers when
+ * there is a pool. Reading stops as soon as -q, -l or -m have their answer.
+ */
+size_t search_file(const search_context *ctx, const char *filename, output *out);
+
+/**
+ * Search every file in files, "-" meaning stdin, and print the results in argument order
+ * With opts.jobs above one the files, and chunks of large files, are searched in parallel on a
+ * thread pool. Under -r directories are walked with filters, "" standing for the current one;
+ * the files found in them are searched on the pool as the walk finds them, in no particular
+ * order. With an index, files it covers only have the blocks it points to searched. On one
+ * thread, several files or a walk are opened and read ahead, many at a time, while earlier
+ * ones are searched. Under --follow the files are handed to follow_files() instead.
+ * Returns true if any line was selected, *failed tells whether an error was reported.
+ */
+bool search_files(const compiled_pattern *pattern,
+                  const char *const *files,
+                  size_t count,
+                  grep_options opts,
+                  const walk_filters *filters,
+                  const trigram_index *index,
+                  bool print_filename,
+                  bool *failed);
+
+/**
+ * search_files() printing to out and reusing what the server keeps from one query to the next
+ * Searches with opts.jobs above one run on workers instead of a pool of their own, workers
+ * being NULL when there are none. With maps, regular files are mapped through it and left
+ * mapped. Nothing is flushed to out.
+ */
+bool search_files_shared(const compiled_pattern *pattern,
+                         const char *const *files,
+                         size_t count,
+                         grep_options opts,
+                         const walk_filters *filters,
+                         const trigram_index *index,
+                         bool print_filename,
+                         pool *workers,
+                         map_cache *maps,
+                         output *out,
+                         bool *failed);
+
+#endif
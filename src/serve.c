@@ -0,0 +1,789 @@
+#include "serve.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "mapcache.h"
+#include "options.h"
+#include "output.h"
+#include "pattern.h"
+#include "pool.h"
+#include "search.h"
+
+// Bytes read from a client at once, and copied from a reply at once by the client side
+#define SERVE_READ_SIZE (64 * 1024)
+
+/**
+ * A compiled pattern set, a free slot when key is NULL
+ */
+typedef struct
+{
+    char *key;  // the flags that shape the compiled form, then every pattern with its length
+    size_t key_len;
+    compiled_pattern pattern;
+    uint64_t last_use;
+} cached_pattern;
+
+/**
+ * A connection, with the part of its queries read so far
+ */
+typedef struct
+{
+    int fd;  // -1 once it is to be dropped
+    char *buf;
+    size_t len;
+    size_t cap;
+} client;
+
+/**
+ * Everything a server keeps from one query to the next
+ */
+typedef struct
+{
+    int listen_fd;
+    int home_fd;    // directory the server started in, gone back to after every query
+    int error_fd;   // memory file the error messages of a query are written to
+    int stderr_fd;  // the server's own stderr
+    size_t jobs;
+    pool *workers;  // started by the first query with -j, NULL until then
+    map_cache *maps;
+    cached_pattern patterns[SERVE_PATTERN_CACHE];
+    uint64_t clock;
+    client clients[SERVE_MAX_CLIENTS];
+    size_t client_count;
+} server;
+
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int signo)
+{
+    (void) signo;
+    stop_requested = 1;
+}
+
+/**
+ * Write all of data to a socket, false once the peer is gone or too slow to take it
+ */
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+/**
+ * Build the cache key of the patterns a command line asks for, NULL if memory runs out
+ */
+static char *pattern_key(const command_line *cmd, size_t *key_len)
+{
+    const grep_options *opts = &cmd->options;
+    size_t len = 4;
+
+    for (size_t i = 0; i < cmd->patterns.count; i++)
+    {
+        len += sizeof(size_t) + strlen(cmd->patterns.items[i]);
+    }
+
+    char *key = malloc(len);
+    if (key == NULL)
+    {
+        return NULL;
+    }
+
+    // Only these options reach pattern_compile_set()
+    key[0] = (char) opts->ignore_case;
+    key[1] = (char) opts->use_regex;
+    key[2] = (char) opts->use_anchors;
+    key[3] = (char) opts->use_wildcards;
+
+    char *pos = key + 4;
+    for (size_t i = 0; i < cmd->patterns.count; i++)
+    {
+        size_t pattern_len = strlen(cmd->patterns.items[i]);
+        memcpy(pos, &pattern_len, sizeof(pattern_len));
+        memcpy(pos + sizeof(pattern_len), cmd->patterns.items[i], pattern_len);
+        pos += sizeof(pattern_len) + pattern_len;
+    }
+
+    *key_len = len;
+    return key;
+}
+
+/**
+ * Free a cached pattern set to make room for another
+ */
+static void evict_pattern(cached_pattern *entry)
+{
+    pattern_free(&entry->pattern);
+    free(entry->key);
+    entry->key = NULL;
+}
+
+/**
+ * Find the compiled form of the patterns of a command line, compiling it on a miss
+ * Returns NULL once the reason was reported on stderr.
+ */
+static const compiled_pattern *lookup_pattern(server *srv, const command_line *cmd)
+{
+    size_t key_len;
+    char *key = pattern_key(cmd, &key_len);
+    cached_pattern *slot = NULL;
+
+    if (key == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory\n");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < SERVE_PATTERN_CACHE; i++)
+    {
+        cached_pattern *entry = &srv->patterns[i];
+
+        if (entry->key != NULL && entry->key_len == key_len
+            && memcmp(entry->key, key, key_len) == 0)
+        {
+            entry->last_use = ++srv->clock;
+            free(key);
+            return &entry->pattern;
+        }
+
+        // A free slot, or else the least recently used set, takes the new one
+        if (slot == NULL || (slot->key != NULL
+                             && (entry->key == NULL || entry->last_use < slot->last_use)))
+        {
+            slot = entry;
+        }
+    }
+
+    if (slot->key != NULL)
+    {
+        evict_pattern(slot);
+    }
+
+    // Compiled in place, the compiled form may point into itself
+    if (!command_line_compile(cmd, &slot->pattern))
+    {
+        free(key);
+        return NULL;
+    }
+
+    slot->key = key;
+    slot->key_len = key_len;
+    slot->last_use = ++srv->clock;
+    return &slot->pattern;
+}
+
+/**
+ * Check whether a command line reads standard input, for patterns or as a file to search
+ */
+static bool reads_standard_input(const command_line *cmd)
+{
+    bool reads = cmd->stdin_patterns;
+
+    for (size_t i = 0; i < cmd->file_count && !reads; i++)
+    {
+        reads = strcmp(cmd->files[i], "-") == 0;
+    }
+    return reads;
+}
+
+/**
+ * Run one parsed command line and print its results to out, returns its exit status
+ */
+static int answer_query(server *srv, int argc, char **argv, output *out)
+{
+    command_line cmd;
+    int status;
+
+    if (!command_line_parse(&cmd, argc, argv, &status))
+    {
+        return status;
+    }
+
+    // A query has to end, and the server's own settings are not the client's to change
+    if (cmd.options.follow || cmd.serve_path != NULL || cmd.stats)
+    {
+        fprintf(stderr, "Error: --follow, --serve and --stats cannot be sent to a server\n");
+        command_line_free(&cmd);
+        return EXIT_TROUBLE;
+    }
+
+    // The server's stdin is /dev/null, searching it would answer as though no line matched
+    if (reads_standard_input(&cmd))
+    {
+        fprintf(stderr, "Error: A server cannot read the client's standard input\n");
+        command_line_free(&cmd);
+        return EXIT_TROUBLE;
+    }
+
+    if (cmd.build_index_path != NULL)
+    {
+        bool built = index_build(cmd.build_index_path, cmd.files, cmd.file_count, &cmd.filters);
+        command_line_free(&cmd);
+        return built ? EXIT_SUCCESS : EXIT_TROUBLE;
+    }
+
+    const compiled_pattern *pattern = lookup_pattern(srv, &cmd);
+    if (pattern == NULL)
+    {
+        command_line_free(&cmd);
+        return EXIT_TROUBLE;
+    }
+
+    trigram_index index;
+    if (cmd.index_path != NULL && !index_open(&index, cmd.index_path))
+    {
+        fprintf(stderr, "Error: Cannot open index '%s'\n", cmd.index_path);
+        command_line_free(&cmd);
+        return EXIT_TROUBLE;
+    }
+
+    // -j asks for the server's pool, however many threads the query named
+    grep_options opts = cmd.options;
+    if (opts.jobs > 1 && srv->jobs > 1 && srv->workers == NULL)
+    {
+        srv->workers = pool_create(srv->jobs);
+    }
+    opts.jobs = opts.jobs > 1 && srv->workers != NULL ? srv->jobs : 1;
+
+    bool failed;
+    bool matched = search_files_shared(pattern,
+                                       cmd.files,
+                                       cmd.file_count,
+                                       opts,
+                                       &cmd.filters,
+                                       cmd.index_path != NULL ? &index : NULL,
+                                       cmd.print_filename,
+                                       srv->workers,
+                                       srv->maps,
+                                       out,
+                                       &failed);
+
+    if (cmd.index_path != NULL)
+    {
+        index_close(&index);
+    }
+    command_line_free(&cmd);
+
+    // As with grep, 1 means no line was selected and 2 that a file could not be searched,
+    // unless -q found its line anyway
+    if (failed && !(matched && opts.quiet))
+    {
+        return EXIT_TROUBLE;
+    }
+    return matched ? EXIT_SUCCESS : 1;
+}
+
+/**
+ * Read back the error messages of the last query, NULL when there are none
+ */
+static char *read_errors(server *srv, size_t *len)
+{
+    off_t size = lseek(srv->error_fd, 0, SEEK_END);
+    char *errors = size > 0 ? malloc((size_t) size) : NULL;
+    size_t done = 0;
+
+    while (errors != NULL && done < (size_t) size)
+    {
+        ssize_t n = pread(srv->error_fd, errors + done, (size_t) size - done, (off_t) done);
+        if (n <= 0)
+        {
+            break;
+        }
+        done += (size_t) n;
+    }
+
+    *len = errors != NULL ? done : 0;
+    return errors;
+}
+
+/**
+ * Run a query in the directory it names, with its error messages collected, and send the reply
+ * Returns false if the client cannot be sent it.
+ */
+static bool run_query(server *srv, client *c, const char *directory, int argc, char **argv)
+{
+    int status = EXIT_TROUBLE;
+    output out;
+    bool have_output = output_init(&out, -1);
+
+    // Every thread's messages go to fd 2, and only this query's threads run until it is done
+    fflush(stderr);
+    if (ftruncate(srv->error_fd, 0) == 0)
+    {
+        lseek(srv->error_fd, 0, SEEK_SET);
+    }
+    dup2(srv->error_fd, STDERR_FILENO);
+
+    if (!have_output)
+    {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+    else if (chdir(directory) != 0)
+    {
+        fprintf(stderr, "Error: Cannot change to directory '%s'\n", directory);
+    }
+    else
+    {
+        status = answer_query(srv, argc, argv, &out);
+    }
+
+    if (fchdir(srv->home_fd) != 0)
+    {
+        fprintf(stderr, "Error: Cannot change back to the server directory\n");
+    }
+    fflush(stderr);
+    dup2(srv->stderr_fd, STDERR_FILENO);
+
+    size_t output_len = 0;
+    size_t errors_len;
+    char *output = have_output ? output_release(&out, &output_len) : NULL;
+    char *errors = read_errors(srv, &errors_len);
+    char header[64];
+    int header_len =
+        snprintf(header, sizeof(header), "%d %zu %zu\n", status, output_len, errors_len);
+
+    bool sent = send_all(c->fd, header, (size_t) header_len)
+                && send_all(c->fd, output, output_len) && send_all(c->fd, errors, errors_len);
+
+    free(output);
+    free(errors);
+    if (have_output)
+    {
+        output_free(&out);
+    }
+    return sent;
+}
+
+/**
+ * Answer every whole query at the start of the client's buffer and drop them from it
+ * Returns false if the client is to be disconnected, for a malformed query or a reply it
+ * would not take.
+ */
+static bool take_queries(server *srv, client *c)
+{
+    size_t pos = 0;
+    bool ok = true;
+
+    while (ok)
+    {
+        char *start = c->buf + pos;
+        char *end = c->buf + c->len;
+        char *field_end = memchr(start, '\0', (size_t) (end - start));
+        if (field_end == NULL)
+        {
+            break;
+        }
+
+        char *number_end;
+        unsigned long count = strtoul(start, &number_end, 10);
+        if (start == field_end || number_end != field_end || count >= SERVE_MAX_QUERY)
+        {
+            return false;
+        }
+
+        // The program name, then the arguments, then the NULL getopt wants
+        char **argv = malloc((count + 2) * sizeof(*argv));
+        if (argv == NULL)
+        {
+            return false;
+        }
+        argv[0] = "grep";
+
+        // The directory, then the arguments
+        char *directory = NULL;
+        char *field = field_end + 1;
+        size_t fields = 0;
+        while (fields < count + 1 && field < end)
+        {
+            field_end = memchr(field, '\0', (size_t) (end - field));
+            if (field_end == NULL)
+            {
+                break;
+            }
+            if (fields == 0)
+            {
+                directory = field;
+            }
+            else
+            {
+                argv[fields] = field;
+            }
+            fields++;
+            field = field_end + 1;
+        }
+
+        // The rest of the query is still on its way
+        if (fields < count + 1)
+        {
+            free(argv);
+            break;
+        }
+
+        argv[count + 1] = NULL;
+        ok = run_query(srv, c, directory, (int) count + 1, argv);
+        free(argv);
+        pos = (size_t) (field - c->buf);
+    }
+
+    memmove(c->buf, c->buf + pos, c->len - pos);
+    c->len -= pos;
+    return ok;
+}
+
+/**
+ * Read what a client sent and answer the queries it completes, false to disconnect it
+ */
+static bool read_client(server *srv, client *c)
+{
+    if (c->len == c->cap)
+    {
+        size_t cap = c->cap > 0 ? c->cap * 2 : SERVE_READ_SIZE;
+        char *buf = cap <= SERVE_MAX_QUERY ? realloc(c->buf, cap) : NULL;
+        if (buf == NULL)
+        {
+            return false;
+        }
+        c->buf = buf;
+        c->cap = cap;
+    }
+
+    ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len);
+    if (n < 0 && errno == EINTR)
+    {
+        return true;
+    }
+    if (n <= 0)
+    {
+        return false;
+    }
+
+    c->len += (size_t) n;
+    return take_queries(srv, c);
+}
+
+/**
+ * Take a new connection, replies that do not go out in time drop it
+ */
+static void accept_client(server *srv)
+{
+    struct timeval timeout = {SERVE_SEND_TIMEOUT, 0};
+    int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    client *c = &srv->clients[srv->client_count++];
+    c->fd = fd;
+    c->buf = NULL;
+    c->len = 0;
+    c->cap = 0;
+}
+
+/**
+ * Wait for connections and queries until a signal asks the server to stop
+ * wait_mask lets SIGINT and SIGTERM through, they are blocked the rest of the time.
+ */
+static void serve_clients(server *srv, const sigset_t *wait_mask)
+{
+    struct pollfd fds[SERVE_MAX_CLIENTS + 1];
+
+    while (!stop_requested)
+    {
+        // A full server only takes new connections once one goes away
+        fds[0].fd = srv->listen_fd;
+        fds[0].events = srv->client_count < SERVE_MAX_CLIENTS ? POLLIN : 0;
+        for (size_t i = 0; i < srv->client_count; i++)
+        {
+            fds[i + 1].fd = srv->clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        int ready = ppoll(fds, srv->client_count + 1, NULL, wait_mask);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready < 0)
+        {
+            fprintf(stderr, "Error: Cannot wait for queries: %s\n", strerror(errno));
+            return;
+        }
+
+        size_t polled = srv->client_count;
+        for (size_t i = 0; i < polled; i++)
+        {
+            client *c = &srv->clients[i];
+            if (fds[i + 1].revents != 0 && !read_client(srv, c))
+            {
+                close(c->fd);
+                free(c->buf);
+                c->fd = -1;
+            }
+        }
+
+        // Dropped clients leave a gap, filled from the end
+        size_t kept = 0;
+        for (size_t i = 0; i < srv->client_count; i++)
+        {
+            if (srv->clients[i].fd >= 0)
+            {
+                srv->clients[kept++] = srv->clients[i];
+            }
+        }
+        srv->client_count = kept;
+
+        if (fds[0].revents & POLLIN)
+        {
+            accept_client(srv);
+        }
+    }
+}
+
+/**
+ * Bind the listening socket at path, taking over a socket file no server answers on
+ */
+static bool listen_on(server *srv, const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: Socket path too long '%s'\n", path);
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv->listen_fd < 0)
+    {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    // Left behind by a server that is gone, unless one still answers on it
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        if (connect(srv->listen_fd, (const struct sockaddr *) &addr, sizeof(addr)) == 0)
+        {
+            fprintf(stderr, "Error: A server is already listening on '%s'\n", path);
+            return false;
+        }
+        unlink(path);
+    }
+
+    if (bind(srv->listen_fd, (const struct sockaddr *) &addr, sizeof(addr)) != 0
+        || listen(srv->listen_fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool serve_run(const char *path, size_t jobs)
+{
+    server srv;
+    sigset_t stop_signals;
+    sigset_t wait_mask;
+    struct sigaction action;
+    bool ok = false;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.jobs = jobs;
+    srv.listen_fd = -1;
+    srv.home_fd = -1;
+    srv.error_fd = -1;
+    srv.stderr_fd = -1;
+
+    // Blocked on every thread, workers included, and only let through while waiting
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Nothing a query does reads the server's own stdin
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+
+    srv.home_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    srv.error_fd = memfd_create("grep-errors", MFD_CLOEXEC);
+    srv.stderr_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    srv.maps = map_cache_create();
+
+    if (srv.home_fd < 0 || srv.error_fd < 0 || srv.stderr_fd < 0 || srv.maps == NULL)
+    {
+        fprintf(stderr, "Error: Cannot start the server: %s\n", strerror(errno));
+    }
+    else if (listen_on(&srv, path))
+    {
+        serve_clients(&srv, &wait_mask);
+        unlink(path);
+        ok = true;
+    }
+
+    for (size_t i = 0; i < srv.client_count; i++)
+    {
+        close(srv.clients[i].fd);
+        free(srv.clients[i].buf);
+    }
+    if (srv.workers != NULL)
+    {
+        pool_destroy(srv.workers);
+    }
+    for (size_t i = 0; i < SERVE_PATTERN_CACHE; i++)
+    {
+        if (srv.patterns[i].key != NULL)
+        {
+            pattern_free(&srv.patterns[i].pattern);
+            free(srv.patterns[i].key);
+        }
+    }
+    if (srv.maps != NULL)
+    {
+        map_cache_destroy(srv.maps);
+    }
+    if (srv.listen_fd >= 0)
+    {
+        close(srv.listen_fd);
+    }
+    if (srv.home_fd >= 0)
+    {
+        close(srv.home_fd);
+    }
+    if (srv.error_fd >= 0)
+    {
+        close(srv.error_fd);
+    }
+    if (srv.stderr_fd >= 0)
+    {
+        close(srv.stderr_fd);
+    }
+    return ok;
+}
+
+/**
+ * Copy len bytes of the reply to out, false if the reply ends before them
+ */
+static bool copy_reply(FILE *reply, FILE *out, size_t len)
+{
+    char buf[SERVE_READ_SIZE];
+
+    while (len > 0)
+    {
+        size_t n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), reply);
+        if (n == 0)
+        {
+            return false;
+        }
+        fwrite(buf, 1, n, out);
+        len -= n;
+    }
+    return true;
+}
+
+int serve_query(const char *path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char count[32];
+    char *directory = getcwd(NULL, 0);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path) || directory == NULL || fd < 0)
+    {
+        fprintf(stderr, "Error: Cannot connect to server '%s'\n", path);
+        free(directory);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return EXIT_TROUBLE;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (connect(fd, (const struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Error: Cannot connect to server '%s': %s\n", path, strerror(errno));
+        free(directory);
+        close(fd);
+        return EXIT_TROUBLE;
+    }
+
+    // Every field goes out with its NUL
+    int count_len = snprintf(count, sizeof(count), "%d", argc);
+    bool sent = send_all(fd, count, (size_t) count_len + 1)
+                && send_all(fd, directory, strlen(directory) + 1);
+    for (int i = 0; sent && i < argc; i++)
+    {
+        sent = send_all(fd, argv[i], strlen(argv[i]) + 1);
+    }
+    free(directory);
+
+    FILE *reply = sent ? fdopen(fd, "r") : NULL;
+    int status;
+    size_t output_len;
+    size_t errors_len;
+
+    if (reply == NULL || fscanf(reply, "%d %zu %zu", &status, &output_len, &errors_len) != 3
+        || fgetc(reply) != '\n' || !copy_reply(reply, stdout, output_len)
+        || !copy_reply(reply, stderr, errors_len))
+    {
+        fprintf(stderr, "Error: No reply from server '%s'\n", path);
+        status = EXIT_TROUBLE;
+    }
+
+    if (reply != NULL)
+    {
+        fclose(reply);
+    }
+    else
+    {
+        close(fd);
+    }
+    fflush(stdout);
+    return status;
+}
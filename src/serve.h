@@ -0,0 +1,41 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Compiled pattern sets a server keeps, the least recently used one goes first
+#define SERVE_PATTERN_CACHE 64
+
+// Connections a server reads queries from at once
+#define SERVE_MAX_CLIENTS 64
+
+// Longest query a server accepts, a client sending more is disconnected
+#define SERVE_MAX_QUERY (1024 * 1024)
+
+// Seconds a server waits for a client to take a reply before disconnecting it
+#define SERVE_SEND_TIMEOUT 10
+
+/**
+ * Answer queries on the Unix socket at path until SIGINT or SIGTERM, for --serve
+ * A query is a command line as grep itself takes it, without the program name. It is sent as
+ * fields that each end with a NUL byte: the number of arguments in decimal, the directory to
+ * run it in, then the arguments. A connection may send any number of queries, one after the
+ * other, without waiting for the replies. Each reply is a header line "STATUS OUT ERR\n",
+ * with the exit status and the two lengths in decimal, then OUT bytes of output and ERR bytes
+ * of error messages.
+ * Queries run one at a time, with -j above one on a pool of jobs threads kept for every
+ * query. Compiled patterns are kept in a cache keyed by the patterns and the options that
+ * shape them, and regular files stay mapped until they change. A query cannot read standard
+ * input, with "-" or -f -, and --follow, --serve and --stats cannot be sent. Returns false if
+ * the socket cannot be set up.
+ */
+bool serve_run(const char *path, size_t jobs);
+
+/**
+ * Send a command line to the server at path and print its reply, for --connect
+ * Returns the exit status of the query, or EXIT_TROUBLE without a server to answer it.
+ */
+int serve_query(const char *path, int argc, char **argv);
+
+#endif
@@ -0,0 +1,107 @@
+#include "stats.h"
+
+#ifdef GREP_STATS
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+_Thread_local grep_stats thread_stats;
+bool stats_enabled;
+
+// Sum of the counters of every thread that has flushed
+static grep_stats totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stats_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+void stats_file_begin(stats_mark *mark)
+{
+    mark->start = STATS_CLOCK();
+    mark->io_ns = thread_stats.io_ns;
+    mark->output_ns = thread_stats.output_ns;
+}
+
+void stats_file_end(const stats_mark *mark, const char *filename, uint64_t bytes)
+{
+    thread_stats.files++;
+    thread_stats.bytes += bytes;
+
+    if (!stats_enabled)
+    {
+        return;
+    }
+
+    uint64_t elapsed = stats_now() - mark->start;
+    uint64_t io = thread_stats.io_ns - mark->io_ns;
+    uint64_t output = thread_stats.output_ns - mark->output_ns;
+    thread_stats.match_ns += elapsed > io + output ? elapsed - io - output : 0;
+
+    double seconds = (double) elapsed / 1e9;
+    fprintf(stderr,
+            "stats: file %s: %llu bytes in %.6f s, %.1f MB/s\n",
+            filename,
+            (unsigned long long) bytes,
+            seconds,
+            seconds > 0 ? (double) bytes / seconds / 1e6 : 0.0);
+}
+
+void stats_flush(void)
+{
+    pthread_mutex_lock(&totals_lock);
+    totals.files += thread_stats.files;
+    totals.bytes += thread_stats.bytes;
+    totals.lines_scanned += thread_stats.lines_scanned;
+    totals.lines_tested += thread_stats.lines_tested;
+    totals.candidates += thread_stats.candidates;
+    totals.matches += thread_stats.matches;
+    totals.io_ns += thread_stats.io_ns;
+    totals.match_ns += thread_stats.match_ns;
+    totals.output_ns += thread_stats.output_ns;
+    totals.scratch_peak += thread_stats.scratch_peak;
+    pthread_mutex_unlock(&totals_lock);
+
+    memset(&thread_stats, 0, sizeof(thread_stats));
+}
+
+void stats_report(void)
+{
+    struct rusage usage;
+
+    stats_flush();
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        usage.ru_maxrss = 0;
+    }
+
+    pthread_mutex_lock(&totals_lock);
+    double search_seconds = (double) (totals.io_ns + totals.match_ns) / 1e9;
+
+    fprintf(stderr, "stats: files: %llu\n", (unsigned long long) totals.files);
+    fprintf(stderr, "stats: bytes read: %llu\n", (unsigned long long) totals.bytes);
+    fprintf(stderr, "stats: lines scanned: %llu\n", (unsigned long long) totals.lines_scanned);
+    fprintf(stderr, "stats: lines tested: %llu\n", (unsigned long long) totals.lines_tested);
+    fprintf(stderr, "stats: prefilter candidates: %llu\n", (unsigned long long) totals.candidates);
+    fprintf(stderr, "stats: confirmed matches: %llu\n", (unsigned long long) totals.matches);
+    fprintf(stderr, "stats: io seconds: %.6f\n", (double) totals.io_ns / 1e9);
+    fprintf(stderr, "stats: matching seconds: %.6f\n", (double) totals.match_ns / 1e9);
+    fprintf(stderr, "stats: output seconds: %.6f\n", (double) totals.output_ns / 1e9);
+    fprintf(stderr,
+            "stats: throughput MB/s: %.1f\n",
+            search_seconds > 0 ? (double) totals.bytes / search_seconds / 1e6 : 0.0);
+    fprintf(stderr,
+            "stats: scratch high water: %llu bytes\n",
+            (unsigned long long) totals.scratch_peak);
+    fprintf(stderr, "stats: peak RSS: %ld KiB\n", usage.ru_maxrss);
+    pthread_mutex_unlock(&totals_lock);
+}
+
+#endif
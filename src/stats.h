@@ -0,0 +1,93 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Counters behind --stats, kept per thread and summed when each thread is done
+ * Times are in nanoseconds and add up across threads, so do the arena high-water marks.
+ */
+typedef struct
+{
+    uint64_t files;
+    uint64_t bytes;          // bytes read from files
+    uint64_t lines_scanned;  // lines in the buffers searched, counted only under --stats
+    uint64_t lines_tested;   // lines handed to the matcher
+    uint64_t candidates;     // prefilter hits
+    uint64_t matches;        // lines the matcher or an exact prefilter confirmed
+    uint64_t io_ns;          // mapping files and reading streams
+    uint64_t match_ns;       // searching, what is left of each file once I/O and output are out
+    uint64_t output_ns;      // writing results
+    uint64_t scratch_peak;   // high-water mark of the thread's arena, in bytes
+} grep_stats;
+
+#ifdef GREP_STATS
+
+/**
+ * The start of one file's search, to attribute its time once it is done
+ */
+typedef struct
+{
+    uint64_t start;
+    uint64_t io_ns;
+    uint64_t output_ns;
+} stats_mark;
+
+extern _Thread_local grep_stats thread_stats;
+
+// --stats, only set before any search starts; counters run regardless, clocks only with it
+extern bool stats_enabled;
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t stats_now(void);
+
+/**
+ * Start timing a file
+ */
+void stats_file_begin(stats_mark *mark);
+
+/**
+ * Account a searched file and print its throughput under --stats
+ */
+void stats_file_end(const stats_mark *mark, const char *filename, uint64_t bytes);
+
+/**
+ * Add the calling thread's counters to the totals, every thread calls this before it exits
+ */
+void stats_flush(void);
+
+/**
+ * Print the totals to stderr, after every other thread has flushed
+ */
+void stats_report(void);
+
+#define STATS_ADD(field, n) (thread_stats.field += (n))
+#define STATS_MAX(field, n) \
+    (thread_stats.field = thread_stats.field > (n) ? thread_stats.field : (n))
+#define STATS_ON()          stats_enabled
+#define STATS_CLOCK()       (stats_enabled ? stats_now() : 0)
+#define STATS_ELAPSED(field, start)                                                            \
+    (stats_enabled ? (void) (thread_stats.field += stats_now() - (start)) : (void) 0)
+#define STATS_FILE_BEGIN(mark)              \
+    stats_mark mark;                        \
+    stats_file_begin(&mark)
+#define STATS_FILE_END(mark, filename, bytes) stats_file_end(&(mark), (filename), (bytes))
+#define STATS_FLUSH()                         stats_flush()
+
+#else
+
+#define STATS_ADD(field, n)                   ((void) 0)
+#define STATS_MAX(field, n)                   ((void) 0)
+#define STATS_ON()                            false
+#define STATS_CLOCK()                         ((uint64_t) 0)
+#define STATS_ELAPSED(field, start)           ((void) (start))
+#define STATS_FILE_BEGIN(mark)                ((void) 0)
+#define STATS_FILE_END(mark, filename, bytes) ((void) (bytes))
+#define STATS_FLUSH()                         ((void) 0)
+
+#endif
+
+#endif
@@ -0,0 +1,617 @@
+#include "walk.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Buffer for one getdents64() call
+#define DIRENT_BUFFER_SIZE (32 * 1024)
+
+// Largest .gitignore file that is read
+#define MAX_IGNORE_FILE_SIZE (1024 * 1024)
+
+/**
+ * Directory entry as returned by the getdents64 system call
+ */
+struct kernel_dirent
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * One line of a .gitignore file
+ */
+typedef struct
+{
+    compiled_pattern glob;
+    bool negate;    // "!glob" re-includes what an earlier rule ignored
+    bool dir_only;  // "glob/" only applies to directories
+    bool anchored;  // contains a '/', matched against the path below the .gitignore directory
+} ignore_rule;
+
+/**
+ * The rules of one .gitignore file, linked to the one of the directory above
+ */
+typedef struct ignore_file ignore_file;
+
+struct ignore_file
+{
+    const ignore_file *parent;
+    size_t base_len;  // length of the path of the directory holding the file
+    ignore_rule *rules;
+    size_t rule_count;
+    ignore_file *next_owned;  // every file read during the walk, for freeing
+};
+
+/**
+ * State shared by every directory task of one walk
+ */
+typedef struct
+{
+    const walk_filters *filters;
+    pool *workers;
+    atomic_bool *stop;
+    atomic_bool *failed;
+    walk_visit_fn visit;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    size_t pending;  // directory tasks queued or running
+    ignore_file *ignore_files;
+} walk_state;
+
+/**
+ * One directory still to be read
+ */
+typedef struct
+{
+    walk_state *walk;
+    char *path;
+    size_t path_len;
+    const ignore_file *ignores;
+} dir_task;
+
+static void walk_directory(walk_state *walk,
+                           const char *path,
+                           size_t path_len,
+                           const ignore_file *ignores);
+
+/**
+ * Compile glob as a -w pattern tied to both ends of the name
+ */
+static bool compile_glob(compiled_pattern *pattern, const char *glob, size_t len)
+{
+    grep_options opts = {0};
+    char *source = malloc(len + 3);
+
+    if (source == NULL)
+    {
+        return false;
+    }
+
+    source[0] = '^';
+    memcpy(source + 1, glob, len);
+    source[len + 1] = '$';
+    source[len + 2] = '\0';
+
+    opts.use_wildcards = true;
+    opts.use_anchors = true;
+
+    bool ok = pattern_compile(pattern, source, &opts);
+    free(source);
+    return ok;
+}
+
+bool walk_add_glob(glob_list *list, const char *glob)
+{
+    if (list->count == list->cap)
+    {
+        size_t cap = list->cap > 0 ? list->cap * 2 : 8;
+        compiled_pattern *items = realloc(list->items, cap * sizeof(*items));
+        if (items == NULL)
+        {
+            return false;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+
+    if (!compile_glob(&list->items[list->count], glob, strlen(glob)))
+    {
+        return false;
+    }
+    list->count++;
+    return true;
+}
+
+static void free_globs(glob_list *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        pattern_free(&list->items[i]);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->cap = 0;
+}
+
+void walk_filters_free(walk_filters *filters)
+{
+    free_globs(&filters->include);
+    free_globs(&filters->exclude);
+    free_globs(&filters->exclude_dir);
+}
+
+static bool any_glob_matches(const glob_list *list, const char *name, size_t len)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (pattern_matches(&list->items[i], name, len))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check the entry name against the --include, --exclude and --exclude-dir globs
+ */
+static bool filtered_out(const walk_filters *filters,
+                         const char *name,
+                         size_t name_len,
+                         bool is_dir)
+{
+    if (is_dir)
+    {
+        return (filters->gitignore && strcmp(name, ".git") == 0)
+               || any_glob_matches(&filters->exclude_dir, name, name_len);
+    }
+
+    if (filters->include.count > 0 && !any_glob_matches(&filters->include, name, name_len))
+    {
+        return true;
+    }
+    return any_glob_matches(&filters->exclude, name, name_len);
+}
+
+/**
+ * Parse one .gitignore line into a rule, returns false for blank lines and comments
+ * Git's "**" is treated as '*', which here also crosses '/', and bracket expressions are
+ * taken literally.
+ */
+static bool parse_ignore_line(ignore_rule *rule, char *line, size_t len)
+{
+    // Trailing spaces are not part of the pattern
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\r'))
+    {
+        len--;
+    }
+    if (len == 0 || line[0] == '#')
+    {
+        return false;
+    }
+
+    rule->negate = line[0] == '!';
+    if (rule->negate || line[0] == '\\')
+    {
+        line++;
+        len--;
+    }
+
+    rule->dir_only = len > 0 && line[len - 1] == '/';
+    if (rule->dir_only)
+    {
+        len--;
+    }
+
+    // A leading "**/" matches in every directory, like no slash at all
+    if (len >= 3 && memcmp(line, "**/", 3) == 0)
+    {
+        line += 3;
+        len -= 3;
+        rule->anchored = memchr(line, '/', len) != NULL;
+    }
+    else
+    {
+        rule->anchored = memchr(line, '/', len) != NULL;
+        if (len > 0 && line[0] == '/')
+        {
+            line++;
+            len--;
+        }
+    }
+
+    // Collapse "**" to '*'
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!(line[i] == '*' && out > 0 && line[out - 1] == '*'))
+        {
+            line[out++] = line[i];
+        }
+    }
+
+    return out > 0 && compile_glob(&rule->glob, line, out);
+}
+
+/**
+ * Read the .gitignore in the directory open at fd, returns NULL if there is none
+ */
+static ignore_file *read_ignore_file(walk_state *walk,
+                                     int fd,
+                                     size_t base_len,
+                                     const ignore_file *parent)
+{
+    int file = openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (file < 0)
+    {
+        return NULL;
+    }
+    if (fstat(file, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > MAX_IGNORE_FILE_SIZE)
+    {
+        close(file);
+        return NULL;
+    }
+
+    size_t size = (size_t) st.st_size;
+    char *text = malloc(size + 1);
+    ignore_file *ignores = calloc(1, sizeof(*ignores));
+    size_t used = 0;
+
+    while (text != NULL && used < size)
+    {
+        ssize_t got = read(file, text + used, size - used);
+        if (got <= 0)
+        {
+            break;
+        }
+        used += (size_t) got;
+    }
+    close(file);
+
+    // At most one rule per line
+    size_t max_rules = 1;
+    for (size_t i = 0; text != NULL && i < used; i++)
+    {
+        max_rules += text[i] == '\n';
+    }
+
+    if (text == NULL || ignores == NULL
+        || (ignores->rules = malloc(max_rules * sizeof(*ignores->rules))) == NULL)
+    {
+        free(text);
+        free(ignores);
+        return NULL;
+    }
+
+    char *line = text;
+    char *end = text + used;
+    while (line < end)
+    {
+        char *newline = memchr(line, '\n', (size_t) (end - line));
+        char *stop = newline != NULL ? newline : end;
+
+        if (parse_ignore_line(&ignores->rules[ignores->rule_count], line, (size_t) (stop - line)))
+        {
+            ignores->rule_count++;
+        }
+        line = stop + 1;
+    }
+    free(text);
+
+    ignores->parent = parent;
+    ignores->base_len = base_len;
+
+    pthread_mutex_lock(&walk->lock);
+    ignores->next_owned = walk->ignore_files;
+    walk->ignore_files = ignores;
+    pthread_mutex_unlock(&walk->lock);
+    return ignores;
+}
+
+/**
+ * Check the .gitignore rules from the innermost directory outwards, the last matching
+ * rule of a file decides
+ */
+static bool is_ignored(const ignore_file *ignores,
+                       const char *path,
+                       size_t path_len,
+                       const char *name,
+                       size_t name_len,
+                       bool is_dir)
+{
+    for (const ignore_file *file = ignores; file != NULL; file = file->parent)
+    {
+        const char *relative = path + file->base_len;
+        relative += *relative == '/';
+        size_t relative_len = path_len - (size_t) (relative - path);
+
+        for (size_t i = file->rule_count; i-- > 0;)
+        {
+            const ignore_rule *rule = &file->rules[i];
+
+            if (rule->dir_only && !is_dir)
+            {
+                continue;
+            }
+
+            bool match = rule->anchored ? pattern_matches(&rule->glob, relative, relative_len)
+                                        : pattern_matches(&rule->glob, name, name_len);
+            if (match)
+            {
+                return !rule->negate;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Pool task: read one directory, queueing its subdirectories the same way
+ */
+static void run_dir_task(void *arg)
+{
+    dir_task *task = arg;
+    walk_state *walk = task->walk;
+
+    walk_directory(walk, task->path, task->path_len, task->ignores);
+    free(task->path);
+    free(task);
+
+    pthread_mutex_lock(&walk->lock);
+    if (--walk->pending == 0)
+    {
+        pthread_cond_broadcast(&walk->finished);
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/**
+ * Enter a subdirectory, on the pool when there is one and recursively otherwise
+ * Takes over path.
+ */
+static void enter_directory(walk_state *walk,
+                            char *path,
+                            size_t path_len,
+                            const ignore_file *ignores)
+{
+    dir_task *task = walk->workers != NULL ? malloc(sizeof(*task)) : NULL;
+
+    if (task == NULL)
+    {
+        walk_directory(walk, path, path_len, ignores);
+        free(path);
+        return;
+    }
+
+    task->walk = walk;
+    task->path = path;
+    task->path_len = path_len;
+    task->ignores = ignores;
+
+    pthread_mutex_lock(&walk->lock);
+    walk->pending++;
+    pthread_mutex_unlock(&walk->lock);
+
+    if (!pool_submit(walk->workers, run_dir_task, task))
+    {
+        run_dir_task(task);
+    }
+}
+
+/**
+ * Read the entries of one directory, visiting its files and entering its subdirectories
+ */
+static void walk_directory(walk_state *walk,
+                           const char *path,
+                           size_t path_len,
+                           const ignore_file *ignores)
+{
+    const walk_filters *filters = walk->filters;
+    int fd = open(path_len > 0 ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Cannot open directory '%s'\n", path_len > 0 ? path : ".");
+        atomic_store(walk->failed, true);
+        return;
+    }
+
+    if (filters->gitignore)
+    {
+        const ignore_file *own = read_ignore_file(walk, fd, path_len, ignores);
+        ignores = own != NULL ? own : ignores;
+    }
+
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory reading directory '%s'\n", path);
+        atomic_store(walk->failed, true);
+        close(fd);
+        return;
+    }
+
+    for (;;)
+    {
+        long got = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE);
+        if (got < 0)
+        {
+            fprintf(stderr, "Error: Cannot read directory '%s'\n", path_len > 0 ? path : ".");
+            atomic_store(walk->failed, true);
+            break;
+        }
+        if (got == 0 || atomic_load(walk->stop))
+        {
+            break;
+        }
+
+        for (long offset = 0; offset < got;)
+        {
+            const struct kernel_dirent *entry = (const struct kernel_dirent *) (buffer + offset);
+            const char *name = entry->d_name;
+            size_t name_len = strlen(name);
+            unsigned char type = entry->d_type;
+
+            offset += entry->d_reclen;
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            {
+                continue;
+            }
+
+            // Some file systems leave the type to a stat call
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            // Symbolic links, devices, sockets and pipes are left alone
+            if (type != DT_DIR && type != DT_REG)
+            {
+                continue;
+            }
+
+            bool is_dir = type == DT_DIR;
+            if (filtered_out(filters, name, name_len, is_dir))
+            {
+                continue;
+            }
+
+            bool separator = path_len > 0 && path[path_len - 1] != '/';
+            size_t child_len = path_len + separator + name_len;
+            char *child = malloc(child_len + 1);
+            if (child == NULL)
+            {
+                fprintf(stderr, "Error: Out of memory reading directory '%s'\n", path);
+                atomic_store(walk->failed, true);
+                continue;
+            }
+            memcpy(child, path, path_len);
+            if (separator)
+            {
+                child[path_len] = '/';
+            }
+            memcpy(child + child_len - name_len, name, name_len + 1);
+
+            if (ignores != NULL && is_ignored(ignores, child, child_len, name, name_len, is_dir))
+            {
+                free(child);
+                continue;
+            }
+
+            if (is_dir)
+            {
+                enter_directory(walk, child, child_len, ignores);
+            }
+            else
+            {
+                walk->visit(walk->arg, child);
+            }
+        }
+    }
+
+    free(buffer);
+    close(fd);
+}
+
+void walk_tree(const char *root,
+               const walk_filters *filters,
+               pool *workers,
+               atomic_bool *stop,
+               atomic_bool *failed,
+               walk_visit_fn visit,
+               void *arg)
+{
+    walk_state walk;
+    size_t root_len = strlen(root);
+
+    walk.filters = filters;
+    walk.workers = workers;
+    walk.stop = stop;
+    walk.failed = failed;
+    walk.visit = visit;
+    walk.arg = arg;
+    walk.pending = 0;
+    walk.ignore_files = NULL;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.finished, NULL);
+
+    // "dir/" and "dir" name their entries the same way
+    while (root_len > 1 && root[root_len - 1] == '/')
+    {
+        root_len--;
+    }
+
+    char *path = malloc(root_len + 1);
+    if (path == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory reading directory '%s'\n", root);
+        atomic_store(failed, true);
+    }
+    else
+    {
+        memcpy(path, root, root_len);
+        path[root_len] = '\0';
+        enter_directory(&walk, path, root_len, NULL);
+    }
+
+    // Help with the queued directories and files while the walk is going
+    for (;;)
+    {
+        pthread_mutex_lock(&walk.lock);
+        bool finished = walk.pending == 0;
+        pthread_mutex_unlock(&walk.lock);
+
+        if (finished)
+        {
+            break;
+        }
+        if (pool_run_one(workers))
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&walk.lock);
+        while (walk.pending > 0)
+        {
+            pthread_cond_wait(&walk.finished, &walk.lock);
+        }
+        pthread_mutex_unlock(&walk.lock);
+    }
+
+    while (walk.ignore_files != NULL)
+    {
+        ignore_file *next = walk.ignore_files->next_owned;
+        for (size_t i = 0; i < walk.ignore_files->rule_count; i++)
+        {
+            pattern_free(&walk.ignore_files->rules[i].glob);
+        }
+        free(walk.ignore_files->rules);
+        free(walk.ignore_files);
+        walk.ignore_files = next;
+    }
+
+    pthread_cond_destroy(&walk.finished);
+    pthread_mutex_destroy(&walk.lock);
+}
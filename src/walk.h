@@ -0,0 +1,65 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pattern.h"
+#include "pool.h"
+
+/**
+ * Base name globs given with --include, --exclude or --exclude-dir
+ */
+typedef struct
+{
+    compiled_pattern *items;
+    size_t count;
+    size_t cap;
+} glob_list;
+
+/**
+ * Which entries a recursive search looks at
+ */
+typedef struct
+{
+    glob_list include;      // when not empty, only files matching one of these are searched
+    glob_list exclude;      // files matching one of these are skipped
+    glob_list exclude_dir;  // directories matching one of these are not entered
+    bool gitignore;         // honor .gitignore files and skip .git directories
+} walk_filters;
+
+/**
+ * Called for every file the walk selects, with a heap-allocated path the callee takes over
+ * With a pool it runs on the worker threads, concurrently.
+ */
+typedef void (*walk_visit_fn)(void *arg, char *path);
+
+/**
+ * Compile glob, matched against whole base names with * and ?, and add it to list
+ * Returns false if memory runs out.
+ */
+bool walk_add_glob(glob_list *list, const char *glob);
+
+/**
+ * Release the compiled globs
+ */
+void walk_filters_free(walk_filters *filters);
+
+/**
+ * Visit every regular file below the directory root, "" standing for the current directory
+ * with paths printed relative to it. Symbolic links are not followed. With a pool each
+ * directory is a task of its own, read with getdents64() and handed to whichever worker is
+ * free; without one the tree is walked depth-first on this thread in directory order. The
+ * walk winds down early once *stop is set, and sets *failed when a directory cannot be read.
+ * Returns after every directory has been read.
+ */
+void walk_tree(const char *root,
+               const walk_filters *filters,
+               pool *workers,
+               atomic_bool *stop,
+               atomic_bool *failed,
+               walk_visit_fn visit,
+               void *arg);
+
+#endif